@@ -0,0 +1,188 @@
+/*
+ * --- Module Description --------------------------------------------------- *
+ */
+/**
+ * \file    bench_claim.c
+ * \author  Artem Yushev
+ * \date    $Date$
+ * \version $Version$
+ *
+ * \brief   Cost of claiming files by the workers. Empty tasks are queued
+ *          the way music_found() queues files with pool_inject(), from
+ *          outside the pool when the main thread scans and from a worker
+ *          when it scans a subdirectory. The time per task is reported for
+ *          1k up to 10M tasks, it fails if the cost of 10M tasks is more
+ *          than CLAIM_SPREAD times the cost of 1k.
+ *          Usage: bench_claim <test directory> [workers]
+ */
+
+
+/*
+ * --- Includes ------------------------------------------------------------- *
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include "encoder.h"
+#include "pool.h"
+#include "util.h"
+
+/*
+ * --- Macro Definitions ---------------------------------------------------- *
+ */
+/* Amounts of tasks go from the first up to the last by a factor of 10 */
+#define CLAIM_FIRST         1000
+#define CLAIM_LAST          10000000
+/* Largest allowed growth of the cost per task from the first to the last */
+#define CLAIM_SPREAD        4.0
+
+/*
+ * --- Type Definitions ----------------------------------------------------- *
+ */
+
+/* Tasks of one run */
+typedef struct st_claimRun
+{
+    st_pool_t*      p_pool;
+    uint32_t        tasks;
+    _Atomic uint32_t done;
+} st_claimRun_t;
+
+/*
+ * --- Local Functions Declaration ------------------------------------------ *
+ */
+
+/**
+ * \brief     Empty task, it only counts itself
+ *
+ * \param     p_ctx         Run
+ * \param     idx           Not used
+ */
+static void __taskNop(void* p_ctx, uint32_t idx);
+
+/**
+ * \brief     Task which queues all the tasks of a run from a worker, like
+ *            a worker scanning a subdirectory
+ *
+ * \param     p_ctx         Run
+ * \param     idx           Not used
+ */
+static void __taskSpawn(void* p_ctx, uint32_t idx);
+
+/**
+ * \brief     Queue and execute the tasks of a run
+ *
+ * \param     p_run         Run
+ * \param     inside        Queue them from a worker, otherwise from outside
+ * \return    Nanoseconds per task, negative for failure
+ */
+static double __claim(st_claimRun_t* p_run, uint8_t inside);
+
+/*
+ * --- Local Functions Definition ------------------------------------------- *
+ */
+static void __taskNop(void* p_ctx, uint32_t idx)
+{
+    st_claimRun_t*  p_run = p_ctx;
+
+    atomic_fetch_add_explicit(&p_run->done, 1, memory_order_relaxed);
+}
+
+static void __taskSpawn(void* p_ctx, uint32_t idx)
+{
+    st_claimRun_t*  p_run = p_ctx;
+
+    for (uint32_t i = 0; i < p_run->tasks; i++)
+        if (pool_inject(p_run->p_pool, __taskNop, p_run, i) < 0)
+            break;
+}
+
+static double __claim(st_claimRun_t* p_run, uint8_t inside)
+{
+    uint64_t        start = 0;
+    uint64_t        spent = 0;
+
+    atomic_store(&p_run->done, 0);
+
+    start = util_nsec();
+    if (inside)
+        pool_inject(p_run->p_pool, __taskSpawn, p_run, 0);
+    else
+        for (uint32_t i = 0; i < p_run->tasks; i++)
+            if (pool_inject(p_run->p_pool, __taskNop, p_run, i) < 0)
+                break;
+    pool_wait(p_run->p_pool);
+    spent = util_nsec() - start;
+
+    if (atomic_load(&p_run->done) != p_run->tasks)
+        return (-1);
+
+    return ((double) spent / p_run->tasks);
+}
+
+/*
+ * --- Global Functions Definition ------------------------------------------ *
+ */
+
+int main(int argc, char* argv[])
+{
+    st_claimRun_t   run;
+    long            cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t        workers = (cpus > 0) ? cpus : 1;
+    double          outside = 0;
+    double          inside = 0;
+    double          firstOutside = 0;
+    double          firstInside = 0;
+    int             ret = 0;
+
+    if (argc > 2)
+        workers = strtoul(argv[2], NULL, 10);
+    if (workers == 0)
+        workers = 1;
+
+    run.p_pool = pool_create(workers, NULL, 0, NULL, NULL);
+    if (run.p_pool == NULL)
+    {
+        fprintf(stderr, "Failed to create a pool of %lu workers\n", workers);
+        return (1);
+    }
+
+    /* Workers are woken up and the queues are grown once before measuring */
+    run.tasks = CLAIM_FIRST;
+    __claim(&run, 0);
+    __claim(&run, 1);
+
+    printf("Claim cost, %lu workers\n", workers);
+    printf("%10s %14s %14s\n", "tasks", "outside ns", "worker ns");
+    for (run.tasks = CLAIM_FIRST; run.tasks <= CLAIM_LAST; run.tasks *= 10)
+    {
+        outside = __claim(&run, 0);
+        inside = __claim(&run, 1);
+        if ((outside < 0) || (inside < 0))
+        {
+            fprintf(stderr, "%lu tasks: not all of them were executed\n", run.tasks);
+            pool_destroy(run.p_pool);
+            return (1);
+        }
+        printf("%10lu %14.1f %14.1f\n", run.tasks, outside, inside);
+
+        if (run.tasks == CLAIM_FIRST)
+        {
+            firstOutside = outside;
+            firstInside = inside;
+        }
+    }
+    printf("Growth of the cost from %lu to %lu tasks: outside %.2fx, worker %.2fx\n",
+           CLAIM_FIRST, CLAIM_LAST, outside / firstOutside, inside / firstInside);
+
+    if ((outside > CLAIM_SPREAD * firstOutside) || (inside > CLAIM_SPREAD * firstInside))
+    {
+        fprintf(stderr, "The cost per task grew more than %.1fx\n", CLAIM_SPREAD);
+        ret = 1;
+    }
+
+    pool_destroy(run.p_pool);
+    return (ret);
+}
@@ -0,0 +1,245 @@
+/*
+ * --- Module Description --------------------------------------------------- *
+ */
+/**
+ * \file    bench_setup.c
+ * \author  Artem Yushev
+ * \date    $Date$
+ * \version $Version$
+ *
+ * \brief   Setup cost of the encoder on the small files of the test
+ *          directory. For each file the whole conversion is timed against
+ *          the setup of a LAME instance and of an exception context, the
+ *          latter is what workers save by keeping their context.
+ *          Usage: bench_setup <test directory>
+ */
+
+
+/*
+ * --- Includes ------------------------------------------------------------- *
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "lame.h"
+#include "encoder.h"
+#include "os.h"
+#include "pool.h"
+#include "music.h"
+#include "e4c.h"
+#include "util.h"
+
+/*
+ * --- Macro Definitions ---------------------------------------------------- *
+ */
+/* Each file is converted this many times */
+#define SETUP_REPEAT        10
+/* Setup alone is repeated this many times */
+#define SETUP_INIT_REPEAT   200
+
+/*
+ * --- Local Functions Declaration ------------------------------------------ *
+ */
+
+/**
+ * \brief     Time to create and initialize a LAME instance the way the
+ *            encoder does for a file, and to close it
+ *
+ * \param     p_wave        Format of the file
+ * \return    Nanoseconds per instance, 0 for failure
+ */
+static uint64_t __setupLame(const st_utilWave_t* p_wave);
+
+/**
+ * \brief     Time to begin and end an exception context
+ *
+ * \return    Nanoseconds per context
+ */
+static uint64_t __setupCtx(void);
+
+/**
+ * \brief     Time to convert a file completely
+ *
+ * \param     p_dir         Directories of the input and the output
+ * \param     p_name        Name of the file
+ * \param     fsize         Size of the file
+ * \return    Nanoseconds per conversion, 0 for failure
+ */
+static uint64_t __convert(st_encDir_t* p_dir, char* p_name, uint64_t fsize);
+
+/*
+ * --- Local Functions Definition ------------------------------------------- *
+ */
+static uint64_t __setupLame(const st_utilWave_t* p_wave)
+{
+    uint64_t    start = util_nsec();
+    lame_t      p_lame = NULL;
+
+    for (uint32_t i = 0; i < SETUP_INIT_REPEAT; i++)
+    {
+        p_lame = lame_init();
+        if (p_lame == NULL)
+            return (0);
+        lame_set_num_channels(p_lame, p_wave->channels);
+        lame_set_in_samplerate(p_lame, p_wave->sampleRate);
+        lame_set_num_samples(p_lame, p_wave->len / (p_wave->bps * p_wave->channels));
+        lame_set_VBR(p_lame, vbr_default);
+        lame_set_write_id3tag_automatic(p_lame, 0);
+        if (lame_init_params(p_lame) < 0)
+        {
+            lame_close(p_lame);
+            return (0);
+        }
+        lame_close(p_lame);
+    }
+
+    return ((util_nsec() - start) / SETUP_INIT_REPEAT);
+}
+
+static uint64_t __setupCtx(void)
+{
+    uint64_t    start = util_nsec();
+
+    for (uint32_t i = 0; i < SETUP_INIT_REPEAT; i++)
+    {
+        e4c_context_begin(E4C_TRUE);
+        e4c_context_end();
+    }
+
+    return ((util_nsec() - start) / SETUP_INIT_REPEAT);
+}
+
+static uint64_t __convert(st_encDir_t* p_dir, char* p_name, uint64_t fsize)
+{
+    st_encOpts_t    opts;
+    st_encFDesc_t   fdesc;
+    uint64_t        start = 0;
+    uint64_t        spent = 0;
+    int             out = dup(STDOUT_FILENO);
+    int             null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    int8_t          ret = 0;
+
+    /* Reports of the encoder are not timed */
+    fflush(stdout);
+    if ((out >= 0) && (null >= 0))
+        dup2(null, STDOUT_FILENO);
+
+    memset(&opts, 0, sizeof(opts));
+    start = util_nsec();
+    for (uint32_t i = 0; (ret >= 0) && (i < SETUP_REPEAT); i++)
+    {
+        /* The header is parsed by the conversion as for files not probed */
+        memset(&fdesc, 0, sizeof(fdesc));
+        fdesc.p_fname = p_name;
+        fdesc.p_dir = p_dir;
+        fdesc.fsize = fsize;
+        fdesc.probe = en_probe_none;
+        ret = music_procFile(&fdesc, &opts);
+    }
+    spent = util_nsec() - start;
+
+    fflush(stdout);
+    if ((out >= 0) && (null >= 0))
+        dup2(out, STDOUT_FILENO);
+    if (out >= 0)
+        close(out);
+    if (null >= 0)
+        close(null);
+
+    return ((ret < 0) ? 0 : spent / SETUP_REPEAT);
+}
+
+/*
+ * --- Global Functions Definition ------------------------------------------ *
+ */
+
+int main(int argc, char* argv[])
+{
+    char            p_tmp[PATH_MAX];
+    char            p_path[PATH_MAX];
+    st_encDir_t     dir;
+    st_utilWave_t   wave;
+    struct stat     st;
+    char**          pp_names = NULL;
+    int32_t         files = 0;
+    uint64_t        ctx = 0;
+    uint64_t        lame = 0;
+    uint64_t        conv = 0;
+    uint64_t        sumLame = 0;
+    uint64_t        sumConv = 0;
+    uint32_t        errs = 0;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <test directory>\n", argv[0]);
+        return (2);
+    }
+
+    os_splitFlopInit();
+
+    files = util_waveList(argv[1], &pp_names);
+    if (files <= 0)
+    {
+        fprintf(stderr, "No WAVE files in %s\n", argv[1]);
+        return (2);
+    }
+    if ((util_tempDir(p_tmp) < 0) || (util_dirOpen(&dir, argv[1], p_tmp) < 0))
+    {
+        fprintf(stderr, "Failed to create a directory for outputs\n");
+        util_listFree(pp_names, files);
+        return (1);
+    }
+
+    /* Measured before the worker context exists */
+    ctx = __setupCtx();
+    music_workerEnter(0);
+
+    printf("%-16s %10s %12s %10s %8s %8s\n",
+           "file", "frames", "convert us", "lame us", "lame %", "ctx %");
+    for (int32_t i = 0; i < files; i++)
+    {
+        snprintf(p_path, sizeof(p_path), "%s/%s", argv[1], pp_names[i]);
+        if ((stat(p_path, &st) != 0) || (util_waveLoad(argv[1], pp_names[i], &wave) < 0))
+        {
+            fprintf(stderr, "[%s] Failed to load\n", pp_names[i]);
+            errs++;
+            continue;
+        }
+
+        lame = __setupLame(&wave);
+        conv = __convert(&dir, pp_names[i], st.st_size);
+        if ((lame == 0) || (conv == 0))
+        {
+            fprintf(stderr, "[%s] Failed to convert\n", pp_names[i]);
+            errs++;
+        }
+        else
+        {
+            printf("%-16s %10lu %12.1f %10.1f %8.2f %8.3f\n", pp_names[i],
+                   wave.len / (wave.bps * wave.channels), conv / 1e3, lame / 1e3,
+                   100.0 * lame / conv, 100.0 * ctx / conv);
+            sumLame += lame;
+            sumConv += conv;
+        }
+        util_waveFree(&wave);
+    }
+
+    music_workerLeave(0);
+
+    if (sumConv != 0)
+        printf("Setup of LAME takes %.2f%% of the conversion, "
+               "an exception context per file would take %.3f%% (%.1f us)\n",
+               100.0 * sumLame / sumConv, 100.0 * ctx * (files - errs) / sumConv, ctx / 1e3);
+
+    util_dirClose(&dir);
+    util_tempRemove(p_tmp);
+    util_listFree(pp_names, files);
+
+    return (errs ? 1 : 0);
+}
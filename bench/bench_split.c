@@ -0,0 +1,246 @@
+/*
+ * --- Module Description --------------------------------------------------- *
+ */
+/**
+ * \file    bench_split.c
+ * \author  Artem Yushev
+ * \date    $Date$
+ * \version $Version$
+ *
+ * \brief   Throughput of the sample converters on every format of the test
+ *          directory. The generic path, which dispatches on the sample
+ *          size for every block and checks the channels for every sample,
+ *          is compared with the converters specialized per format.
+ *          Usage: bench_split <test directory>
+ */
+
+
+/*
+ * --- Includes ------------------------------------------------------------- *
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "encoder.h"
+#include "os.h"
+#include "util.h"
+
+/*
+ * --- Macro Definitions ---------------------------------------------------- *
+ */
+/* Frames converted at once */
+#define SPLIT_BLOCK         8192
+/* Input bytes converted per file and converter */
+#define SPLIT_BYTES         (64 * 1024 * 1024)
+
+/* Generic loop over a block as it was before converters were specialized,
+ * both channels are checked for every sample */
+#define SPLIT_GENERIC(name, bps, val)                                         \
+static void name(const uint8_t* p_from, int32_t* p_fir, int32_t* p_sec,       \
+                 uint32_t size)                                               \
+{                                                                             \
+    const uint8_t*  p = p_from;                                               \
+    uint32_t        step = (p_sec != NULL) ? 2 * (bps) : (bps);               \
+                                                                              \
+    for (uint32_t i = 0; (i + step) <= size; i += step)                       \
+    {                                                                         \
+        p = p_from + i;                                                       \
+        if (p_fir != NULL)                                                    \
+            *p_fir++ = (int32_t) (val);                                       \
+        p += (bps);                                                           \
+        if (p_sec != NULL)                                                    \
+            *p_sec++ = (int32_t) (val);                                       \
+    }                                                                         \
+}
+
+/*
+ * --- Type Definitions ----------------------------------------------------- *
+ */
+
+/* Converter of a block, the format is passed for the generic one only */
+typedef void (*split_fn_t)(os_splitFlop_t p_fn, uint8_t* p_from, int32_t* p_fir,
+                           int32_t* p_sec, uint32_t size, uint8_t bps);
+
+/*
+ * --- Local Functions Declaration ------------------------------------------ *
+ */
+
+/**
+ * \brief     Generic loops of each sample size
+ */
+SPLIT_GENERIC(__genericUI8, 1, (uint32_t) (p[0] ^ 0x80) << 24)
+SPLIT_GENERIC(__genericI16, 2, (uint32_t) p[1] << 24 | p[0] << 16)
+SPLIT_GENERIC(__genericI24, 3, (uint32_t) p[2] << 24 | p[1] << 16 | p[0] << 8)
+SPLIT_GENERIC(__genericI32, 4, (uint32_t) p[3] << 24 | p[2] << 16 | p[1] << 8 | p[0])
+
+/**
+ * \brief     Convert a block choosing the loop by the sample size, as it
+ *            was done for every block before converters were specialized
+ *
+ * \param     p_fn          Not used
+ * \param     p_from        Samples
+ * \param     p_fir         First channel
+ * \param     p_sec         Second channel, NULL for mono
+ * \param     size          Size of samples in bytes
+ * \param     bps           Bytes per sample
+ */
+static void __splitGeneric(os_splitFlop_t p_fn, uint8_t* p_from, int32_t* p_fir,
+                           int32_t* p_sec, uint32_t size, uint8_t bps);
+
+/**
+ * \brief     Convert a block with the converter chosen for the file
+ */
+static void __splitBound(os_splitFlop_t p_fn, uint8_t* p_from, int32_t* p_fir,
+                         int32_t* p_sec, uint32_t size, uint8_t bps);
+
+/**
+ * \brief     Convert the samples of a file in blocks repeatedly
+ *
+ * \param     p_wave        Loaded file
+ * \param     p_split       Way to convert a block
+ * \param     p_fn          Converter for the file
+ * \param     p_fir         First channel buffer of SPLIT_BLOCK samples
+ * \param     p_sec         Second channel buffer of the same length
+ * \return    Throughput in MB of input per second
+ */
+static double __throughput(const st_utilWave_t* p_wave, split_fn_t p_split,
+                           os_splitFlop_t p_fn, int32_t* p_fir, int32_t* p_sec);
+
+/*
+ * --- Local Functions Definition ------------------------------------------- *
+ */
+static void __splitGeneric(os_splitFlop_t p_fn, uint8_t* p_from, int32_t* p_fir,
+                           int32_t* p_sec, uint32_t size, uint8_t bps)
+{
+    switch (bps)
+    {
+    case 1:
+        __genericUI8(p_from, p_fir, p_sec, size);
+        break;
+    case 2:
+        __genericI16(p_from, p_fir, p_sec, size);
+        break;
+    case 3:
+        __genericI24(p_from, p_fir, p_sec, size);
+        break;
+    case 4:
+        __genericI32(p_from, p_fir, p_sec, size);
+        break;
+    }
+}
+
+static void __splitBound(os_splitFlop_t p_fn, uint8_t* p_from, int32_t* p_fir,
+                         int32_t* p_sec, uint32_t size, uint8_t bps)
+{
+    p_fn(p_from, p_fir, p_sec, size);
+}
+
+static double __throughput(const st_utilWave_t* p_wave, split_fn_t p_split,
+                           os_splitFlop_t p_fn, int32_t* p_fir, int32_t* p_sec)
+{
+    uint32_t    frameBytes = p_wave->bps * p_wave->channels;
+    uint32_t    block = SPLIT_BLOCK * frameBytes;
+    uint32_t    size = 0;
+    uint64_t    total = 0;
+    uint64_t    start = util_nsec();
+    int32_t*    p_to = (p_wave->channels == 2) ? p_sec : NULL;
+
+    while (total < SPLIT_BYTES)
+    {
+        for (uint32_t off = 0; off < p_wave->len; off += size)
+        {
+            size = ((p_wave->len - off) < block) ? (p_wave->len - off) : block;
+            p_split(p_fn, p_wave->p_data + off, p_fir, p_to, size, p_wave->bps);
+        }
+        total += p_wave->len;
+    }
+
+    return (total / 1e6 / ((util_nsec() - start) / 1e9));
+}
+
+/*
+ * --- Global Functions Definition ------------------------------------------ *
+ */
+
+int main(int argc, char* argv[])
+{
+    static const char* const names[en_split_impls] = { "scalar", "sse2", "avx2" };
+    st_utilWave_t   wave;
+    char**          pp_names = NULL;
+    int32_t*        p_fir = malloc(SPLIT_BLOCK * sizeof(int32_t));
+    int32_t*        p_sec = malloc(SPLIT_BLOCK * sizeof(int32_t));
+    os_splitFlop_t  p_fn = NULL;
+    int32_t         files = 0;
+    double          generic = 0;
+    double          rate = 0;
+    uint32_t        errs = 0;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <test directory>\n", argv[0]);
+        return (2);
+    }
+    if ((p_fir == NULL) || (p_sec == NULL))
+    {
+        fprintf(stderr, "Failed to allocate buffers\n");
+        return (1);
+    }
+
+    os_splitFlopInit();
+
+    files = util_waveList(argv[1], &pp_names);
+    if (files <= 0)
+    {
+        fprintf(stderr, "No WAVE files in %s\n", argv[1]);
+        return (2);
+    }
+
+    printf("MB/s of input, speedup over the generic path in brackets\n");
+    printf("%-16s %10s", "file", "generic");
+    for (uint32_t impl = 0; impl < en_split_impls; impl++)
+        printf(" %17s", names[impl]);
+    printf(" %17s\n", "selected");
+
+    for (int32_t i = 0; i < files; i++)
+    {
+        if (util_waveLoad(argv[1], pp_names[i], &wave) < 0)
+        {
+            fprintf(stderr, "[%s] Failed to load\n", pp_names[i]);
+            errs++;
+            continue;
+        }
+        /* Float samples don't go through the converters */
+        if (wave.isFloat || (wave.bps > 4) || (wave.channels > 2) || (wave.len == 0))
+        {
+            util_waveFree(&wave);
+            continue;
+        }
+
+        generic = __throughput(&wave, __splitGeneric, NULL, p_fir, p_sec);
+        printf("%-16s %10.1f", pp_names[i], generic);
+        for (uint32_t impl = 0; impl < en_split_impls; impl++)
+        {
+            p_fn = os_splitFlopImpl(impl, wave.bps, wave.channels);
+            if (p_fn == NULL)
+            {
+                printf(" %17s", "-");
+                continue;
+            }
+            rate = __throughput(&wave, __splitBound, p_fn, p_fir, p_sec);
+            printf(" %8.1f (%5.2fx)", rate, rate / generic);
+        }
+        p_fn = os_splitFlopGet(wave.bps, wave.channels);
+        rate = __throughput(&wave, __splitBound, p_fn, p_fir, p_sec);
+        printf(" %8.1f (%5.2fx)\n", rate, rate / generic);
+
+        util_waveFree(&wave);
+    }
+
+    util_listFree(pp_names, files);
+    free(p_fir);
+    free(p_sec);
+
+    return (errs ? 1 : 0);
+}
@@ -0,0 +1,377 @@
+/*
+ * --- Module Description --------------------------------------------------- *
+ */
+/**
+ * \file    cache.c
+ * \author  Artem Yushev
+ * \date    $Date$
+ * \version $Version$
+ *
+ * \brief   Content-addressed cache of encoded files
+ */
+
+
+/*
+ * --- Includes ------------------------------------------------------------- *
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "encoder.h"
+#include "os.h"
+#include "cache.h"
+
+/*
+ * --- Macro Definitions ---------------------------------------------------- *
+ */
+/* Bump if the output for the same samples and settings changes */
+#define   CACHE_VERSION                 2
+/* Samples are hashed in blocks of this size */
+#define   CACHE_BLOCK                   (64 * 1024)
+
+/* XXH64 primes */
+#define   XXH_P1                        11400714785074694791ULL
+#define   XXH_P2                        14029467366897019727ULL
+#define   XXH_P3                        1609587929392839161ULL
+#define   XXH_P4                        9650029242287828579ULL
+#define   XXH_P5                        2870177450012600261ULL
+
+
+/*
+ * --- Type Definitions ----------------------------------------------------- *
+ */
+
+/* Streaming XXH64 state */
+typedef struct st_cacheHash
+{
+    uint64_t        acc[4];
+    uint64_t        total;
+    uint8_t         mem[32];
+    uint32_t        memSize;
+} st_cacheHash_t;
+
+/* Format and settings which are hashed before the samples */
+typedef struct st_cacheHead
+{
+    uint64_t        dataLength;
+    uint32_t        version;
+    uint32_t        sampleRate;
+    uint32_t        segLength;
+    uint16_t        channels;
+    uint8_t         bps;
+    uint8_t         isFloat;
+} st_cacheHead_t;
+
+struct st_cache
+{
+    char            p_dir[MAX_FILEPATH];
+    _Atomic uint64_t hits;
+    _Atomic uint64_t misses;
+    _Atomic uint64_t stored;
+};
+
+/**
+ * \brief     Start a hash
+ *
+ * \param     p_hash        Hash state
+ * \param     seed          Seed value
+ * \return    Nothing
+ */
+static void __hashInit(st_cacheHash_t* p_hash, uint64_t seed);
+
+/**
+ * \brief     Add data to a hash
+ *
+ * \param     p_hash        Hash state
+ * \param     p_data        Data
+ * \param     len           Length of data
+ * \return    Nothing
+ */
+static void __hashUpdate(st_cacheHash_t* p_hash, const uint8_t* p_data, size_t len);
+
+/**
+ * \brief     Finish a hash
+ *
+ * \param     p_hash        Hash state
+ * \return    Hash value
+ */
+static uint64_t __hashDigest(const st_cacheHash_t* p_hash);
+
+/**
+ * \brief     Build the path of a stored output
+ *
+ * \param     p_cache       Cache
+ * \param     key           Key of the input
+ * \param     p_path        String where to store result, MAX_FILEPATH long
+ * \return    Nothing
+ */
+static void __entryPath(const st_cache_t* p_cache, uint64_t key, char* p_path);
+
+/*
+ * --- Local Functions Definition ------------------------------------------- *
+ */
+static inline uint64_t __rotl64(uint64_t x, uint8_t r)
+{
+    return ((x << r) | (x >> (64 - r)));
+}
+
+static inline uint64_t __read64(const uint8_t* p_data)
+{
+    uint64_t    u64;
+
+    memcpy(&u64, p_data, sizeof(u64));
+    return (u64);
+}
+
+static inline uint32_t __read32(const uint8_t* p_data)
+{
+    uint32_t    u32;
+
+    memcpy(&u32, p_data, sizeof(u32));
+    return (u32);
+}
+
+static inline uint64_t __hashRound(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_P2;
+    acc = __rotl64(acc, 31);
+    return (acc * XXH_P1);
+}
+
+static inline uint64_t __hashMerge(uint64_t acc, uint64_t val)
+{
+    acc ^= __hashRound(0, val);
+    return (acc * XXH_P1 + XXH_P4);
+}
+
+static void __hashInit(st_cacheHash_t* p_hash, uint64_t seed)
+{
+    memset(p_hash, 0, sizeof(st_cacheHash_t));
+    p_hash->acc[0] = seed + XXH_P1 + XXH_P2;
+    p_hash->acc[1] = seed + XXH_P2;
+    p_hash->acc[2] = seed;
+    p_hash->acc[3] = seed - XXH_P1;
+}
+
+static void __hashUpdate(st_cacheHash_t* p_hash, const uint8_t* p_data, size_t len)
+{
+    const uint8_t*  p_end = p_data + len;
+    uint32_t        fill = 0;
+
+    p_hash->total += len;
+
+    /* Not enough for a stripe yet */
+    if (p_hash->memSize + len < 32)
+    {
+        memcpy(p_hash->mem + p_hash->memSize, p_data, len);
+        p_hash->memSize += len;
+        return;
+    }
+
+    /* Complete the buffered stripe first */
+    if (p_hash->memSize > 0)
+    {
+        fill = 32 - p_hash->memSize;
+        memcpy(p_hash->mem + p_hash->memSize, p_data, fill);
+        for (int i = 0; i < 4; i++)
+            p_hash->acc[i] = __hashRound(p_hash->acc[i], __read64(p_hash->mem + i * 8));
+        p_data += fill;
+        p_hash->memSize = 0;
+    }
+
+    while (p_data + 32 <= p_end)
+    {
+        p_hash->acc[0] = __hashRound(p_hash->acc[0], __read64(p_data));
+        p_hash->acc[1] = __hashRound(p_hash->acc[1], __read64(p_data + 8));
+        p_hash->acc[2] = __hashRound(p_hash->acc[2], __read64(p_data + 16));
+        p_hash->acc[3] = __hashRound(p_hash->acc[3], __read64(p_data + 24));
+        p_data += 32;
+    }
+
+    p_hash->memSize = p_end - p_data;
+    memcpy(p_hash->mem, p_data, p_hash->memSize);
+}
+
+static uint64_t __hashDigest(const st_cacheHash_t* p_hash)
+{
+    const uint8_t*  p_data = p_hash->mem;
+    const uint8_t*  p_end = p_hash->mem + p_hash->memSize;
+    uint64_t        h = 0;
+
+    if (p_hash->total >= 32)
+    {
+        h = __rotl64(p_hash->acc[0], 1) + __rotl64(p_hash->acc[1], 7) +
+            __rotl64(p_hash->acc[2], 12) + __rotl64(p_hash->acc[3], 18);
+        for (int i = 0; i < 4; i++)
+            h = __hashMerge(h, p_hash->acc[i]);
+    }
+    else
+    {
+        /* acc[2] holds the seed as is */
+        h = p_hash->acc[2] + XXH_P5;
+    }
+    h += p_hash->total;
+
+    for (; p_data + 8 <= p_end; p_data += 8)
+    {
+        h ^= __hashRound(0, __read64(p_data));
+        h = __rotl64(h, 27) * XXH_P1 + XXH_P4;
+    }
+    if (p_data + 4 <= p_end)
+    {
+        h ^= (uint64_t) __read32(p_data) * XXH_P1;
+        h = __rotl64(h, 23) * XXH_P2 + XXH_P3;
+        p_data += 4;
+    }
+    for (; p_data < p_end; p_data++)
+    {
+        h ^= (*p_data) * XXH_P5;
+        h = __rotl64(h, 11) * XXH_P1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+
+    return (h);
+}
+
+static void __entryPath(const st_cache_t* p_cache, uint64_t key, char* p_path)
+{
+    char        p_name[32];
+
+    snprintf(p_name, sizeof(p_name), "%016llx.mp3", (unsigned long long) key);
+    os_mkPath(p_path, (char*) p_cache->p_dir, p_name, MAX_FILEPATH);
+}
+
+/*
+ * --- Global Functions Definition ------------------------------------------ *
+ */
+st_cache_t* cache_open(const char* p_dir)
+{
+    assert(p_dir != NULL);
+
+    st_cache_t*     p_cache = NULL;
+
+    if ((strlen(p_dir) + 32) >= MAX_FILEPATH)
+    {
+        fprintf(stderr, "Cache directory path is too long.\n");
+        return (NULL);
+    }
+    if (os_mkDir(p_dir) < 0)
+    {
+        fprintf(stderr, "Failed to create the cache directory.\n");
+        return (NULL);
+    }
+
+    p_cache = calloc(1, sizeof(st_cache_t));
+    if (p_cache == NULL)
+        return (NULL);
+    strcpy(p_cache->p_dir, p_dir);
+
+    return (p_cache);
+}
+
+uint64_t cache_key(st_encoder_t* p_in, const st_encOpts_t* p_opts)
+{
+    assert(p_in != NULL);
+    assert(p_opts != NULL);
+
+    st_cacheHash_t  hash;
+    st_cacheHead_t  head;
+    uint8_t*        p_buf = NULL;
+    uint64_t        left = p_in->dataLength;
+    size_t          len = 0;
+    uint64_t        key = 0;
+
+    p_buf = malloc(CACHE_BLOCK);
+    if (p_buf == NULL)
+        return (0);
+
+    /* Samples are only equal if they are read the same way */
+    memset(&head, 0, sizeof(head));
+    head.version = CACHE_VERSION;
+    head.sampleRate = p_in->sampleRate;
+    head.dataLength = p_in->dataLength;
+    head.segLength = p_opts->segLength;
+    head.channels = p_in->channels;
+    head.bps = p_in->bps;
+    head.isFloat = p_in->isFloat;
+
+    __hashInit(&hash, 0);
+    __hashUpdate(&hash, (const uint8_t*) &head, sizeof(head));
+    while (left > 0)
+    {
+        len = fread(p_buf, 1, (left < CACHE_BLOCK) ? left : CACHE_BLOCK, p_in->p_fp);
+        if (len == 0)
+            break;
+        __hashUpdate(&hash, p_buf, len);
+        left -= len;
+    }
+    free(p_buf);
+
+    /* Truncated files are not cached */
+    if (left > 0)
+        return (0);
+
+    /* 0 stands for no key */
+    key = __hashDigest(&hash);
+    return ((key != 0) ? key : 1);
+}
+
+int8_t cache_fetch(st_cache_t* p_cache, uint64_t key, const st_encDir_t* p_dir,
+                   const char* p_out)
+{
+    assert(p_cache != NULL);
+    assert(p_out != NULL);
+
+    char        p_entry[MAX_FILEPATH];
+
+    __entryPath(p_cache, key, p_entry);
+    if (os_fLink(NULL, p_entry, p_dir, p_out) < 0)
+    {
+        atomic_fetch_add_explicit(&p_cache->misses, 1, memory_order_relaxed);
+        return (-1);
+    }
+
+    atomic_fetch_add_explicit(&p_cache->hits, 1, memory_order_relaxed);
+    return (0);
+}
+
+int8_t cache_store(st_cache_t* p_cache, uint64_t key, const st_encDir_t* p_dir,
+                   const char* p_out)
+{
+    assert(p_cache != NULL);
+    assert(p_out != NULL);
+
+    char        p_entry[MAX_FILEPATH];
+
+    __entryPath(p_cache, key, p_entry);
+    if (os_fLink(p_dir, p_out, NULL, p_entry) < 0)
+    {
+        fprintf(stderr, "Failed to store [%s] in the cache.\n", p_out);
+        return (-1);
+    }
+
+    atomic_fetch_add_explicit(&p_cache->stored, 1, memory_order_relaxed);
+    return (0);
+}
+
+void cache_report(st_cache_t* p_cache)
+{
+    assert(p_cache != NULL);
+
+    printf("Cache: %lu hits, %lu misses, %lu stored\n",
+           atomic_load(&p_cache->hits), atomic_load(&p_cache->misses),
+           atomic_load(&p_cache->stored));
+}
+
+void cache_close(st_cache_t* p_cache)
+{
+    free(p_cache);
+}
@@ -26,6 +26,12 @@
 #include "e4c.h"
 /* OS dependent functions */
 #include "os.h"
+/* Pool of worker threads */
+#include "pool.h"
+/* State of previous runs for the incremental mode */
+#include "state.h"
+/* Content-addressed cache of encoded files */
+#include "cache.h"
 /* Music dependent functions */
 #include "music.h"
 /*
@@ -55,46 +61,154 @@ typedef enum en_encoderFSM {
 
 int main(int argc, char* argv[])
 {
-    pthread_t       threads[MAX_THREADS] = {0};
-    st_encArg_t    tArgs = {.p_fdesc = NULL,
+    st_pool_t*      p_pool = NULL;
+    /* CPUs to pin workers to if pinning is enabled */
+    uint32_t*       p_cpus = NULL;
+    uint32_t        cpus = 0;
+    /* Pin workers to CPUs, to physical cores only unless smt is set */
+    uint8_t         pin = 0;
+    uint8_t         smt = 0;
+    /* Skip files which are up to date since the previous run */
+    uint8_t         incremental = 0;
+    /* Directory of the encode cache, NULL if it's disabled */
+    char*           p_cacheDir = NULL;
+    /* Durability of written outputs */
+    en_encSync_t    sync = en_sync_none;
+    st_encArg_t    tArgs = {.pp_fdesc = NULL,
                              .files = 0,
+                             .sched = en_sched_fifo,
+                             .opts = {.blockSize = 0, .segLength = 0, .pipeDepth = 0,
+                                      .p_cache = NULL},
                              .p_trgPath = NULL,
-                             .threadID = 0};
-    pthread_attr_t  attr;
-    int             ret;
+                             .p_outPath = NULL,
+                             .p_dirs = NULL,
+                             .p_state = NULL,
+                             .skipped = 0,
+                             .p_pool = NULL};
     int             i;
-    uint8_t         activeThreads = 0;
-    /* Let a user to define maxThreads value*/
-    uint16_t        maxThreads = MAX_THREADS;
-
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+    /* Let a user to define maxThreads value, 0 - as much as CPUs available */
+    uint32_t        maxThreads = 0;
 
     if (argc < 2)
     {
         fprintf(stderr, "Error: Specify a directory with input files\n"
-                "Usage: %s [-th] PATH \n"
+                "Usage: %s [-tbspqaicodh] PATH \n"
                 "Options:\n"
-                "        -t  N  Specifies how much threads the application should use \n"
+                "        -t  N  Specifies how much threads the application should use, \n"
+                "               0 (default) uses all available CPUs \n"
+                "        -b  N  Size of input data processed at once in bytes, \n"
+                "               0 (default) chooses it automatically \n"
+                "        -s  N  Split long files into segments of N seconds \n"
+                "               encoded in parallel, 0 (default) disables it \n"
+                "        -p  P  Order of files: fifo (default), largest, smallest \n"
+                "        -q  N  Read and write on own threads with queues of N blocks, \n"
+                "               0 (default) disables it \n"
+                "        -a  M  Pin threads: none (default), core, thread \n"
+                "        -i     Skip files converted by a previous run \n"
+                "        -c  D  Reuse outputs of identical inputs cached in D \n"
+                "        -o  D  Write outputs to a mirror of the input tree in D \n"
+                "        -d  M  Sync outputs: none (default), file, group \n"
                 "        -h     This help\n", argv[0]);
         exit(-1);
     }
 
     while (optind < argc)
     {
-        if ((i = getopt(argc, argv, "ht:")) != -1) {
+        if ((i = getopt(argc, argv, "ht:b:s:p:q:a:ic:o:d:")) != -1) {
             switch (i) {
                 case 'h':
                     fprintf(stderr, "Sound encoder usage:\n"
-                                    "-t    Specifies how much threads the application should use \n"
+                                    "-t    Specifies how much threads the application should use, \n"
+                                    "      0 (default) uses all CPUs allowed by affinity and cgroup quota \n"
+                                    "-b    Size of input data processed at once in bytes, \n"
+                                    "      0 (default) chooses it automatically \n"
+                                    "-s    Split long files into segments of N seconds \n"
+                                    "      encoded in parallel, 0 (default) disables it \n"
+                                    "-p    Order of files: fifo (default) keeps directory order, \n"
+                                    "      largest first shortens the whole run, \n"
+                                    "      smallest first finishes the most files early \n"
+                                    "-q    Read and write on own threads with queues of N blocks, \n"
+                                    "      0 (default) disables it \n"
+                                    "-a    Pin threads to CPUs: none (default) lets them float, \n"
+                                    "      core pins one thread per physical core, \n"
+                                    "      thread pins one thread per hyper-thread \n"
+                                    "-i    Incremental mode, files unchanged since a previous run \n"
+                                    "      with the same settings are skipped if their output exists \n"
+                                    "-c    Cache directory, outputs are stored under a hash of samples \n"
+                                    "      and settings, identical inputs are linked instead of encoded \n"
+                                    "-o    Output directory, subdirectories of the input are mirrored \n"
+                                    "      in it, by default outputs are written next to inputs \n"
+                                    "-d    Durability of outputs, all are published by a rename: \n"
+                                    "      none (default) leaves them to the system, \n"
+                                    "      file syncs every output and its directory, \n"
+                                    "      group syncs outputs finished together at once \n"
                                     "-h    This help\n", optopt);
                     exit(0);
                     break;
                 case 't':
-                    if (strtol(optarg, NULL, 5) > MAX_THREADS) {
-                        fprintf(stderr, "Threads limit is %lu, selecting maximum\n", MAX_THREADS);
+                    maxThreads = strtoul(optarg, NULL, 10);
+                    break;
+                case 'b':
+                    tArgs.opts.blockSize = strtoul(optarg, NULL, 10);
+                    if (tArgs.opts.blockSize == 0) {
+                        break;
+                    }
+                    if (tArgs.opts.blockSize < MIN_BLOCK_SIZE) {
+                        fprintf(stderr, "Block size limit is %lu, selecting minimum\n", MIN_BLOCK_SIZE);
+                        tArgs.opts.blockSize = MIN_BLOCK_SIZE;
+                    } else if (tArgs.opts.blockSize > MAX_BLOCK_SIZE) {
+                        fprintf(stderr, "Block size limit is %lu, selecting maximum\n", MAX_BLOCK_SIZE);
+                        tArgs.opts.blockSize = MAX_BLOCK_SIZE;
+                    }
+                    break;
+                case 's':
+                    tArgs.opts.segLength = strtoul(optarg, NULL, 10);
+                    break;
+                case 'p':
+                    if (!strcmp(optarg, "largest")) {
+                        tArgs.sched = en_sched_largest;
+                    } else if (!strcmp(optarg, "smallest")) {
+                        tArgs.sched = en_sched_smallest;
+                    } else if (!strcmp(optarg, "fifo")) {
+                        tArgs.sched = en_sched_fifo;
                     } else {
-                        maxThreads = strtol(optarg, NULL, 5);
+                        fprintf(stderr, "Unknown order %s, selecting fifo\n", optarg);
+                        tArgs.sched = en_sched_fifo;
+                    }
+                    break;
+                case 'q':
+                    tArgs.opts.pipeDepth = strtoul(optarg, NULL, 10);
+                    if (tArgs.opts.pipeDepth > MAX_PIPE_DEPTH) {
+                        fprintf(stderr, "Queue limit is %lu, selecting maximum\n", MAX_PIPE_DEPTH);
+                        tArgs.opts.pipeDepth = MAX_PIPE_DEPTH;
+                    }
+                    break;
+                case 'a':
+                    pin = strcmp(optarg, "none") != 0;
+                    smt = strcmp(optarg, "thread") == 0;
+                    if (pin && !smt && strcmp(optarg, "core")) {
+                        fprintf(stderr, "Unknown pinning %s, selecting core\n", optarg);
+                    }
+                    break;
+                case 'i':
+                    incremental = 1;
+                    break;
+                case 'c':
+                    p_cacheDir = optarg;
+                    break;
+                case 'o':
+                    tArgs.p_outPath = optarg;
+                    break;
+                case 'd':
+                    if (!strcmp(optarg, "file")) {
+                        sync = en_sync_file;
+                    } else if (!strcmp(optarg, "group")) {
+                        sync = en_sync_group;
+                    } else if (!strcmp(optarg, "none")) {
+                        sync = en_sync_none;
+                    } else {
+                        fprintf(stderr, "Unknown durability %s, selecting none\n", optarg);
+                        sync = en_sync_none;
                     }
                     break;
                 default:
@@ -114,54 +228,109 @@ int main(int argc, char* argv[])
         exit(-1);
     }
 
-    os_fExplore(&tArgs);
-    if (tArgs.files < 0)
+    /* Pick converters for the current CPU */
+    os_splitFlopInit();
+    os_fSyncMode(sync);
+
+    /* Up to date files are dropped by the scan already */
+    if (incremental)
+    {
+        tArgs.p_state = state_load(tArgs.p_trgPath, &tArgs.opts);
+        if (tArgs.p_state == NULL)
+            fprintf(stderr, "Error: Failed to load the state, converting all files\n");
+    }
+
+    if (p_cacheDir != NULL)
+    {
+        tArgs.opts.p_cache = cache_open(p_cacheDir);
+        if (tArgs.opts.p_cache == NULL)
+            fprintf(stderr, "Error: Failed to open the cache, it's disabled\n");
+    }
+
+    if (pin)
     {
-        fprintf(stderr, "Error: No valid files were found\n");
+        cpus = os_cpuList(&p_cpus, smt);
+    }
+    if (maxThreads == 0)
+    {
+        /* By default one worker per CPU we pin to */
+        maxThreads = os_cpuCount();
+        if ((cpus > 0) && (cpus < maxThreads))
+            maxThreads = cpus;
+    }
+
+    /* Workers take whole files as well as parts of them, they are started
+     * before the scan to convert files as soon as they are found */
+    p_pool = pool_create(maxThreads, p_cpus, cpus, music_workerEnter, music_workerLeave);
+    if (p_pool == NULL)
+    {
+        fprintf(stderr, "Error: Failed to start worker threads\n");
     }
     else
     {
-        /* Create several threads */
-        for (i = 0; i < maxThreads && i < tArgs.files; i++)
+        tArgs.p_pool = p_pool;
+        os_fExplore(&tArgs, music_found);
+        if (tArgs.files < 0)
         {
-            tArgs.threadID = i;
-            ret = pthread_create(&threads[i], &attr, music_procFiles,
-                    (void *) &tArgs);
-            if (ret)
-            {
-                fprintf(stderr, " Error in pthread_create(), Code [%d]\n", ret);
-                break;
-            }
-            activeThreads += 1;
+            fprintf(stderr, "Error: No valid files were found\n");
+        }
+        else
+        {
+            /* Reorder files by the selected policy if it needs all of them */
+            music_schedule(p_pool, &tArgs);
         }
 
-        /* Wait until any thread exist */
-        for (i = 0; i < activeThreads; i++)
+        /* Wait until all files are converted */
+        pool_wait(p_pool);
+        pool_destroy(p_pool);
+    }
+
+    if (tArgs.files >= 0)
+    {
+        printf("Finished: %lu files processed\n",tArgs.files);
+        if (incremental)
+            printf("Skipped: %lu files up to date\n", tArgs.skipped);
+        music_report();
+        if (tArgs.opts.p_cache != NULL)
+            cache_report(tArgs.opts.p_cache);
+
+        /* Only completely written files are recorded */
+        if (tArgs.p_state != NULL)
         {
-            ret = pthread_join(threads[i], NULL);
-            if (ret)
+            for (i = 0; i < tArgs.files; i++)
             {
-                fprintf(stderr,
-                        " ERROR; return code from pthread_join() is %d\n", ret);
-                break;
+                if (ENC_FDESC(&tArgs, i)->done)
+                    state_update(tArgs.p_state, ENC_FDESC(&tArgs, i));
             }
+            state_save(tArgs.p_state);
         }
 
-        printf("Finished: %lu files processed\n",tArgs.files);
-
         /* Free allocated memory */
         for (i = 0; i < tArgs.files; i++)
         {
-            if ((tArgs.p_fdesc[i].p_fname) != NULL)
-            {
-                free(tArgs.p_fdesc[i].p_fname);
-            }
+            free(ENC_FDESC(&tArgs, i)->p_fname);
         }
-        free(tArgs.p_fdesc);
-        free(tArgs.p_trgPath);
+        /* Chunks are allocated in turn */
+        for (i = 0; (tArgs.pp_fdesc != NULL) && (i < FDESC_CHUNKS) &&
+                    (tArgs.pp_fdesc[i] != NULL); i++)
+        {
+            free(tArgs.pp_fdesc[i]);
+        }
+        free(tArgs.pp_fdesc);
+    }
+    while (tArgs.p_dirs != NULL)
+    {
+        st_encDir_t*    p_dir = tArgs.p_dirs;
+
+        tArgs.p_dirs = p_dir->p_next;
+        free(p_dir->p_name);
+        free(p_dir);
     }
+    free(tArgs.p_trgPath);
+    free(p_cpus);
+    state_free(tArgs.p_state);
+    cache_close(tArgs.opts.p_cache);
 
-    pthread_attr_destroy(&attr);
     pthread_exit(NULL);
 
 }
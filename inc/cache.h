@@ -0,0 +1,88 @@
+/*
+ * --- Module Description --------------------------------------------------- *
+ */
+/**
+ * \file    cache.h
+ * \author  Artem Yushev
+ * \date    $Date$
+ * \version $Version$
+ *
+ * \brief   Content-addressed cache of encoded files. Outputs are stored
+ *          under a hash of the samples, their format and the settings
+ *          which affect the output, identical inputs are linked instead
+ *          of being encoded again.
+ */
+
+#ifndef CACHE_H_
+#define CACHE_H_
+
+/*
+ * --- Type Definitions ----------------------------------------------------- *
+ */
+
+typedef struct st_cache st_cache_t;
+
+/*
+ * --- Global Functions Declaration ----------------------------------------- *
+ */
+
+/**
+ * \brief     Open a cache directory, it's created if it doesn't exist
+ *
+ * \param     p_dir         Cache directory
+ * \return    Cache, NULL for failure
+ */
+st_cache_t* cache_open(const char* p_dir);
+
+/**
+ * \brief     Hash the samples of a file. The file has to be positioned at
+ *            the start of samples data, all of it is read.
+ *
+ * \param     p_in          Input file with parsed header
+ * \param     p_opts        Encoding options
+ * \return    Key of the file, 0 for failure
+ */
+uint64_t cache_key(st_encoder_t* p_in, const st_encOpts_t* p_opts);
+
+/**
+ * \brief     Link the stored output of a key to the given output file, it's
+ *            replaced if it exists. Hits and misses are counted.
+ *
+ * \param     p_cache       Cache
+ * \param     key           Key of the input
+ * \param     p_dir         Directory of the input, see os_fLink()
+ * \param     p_out         Name of the output file
+ * \return    Negative for a miss, otherwise OK
+ */
+int8_t cache_fetch(st_cache_t* p_cache, uint64_t key, const st_encDir_t* p_dir,
+                   const char* p_out);
+
+/**
+ * \brief     Store an output file under a key
+ *
+ * \param     p_cache       Cache
+ * \param     key           Key of the input
+ * \param     p_dir         Directory of the input, see os_fLink()
+ * \param     p_out         Name of the completely written output file
+ * \return    Negative for failure, otherwise OK
+ */
+int8_t cache_store(st_cache_t* p_cache, uint64_t key, const st_encDir_t* p_dir,
+                   const char* p_out);
+
+/**
+ * \brief     Print hits, misses and stored outputs of the run
+ *
+ * \param     p_cache       Cache
+ * \return    Nothing
+ */
+void cache_report(st_cache_t* p_cache);
+
+/**
+ * \brief     Free the cache, stored outputs stay on disk
+ *
+ * \param     p_cache       Cache
+ * \return    Nothing
+ */
+void cache_close(st_cache_t* p_cache);
+
+#endif /* CACHE_H_ */
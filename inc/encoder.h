@@ -18,11 +18,24 @@
  * --- Macro Definitions ---------------------------------------------------- *
  */
 
-#define BLOCK_SIZE      2048
-#define INBUF_SIZE      BLOCK_SIZE
-#define OUTBUF_SIZE     BLOCK_SIZE
+/* Limits for the size of input data processed at once, bytes */
+#define MIN_BLOCK_SIZE  2048
+#define MAX_BLOCK_SIZE  (1 << 20)
+/* Buffers are aligned to a cache line */
+#define CACHE_LINE      64
 #define MAX_FILEPATH    256
-#define MAX_THREADS     20
+/* Upper bound of blocks queued between pipeline stages */
+#define MAX_PIPE_DEPTH  64
+/* NUMA nodes accounted in the report */
+#define MAX_NODES       64
+/* Table of files is kept in chunks which never move, so it grows while
+ * workers convert files found before. Up to FDESC_CHUNKS chunks. */
+#define FDESC_SHIFT     12
+#define FDESC_CHUNK     (1 << FDESC_SHIFT)
+#define FDESC_CHUNKS    (1 << 16)
+/* Descriptor of a file in the table by its index */
+#define ENC_FDESC(p_tArgs, idx) \
+    (&(p_tArgs)->pp_fdesc[(idx) >> FDESC_SHIFT][(idx) & (FDESC_CHUNK - 1)])
 
 /*
  * --- Type Definitions ----------------------------------------------------- *
@@ -34,30 +47,147 @@ typedef enum en_music
     en_music_wave
 } en_music_t;
 
+/* Order in which files are handed out to threads */
+typedef enum en_encSched
+{
+    /* Directory order, no extra probing */
+    en_sched_fifo,
+    /* Largest first, shortens the overall batch time */
+    en_sched_largest,
+    /* Smallest first, the most files are finished early */
+    en_sched_smallest
+} en_encSched_t;
+
+/* Durability of published outputs */
+typedef enum en_encSync
+{
+    /* Outputs are renamed in place, the system writes them back later */
+    en_sync_none,
+    /* Every output is synced before it's renamed, then its directory */
+    en_sync_file,
+    /* Finished outputs are synced in groups, each directory once a group */
+    en_sync_group
+} en_encSync_t;
+
+/* Result of the header probe of a file */
+typedef enum en_encProbe
+{
+    /* Not probed or the header didn't fit, it's parsed on encoding */
+    en_probe_none,
+    /* Header is known, encoding starts at samples data */
+    en_probe_ok,
+    /* Not a supported file, it's rejected before encoding */
+    en_probe_bad
+} en_encProbe_t;
+
+/* Directory of the input tree, names are kept relative to the parent,
+ * so paths are only built when they are needed */
+typedef struct st_encDir
+{
+    /* Name within the parent directory, NULL for the root */
+    char*               p_name;
+    struct st_encDir*   p_parent;
+    /* Descriptors of the directory and of its mirror in the output tree,
+     * open while the subtree is scanned, and until its files are converted
+     * if it's held. outFd is -1 if outputs are written next to inputs. */
+    int                 fd;
+    int                 outFd;
+    /* Own scan, subdirectories which didn't open yet and unfinished
+     * files opened through the directory, see os_dirRelease() */
+    _Atomic uint32_t    refs;
+    /* Set if descriptors are kept for the files, while the limit allows,
+     * files of other directories are opened by path through the root */
+    uint8_t             held;
+    /* All directories of the tree, to free them */
+    struct st_encDir*   p_next;
+} st_encDir_t;
+
 typedef struct st_encFDesc
 {
     char*      p_fname;
-    uint8_t    flocked;
+    /* Directory of the file */
+    st_encDir_t* p_dir;
+    /* Size and modification time in nanoseconds found during the scan */
+    uint64_t   fsize;
+    int64_t    mtime;
+    /* Header found by the probe, valid for en_probe_ok only */
+    en_encProbe_t probe;
+    uint8_t    isFloat;
+    uint8_t    bps;
+    uint16_t   channels;
+    uint32_t   sampleRate;
+    /* Offset and length of samples data, 0 if it wasn't probed */
+    uint64_t   dataOffset;
+    uint64_t   dataLength;
+    /* Set once the output is completely written */
+    uint8_t    done;
+    /* Key in the encode cache, 0 if the file isn't cached */
+    uint64_t   key;
 }st_encFDesc_t;
 
+typedef struct st_encOpts
+{
+    /* Size of input data processed at once, 0 for auto tuning */
+    uint32_t        blockSize;
+    /* Length of segments in seconds to split long files into, 0 - off */
+    uint32_t        segLength;
+    /* Blocks queued between reader, encoder and writer stages, 0 - off */
+    uint32_t        pipeDepth;
+    /* Cache of encoded files, NULL - off */
+    struct st_cache* p_cache;
+}st_encOpts_t;
+
 typedef struct st_encArgs
 {
-    st_encFDesc_t*  p_fdesc;
+    /* Chunks of the table of files, see ENC_FDESC() */
+    st_encFDesc_t** pp_fdesc;
     int32_t         files;
+    /* Order of files in the table */
+    en_encSched_t   sched;
+    st_encOpts_t    opts;
     char*           p_trgPath;
-    uint16_t        threadID;
+    /* Root of the mirrored output tree, NULL to write next to inputs */
+    char*           p_outPath;
+    /* Directories found by the scan */
+    st_encDir_t*    p_dirs;
+    /* State of previous runs in incremental mode, otherwise NULL */
+    struct st_state* p_state;
+    /* Files skipped by the scan as up to date */
+    int32_t         skipped;
+    /* Pool which converts files while the scan goes on */
+    struct st_pool* p_pool;
 }st_encArg_t;
 
 typedef struct st_encoder
 {
     /* File struct pointer to opened file, otherwise NULL */
     FILE*           p_fp;
-    /* Absolute path to the file */
-    const char*     path;
+    /* Directory of the file and the name within it, outputs are
+     * created in the mirror of the directory */
+    const st_encDir_t* p_dir;
+    const char*     p_fname;
     /* The overall length of the file */
-    uint32_t        fsize;
+    uint64_t        fsize;
     /* Shows whether file is still opened */
     uint8_t         opened;
+    /* Read-only mapping of the whole file if mapped, otherwise NULL */
+    uint8_t*        p_map;
+    /* Offset of the next unread byte and the end of readable data */
+    uint64_t        mapOff;
+    uint64_t        mapEnd;
+    /* Pages before this offset were released after reading */
+    uint64_t        mapFree;
+    /* Asynchronous I/O state if enabled, otherwise NULL */
+    struct st_osAio* p_aio;
+    /* Buffer collecting writes into large blocks, otherwise NULL */
+    uint8_t*        p_wbuf;
+    /* Space preallocated for an output, it's cut to the written
+     * length when the file is committed */
+    uint64_t        reserved;
+    /* Output is written under a temporary name until it's committed,
+     * the name is told apart by the sequence number */
+    uint8_t         temp;
+    uint32_t        tempSeq;
 
     /* Format of the file */
     en_music_t      fmt;
@@ -65,6 +195,11 @@ typedef struct st_encoder
     uint8_t         isFloat;
     /* Bit per sample */
     uint8_t			bps;
+    /* Amount of channels and sample rate from the header */
+    uint16_t        channels;
+    uint32_t        sampleRate;
+    /* Length of samples data */
+    uint64_t        dataLength;
 } st_encoder_t;
 
 /*
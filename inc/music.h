@@ -19,20 +19,57 @@
 
 /**
  * \brief     Process individual music file and convert it in mp3
- *            We have separated these two strings, as storing relative/absolute
- *            paths for each file to expensive
- * \param     p_dirPath     Directory name string
- * \param     p_fname       Filename string
- * \return    Negative for failure, otherwise OK
+ *            The file is opened relative to its directory, so only its
+ *            name is stored and no path is built
+ * \param     p_fdesc       File descriptor, marked done once the output is
+ *                          written, which may happen later for split files
+ * \param     p_opts        Encoding options
+ * \return    Negative for failure, 0 if the file was split and is finished
+ *            by its last segment, otherwise OK
  */
-int8_t music_procFile(char* p_dirPath, char* p_fname);
+int8_t music_procFile(st_encFDesc_t* p_fdesc, const st_encOpts_t* p_opts);
 
 /**
- * \brief     Function to process files in the given directory
+ * \brief     Take a file found by the scan, see os_fFound_t. In directory
+ *            order the file is submitted for conversion right away and
+ *            probed by the worker, other orders need all headers first,
+ *            so only the probe is submitted. Files which fail the probe
+ *            are reported and left out.
  *
- * \param     p_threadarg     Pointer to argument given to thread
- * \return    Void
+ * \param     p_tArgs       Arguments with the table of files and the pool
+ * \param     idx           Index of the file in the table
+ * \return    Nothing
  */
-void* music_procFiles(void* p_threadarg);
+void music_found(st_encArg_t* p_tArgs, uint32_t idx);
+
+/**
+ * \brief     Once the scan is over, wait for the probes and submit all
+ *            files to the pool ordered by the scheduling policy. Nothing
+ *            is left to do in directory order.
+ *
+ * \param     p_pool        Pool of workers
+ * \param     p_tArgs       Arguments with the table of files
+ * \return    Amount of submitted files
+ */
+int32_t music_schedule(st_pool_t* p_pool, st_encArg_t* p_tArgs);
+
+/**
+ * \brief     Print statistics of the run: files found by probes, files
+ *            and bytes processed on each NUMA node and average fill of
+ *            the pipeline queues if pipelining was enabled
+ *
+ * \return    Nothing
+ */
+void music_report(void);
+
+/**
+ * \brief     Set up and release per-thread state of a pool worker:
+ *            exception context and encoder instance
+ *
+ * \param     id            Worker index
+ * \return    Nothing
+ */
+void music_workerEnter(uint32_t id);
+void music_workerLeave(uint32_t id);
 
 #endif /* MUSIC_H_ */
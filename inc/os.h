@@ -12,6 +12,33 @@
 #ifndef OS_H_
 #define OS_H_
 
+/*
+ * --- Type Definitions ----------------------------------------------------- *
+ */
+
+/**
+ * \brief     Converter of interleaved little-endian samples into one or two
+ *            channel buffers. See os_splitFlop*() functions.
+ */
+typedef void (*os_splitFlop_t)(uint8_t* from, int32_t* toFir, int32_t* toSec,
+                               uint32_t toMaxOff);
+
+/* Implementations of the converters, see os_splitFlopImpl() */
+typedef enum en_osSplit
+{
+    /* Plain C, the reference for the others */
+    en_split_scalar,
+    en_split_sse2,
+    en_split_avx2,
+    en_split_impls
+} en_osSplit_t;
+
+/**
+ * \brief     Called by os_fExplore() for every file added to the table,
+ *            while the scan goes on. See music_found().
+ */
+typedef void (*os_fFound_t)(st_encArg_t* p_tArgs, uint32_t idx);
+
 /*
  * --- Global Functions Declaration ----------------------------------------- *
  */
@@ -19,26 +46,183 @@
 /**
  * \brief     Open a given filename in Read or Write direction. Safe calls
  *            should be used here as we open binary files, not text.
+ *            Files are opened by name relative to their directory,
+ *            outputs are created in its mirror, see os_outPath().
+ *            Outputs are written under a temporary name, which replaces
+ *            the given one only once the output is committed.
  * \param     inout         Direction to open (1- Read, 9 - Write)
  * \param     enc           Encoder file descriptor
  * \return    Negative for failure, otherwise OK
  */
 int8_t  os_fOpen(uint8_t inout, st_encoder_t * enc);
 
+/**
+ * \brief     Read a part of a file with a single positioned read, the file
+ *            isn't kept open
+ * \param     p_dir         Directory of the file
+ * \param     p_fname       Name of the file within the directory
+ * \param     p_buf         Buffer to read into
+ * \param     len           Amount of bytes to read
+ * \param     off           Offset in the file to read from
+ * \return    Negative for failure, otherwise amount of bytes read, which is
+ *            less than len at the end of the file
+ */
+int32_t os_fPeek(const st_encDir_t* p_dir, const char* p_fname, uint8_t* p_buf,
+                 uint32_t len, uint64_t off);
+
 /**
  * \brief     Shift current FILE read/write pointer
  * \param     p_fp          Pointer to FILE stream
  * \param     off           Offset for shift, might be negative
  * \return    Negative for failure, otherwise OK
  */
-int8_t os_fOffset(FILE* p_fp, int32_t off);
+int8_t os_fOffset(FILE* p_fp, int64_t off);
+
+/**
+ * \brief     Map an opened input file into memory. Samples are read out
+ *            with os_fRead() starting from the current FILE position.
+ *            Pages far behind the read position are released, so files
+ *            of any length are read with constant memory.
+ *            On failure the file stays usable with the stream functions.
+ * \param     p_enc         Encoder file descriptor of an input file
+ * \param     len           Length of data which is allowed to be read
+ * \return    Negative for failure, otherwise OK
+ */
+int8_t os_fMap(st_encoder_t* p_enc, uint64_t len);
+
+/**
+ * \brief     Switch an opened file to asynchronous I/O (io_uring). An input
+ *            file is read ahead from the current FILE position, writes to
+ *            an output file are collected and sent in background.
+ *            Available only if built with --iouring option and supported
+ *            by the kernel, otherwise the file stays usable as it was.
+ * \param     p_enc         Encoder file descriptor
+ * \param     len           Length of data to read, 0 for an output file
+ * \return    Negative for failure, otherwise OK
+ */
+int8_t os_fAioStart(st_encoder_t* p_enc, uint64_t len);
+
+/**
+ * \brief     Prepare an opened output file for about len bytes. The space
+ *            is allocated at once where the filesystem supports it and
+ *            writes are collected into large blocks, so the file doesn't
+ *            grow by small pieces. The file is cut to the written length
+ *            when it's committed, so the estimate may be off either way.
+ *            Call it after os_fAioStart(), before anything is written.
+ * \param     p_enc         Encoder file descriptor of an output file
+ * \param     len           Expected length of the file
+ * \return    Nothing
+ */
+void os_fReserve(st_encoder_t* p_enc, uint64_t len);
+
+/**
+ * \brief     Select how published outputs are made durable, see
+ *            os_fCommit(). Outputs are only renamed by default.
+ * \param     mode          Durability mode
+ * \return    Nothing
+ */
+void os_fSyncMode(en_encSync_t mode);
+
+/**
+ * \brief     Publish a completely written output under its name. Pending
+ *            writes are flushed, the file is synced according to the
+ *            durability mode and renamed over the old file at once, so
+ *            readers see either the old or the whole new output. In group
+ *            mode outputs committed by several threads at once are synced
+ *            together and each of their directories once. The file still
+ *            has to be closed with os_fclose(), an output which wasn't
+ *            committed is removed then.
+ * \param     p_enc         Encoder file descriptor of an output file
+ * \return    Negative for failure, otherwise OK
+ */
+int8_t os_fCommit(st_encoder_t* p_enc);
 
 /**
- * \brief     Find all files in the given directory and store filenames
+ * \brief     Get the next portion of data from an input file. Mapped and
+ *            asynchronous files return a pointer to their own memory,
+ *            otherwise data is read into the given buffer.
+ *            Data under the pointer is valid until the next call,
+ *            mapped data stays valid until the file is closed.
+ *            Declared in source as inline function.
+ * \param     p_enc         Encoder file descriptor
+ * \param     pp_buf        Buffer to read into, replaced with a pointer
+ *                          to the data
+ * \param     size          Size of data portion
+ * \param     cnt           Amount of data portions
+ * \return    Amount of data portions available under the pointer
+ */
+extern uint32_t os_fRead(st_encoder_t* p_enc, uint8_t** pp_buf, size_t size, size_t cnt);
+
+/**
+ * \brief     Write data to an output file opened with os_fOpen()
+ *            Declared in source as inline function.
+ * \param     p_enc         Encoder file descriptor
+ * \param     p_buf         Source data buffer
+ * \param     len           Length of data
+ * \return    Nothing
+ */
+extern void os_fWrite(st_encoder_t* p_enc, uint8_t* p_buf, size_t len);
+
+/**
+ * \brief     Find all files in the given directory tree and append them to
+ *            the table. Subdirectories are opened relative to their parent
+ *            and scanned in parallel by the pool, their mirrors are created
+ *            under the output root if it's set. Entries are read in large
+ *            batches and every file is handed over as soon as it's found,
+ *            so conversion overlaps the scan. Returns once the whole tree
+ *            is scanned. Every file added holds a reference to its
+ *            directory, which is dropped with os_dirRelease() once the file
+ *            is finished.
  * \param     p_tArg        Pointer to a structure where the result should be stored
+ * \param     p_found       Called for every file added, might be NULL
  * \return    Negative for failure, otherwise how much valid files were found
  */
-int32_t os_fExplore(st_encArg_t* p_tArg);
+int32_t os_fExplore(st_encArg_t* p_tArg, os_fFound_t p_found);
+
+/**
+ * \brief     Take one more reference to a directory found by os_fExplore(),
+ *            its descriptors stay open until all references are dropped
+ * \param     p_dir         Directory with at least one reference
+ * \return    Nothing
+ */
+void os_dirRetain(st_encDir_t* p_dir);
+
+/**
+ * \brief     Drop a reference to a directory, its descriptors are closed
+ *            with the last one
+ * \param     p_dir         Directory
+ * \return    Nothing
+ */
+void os_dirRelease(st_encDir_t* p_dir);
+
+/**
+ * \brief     Get amount of CPUs the process may use. It's limited by
+ *            the CPU affinity mask and the cgroup CPU quota if any.
+ * \return    Amount of CPUs, at least 1
+ */
+uint32_t os_cpuCount(void);
+
+/**
+ * \brief     List CPUs the process may run on
+ * \param     pp_cpus       Where to store allocated list, freed by caller
+ * \param     smt           List all hyper-threads, otherwise only the first
+ *                          one of each physical core
+ * \return    Amount of CPUs in the list
+ */
+uint32_t os_cpuList(uint32_t** pp_cpus, uint8_t smt);
+
+/**
+ * \brief     Pin the calling thread to a CPU
+ * \param     cpu           CPU from os_cpuList()
+ * \return    Negative for failure, otherwise OK
+ */
+int8_t os_cpuPin(uint32_t cpu);
+
+/**
+ * \brief     Get NUMA node of the CPU the calling thread runs on
+ * \return    Node index, 0 if NUMA isn't supported
+ */
+uint32_t os_cpuNode(void);
 
 /**
  * \brief     Merge directory path and filename OSwise to make relative or
@@ -52,6 +236,50 @@ int32_t os_fExplore(st_encArg_t* p_tArg);
  */
 extern void os_mkPath(char* p_path, char* p_dirPath, char* p_fname, uint16_t lim);
 
+/**
+ * \brief     Build the path of a file in the input tree or in its mirror
+ * \param     p_path        String where to store result
+ * \param     p_root        Root of the tree, NULL for a path relative to it
+ * \param     p_dir         Directory of the file
+ * \param     p_fname       Filename
+ * \param     lim           Size of the string
+ * \return    Negative if the path doesn't fit, otherwise OK
+ */
+int8_t os_dirPath(char* p_path, const char* p_root, const st_encDir_t* p_dir,
+                  const char* p_fname, uint32_t lim);
+
+/**
+ * \brief     Build the name of the output file for an input file, its
+ *            extension is replaced with mp3
+ * \param     p_to          String where to store result, at least
+ *                          strlen(p_from) + sizeof(".mp3") long
+ * \param     p_from        Name of the input file
+ * \return    Nothing
+ */
+void os_outPath(char* p_to, const char* p_from);
+
+/**
+ * \brief     Make a file available under another name. It's hardlinked if
+ *            possible, otherwise reflinked or copied. An existing target is
+ *            replaced atomically and synced as set by os_fSyncMode().
+ * \param     p_fromDir     Directory whose output mirror holds the file,
+ *                          NULL if p_from is a path
+ * \param     p_from        Name of an existing file
+ * \param     p_toDir       Directory whose output mirror gets the new
+ *                          file, NULL if p_to is a path
+ * \param     p_to          Name of the new file
+ * \return    Negative for failure, otherwise OK
+ */
+int8_t os_fLink(const st_encDir_t* p_fromDir, const char* p_from,
+                const st_encDir_t* p_toDir, const char* p_to);
+
+/**
+ * \brief     Create a directory unless it exists
+ * \param     p_path        Path of the directory
+ * \return    Negative for failure, otherwise OK
+ */
+int8_t os_mkDir(const char* p_path);
+
 /**
  * \brief     Read data from stream in a thread-safe way
  *            Declared in source as inline function.
@@ -83,37 +311,33 @@ extern void os_fwrite_unlocked(void* p_buf, size_t size, size_t cnt, FILE* p_fp)
 extern void os_fclose(st_encoder_t* p_enc);
 
 /**
- * \brief     Read 4 bytes in big-endian order
- *            Declared in source as inline function.
- * \param     p_fp         FILE stream pointer
- * \return    signed integer 32 bits long
- */
-extern int32_t os_read32be(FILE* p_fp);
-
-/**
- * \brief     Read 4 bytes in little-endian order
- *            Declared in source as inline function.
- * \param     p_fp         FILE stream pointer
- * \return    signed integer 32 bits long
+ * \brief     Select the fastest os_splitFlop*() implementations supported
+ *            by the CPU (AVX2, SSE2 or plain C). Has to be called before
+ *            any thread is started, otherwise plain C versions are used.
+ * \return    Nothing
  */
-extern int32_t os_read32le(FILE* p_fp);
+void os_splitFlopInit(void);
 
 /**
- * \brief     Read 2 bytes in big-endian order
- *            Declared in source as inline function.
- * \param     p_fp         FILE stream pointer
- * \return    signed integer 16 bits long
+ * \brief     Get the converter selected by os_splitFlopInit() for a sample
+ *            format. It's specialized for the amount of channels, so it has
+ *            to be taken once per file and called for every block.
+ * \param     bps          Bytes per sample, 1..4
+ * \param     channels     Amount of channels, 1..2
+ * \return    Converter, NULL if the format isn't supported
  */
-extern int16_t os_read16be(FILE* p_fp);
-
+os_splitFlop_t os_splitFlopGet(uint8_t bps, uint8_t channels);
 
 /**
- * \brief     Read 2 bytes in little-endian order
- *            Declared in source as inline function.
- * \param     p_fp         FILE stream pointer
- * \return    signed integer 16 bits long
+ * \brief     Get a converter of the given implementation regardless of the
+ *            one selected, so tests and benchmarks can compare all of them.
+ * \param     impl         Implementation
+ * \param     bps          Bytes per sample, 1..4
+ * \param     channels     Amount of channels, 1..2
+ * \return    Converter, NULL if the format isn't supported or the CPU or
+ *            the platform doesn't have the implementation
  */
-extern int16_t os_read16le(FILE* p_fp);
+os_splitFlop_t os_splitFlopImpl(en_osSplit_t impl, uint8_t bps, uint8_t channels);
 
 /**
  * \brief     Read every 1 byte from input and store every other byte
@@ -0,0 +1,110 @@
+/*
+ * --- Module Description --------------------------------------------------- *
+ */
+/**
+ * \file    pool.h
+ * \author  Artem Yushev
+ * \date    $Date$
+ * \version $Version$
+ *
+ * \brief   Work-stealing pool of worker threads
+ */
+
+#ifndef POOL_H_
+#define POOL_H_
+
+/*
+ * --- Type Definitions ----------------------------------------------------- *
+ */
+
+/**
+ * \brief     Task executed by a worker, gets a context and an index
+ *            within it, e.g. a table of files and a file in the table
+ */
+typedef void (*pool_fn_t)(void* p_ctx, uint32_t idx);
+
+/**
+ * \brief     Called by each worker thread after it starts and before
+ *            it stops, to set up and release per-thread state
+ */
+typedef void (*pool_hook_t)(uint32_t id);
+
+typedef struct st_pool st_pool_t;
+
+/*
+ * --- Global Functions Declaration ----------------------------------------- *
+ */
+
+/**
+ * \brief     Create a pool and start its worker threads
+ *
+ * \param     workers       Amount of worker threads
+ * \param     p_cpus        CPUs to pin workers to in turn, NULL to let them float
+ * \param     cpus          Amount of CPUs in the list
+ * \param     p_enter       Called by each worker when it starts, might be NULL
+ * \param     p_leave       Called by each worker before it stops, might be NULL
+ * \return    Pool, NULL for failure
+ */
+st_pool_t* pool_create(uint32_t workers, const uint32_t* p_cpus, uint32_t cpus,
+                       pool_hook_t p_enter, pool_hook_t p_leave);
+
+/**
+ * \brief     Submit a task. Tasks submitted by a worker go to its own deque
+ *            and are taken newest first, other workers may steal them
+ *            oldest first. Tasks submitted from outside are served in the
+ *            order of submission.
+ *
+ * \param     p_pool        Pool
+ * \param     p_fn          Task function
+ * \param     p_ctx         Context passed to the task
+ * \param     idx           Index passed to the task
+ * \return    Negative for failure, otherwise OK
+ */
+int8_t pool_submit(st_pool_t* p_pool, pool_fn_t p_fn, void* p_ctx, uint32_t idx);
+
+/**
+ * \brief     Submit a task in the order of submission, like from outside
+ *            the pool, even if it's called by a worker. Workers claim such
+ *            tasks in small batches once their own deques are empty.
+ *
+ * \param     p_pool        Pool
+ * \param     p_fn          Task function
+ * \param     p_ctx         Context passed to the task
+ * \param     idx           Index passed to the task
+ * \return    Negative for failure, otherwise OK
+ */
+int8_t pool_inject(st_pool_t* p_pool, pool_fn_t p_fn, void* p_ctx, uint32_t idx);
+
+/**
+ * \brief     Wait until all submitted tasks, including the ones submitted
+ *            by tasks, are finished. Must not be called by a worker.
+ *
+ * \param     p_pool        Pool
+ * \return    Nothing
+ */
+void pool_wait(st_pool_t* p_pool);
+
+/**
+ * \brief     Stop worker threads once all tasks are finished and free the pool
+ *
+ * \param     p_pool        Pool
+ * \return    Nothing
+ */
+void pool_destroy(st_pool_t* p_pool);
+
+/**
+ * \brief     Get the pool of the calling worker thread
+ *
+ * \return    Pool, NULL if not called by a worker
+ */
+st_pool_t* pool_self(void);
+
+/**
+ * \brief     Get amount of worker threads in a pool
+ *
+ * \param     p_pool        Pool
+ * \return    Amount of workers
+ */
+uint32_t pool_workers(st_pool_t* p_pool);
+
+#endif /* POOL_H_ */
@@ -0,0 +1,77 @@
+/*
+ * --- Module Description --------------------------------------------------- *
+ */
+/**
+ * \file    state.h
+ * \author  Artem Yushev
+ * \date    $Date$
+ * \version $Version$
+ *
+ * \brief   State of previous runs for the incremental mode. Every converted
+ *          file is recorded by its path relative to the input root with
+ *          its size and modification time together with the settings
+ *          which affect the output.
+ */
+
+#ifndef STATE_H_
+#define STATE_H_
+
+/*
+ * --- Type Definitions ----------------------------------------------------- *
+ */
+
+typedef struct st_state st_state_t;
+
+/*
+ * --- Global Functions Declaration ----------------------------------------- *
+ */
+
+/**
+ * \brief     Load the state file of a directory. Records made with other
+ *            settings are dropped, a missing or broken file gives an
+ *            empty state.
+ *
+ * \param     p_dir         Directory with input files
+ * \param     p_opts        Encoding options of this run
+ * \return    State, NULL for failure
+ */
+st_state_t* state_load(const char* p_dir, const st_encOpts_t* p_opts);
+
+/**
+ * \brief     Check whether a file was converted with the same size and
+ *            modification time before. Fresh records are kept on save.
+ *            Might be called by several threads at once.
+ *
+ * \param     p_state       State
+ * \param     p_fdesc       File found during the scan
+ * \return    1 if the file is up to date, otherwise 0
+ */
+uint8_t state_fresh(st_state_t* p_state, const st_encFDesc_t* p_fdesc);
+
+/**
+ * \brief     Record a converted file. Must not be called concurrently.
+ *
+ * \param     p_state       State
+ * \param     p_fdesc       Converted file
+ * \return    Negative for failure, otherwise OK
+ */
+int8_t state_update(st_state_t* p_state, const st_encFDesc_t* p_fdesc);
+
+/**
+ * \brief     Replace the state file with fresh and updated records only,
+ *            records of files which are gone or changed are dropped
+ *
+ * \param     p_state       State
+ * \return    Negative for failure, otherwise OK
+ */
+int8_t state_save(st_state_t* p_state);
+
+/**
+ * \brief     Free the state
+ *
+ * \param     p_state       State
+ * \return    Nothing
+ */
+void state_free(st_state_t* p_state);
+
+#endif /* STATE_H_ */
@@ -20,9 +20,14 @@
 #include <assert.h>
 #include <string.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
 #include "lame.h"
 #include "encoder.h"
 #include "os.h"
+#include "pool.h"
+#include "music.h"
+#include "cache.h"
 #include "e4c.h"
 
 /*
@@ -44,6 +49,41 @@
 #define   WAVE_ID_FMT                   0x666d7420
 /* Contains the letters "DATA" in ASCII (0x64617461 big-endian form). */
 #define   WAVE_ID_DATA                  0x64617461
+/* Contains the letters "fact" in ASCII, amount of sample frames */
+#define   WAVE_ID_FACT                  0x66616374
+/* Contains the letters "LIST" in ASCII, metadata */
+#define   WAVE_ID_LIST                  0x4c495354
+/* Contains the letters "cue " in ASCII, cue points */
+#define   WAVE_ID_CUE                   0x63756520
+/* Contains the letters "RF64" and "BW64" in ASCII, RIFF with 64-bit sizes */
+#define   WAVE_ID_RF64                  0x52463634
+#define   WAVE_ID_BW64                  0x42573634
+/* Contains the letters "ds64" in ASCII, 64-bit sizes of RF64 */
+#define   WAVE_ID_DS64                  0x64733634
+/* 32-bit size of RF64 chunks which have their size in ds64 */
+#define   WAVE_SIZE_DS64                0xFFFFFFFF
+/* Bytes of the ds64 chunk up to the table of other chunk sizes */
+#define   WAVE_DS64_SIZE                28
+/* Bytes of the fmt chunk up to SubFormat of WAVE_FORMAT_EXTENSIBLE */
+#define   WAVE_FMT_SIZE                 16
+#define   WAVE_FMT_EXT_SIZE             26
+/* Block size auto tuning works with powers of two between
+ * MIN_BLOCK_SIZE and MAX_BLOCK_SIZE */
+#define   TUNE_MIN_SHIFT                11
+#define   TUNE_MAX_SHIFT                20
+#define   TUNE_CLASSES                  (TUNE_MAX_SHIFT - TUNE_MIN_SHIFT + 1)
+/* Initial guess is a block size to split a file into this much blocks */
+#define   TUNE_BLOCKS                   32
+/* Segments are encoded with this much MP3 frames of overlap on each side */
+#define   SEG_OVERLAP                   8
+/* Preallocated output is 1/MP3_EST_MARGIN longer than the estimate */
+#define   MP3_EST_MARGIN                8
+/* 16-bit samples of a little-endian host are LAME shorts already */
+#define   MUSIC_NATIVE16                (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+/* Headers are probed with a single read of this much bytes */
+#define   PROBE_SIZE                    4096
+/* Progress is printed at most once per this period */
+#define   PROGRESS_NSEC                 1000000000LL
 
 
 /*
@@ -59,65 +99,526 @@ typedef enum en_musicFSM
     en_mfsm_exit
 } en_musicFSM_t;
 
+/* Encoded output of one segment of a long file */
+typedef struct st_musicSeg
+{
+    uint8_t*        p_data;
+    uint32_t        size;
+    /* Range of frames to be written, set when encoding is done */
+    uint32_t        from;
+    uint32_t        len;
+    uint8_t         ready;
+} st_musicSeg_t;
+
+/* Long file, which is encoded in segments by several threads */
+typedef struct st_musicSplit
+{
+    char*           p_out;
+    char*           p_fname;
+    st_encFDesc_t*  p_fdesc;
+    st_encOpts_t    opts;
+    /* Amount of sample frames in the file */
+    uint64_t        numSamples;
+    /* Sample frames per segment and per overlap, multiples of MP3 frame */
+    uint32_t        segSamples;
+    uint32_t        overlap;
+    /* Samples per MP3 frame */
+    uint32_t        frameSize;
+    int32_t         segs;
+    /* The rest is guarded by lock */
+    pthread_mutex_t lock;
+    st_musicSeg_t*  p_segs;
+    int32_t         nextWrite;
+    int32_t         doneSegs;
+    int8_t          err;
+    st_encoder_t    outFile;
+} st_musicSplit_t;
+
+/* One block travelling between pipeline stages */
+typedef struct st_musicSlot
+{
+    uint8_t*        p_buf;
+    /* Data of the block, either p_buf or mapped file */
+    uint8_t*        p_data;
+    /* Samples read or bytes encoded */
+    uint32_t        len;
+    /* The last block of a file */
+    uint8_t         last;
+} st_musicSlot_t;
+
+/* Bounded queue of blocks between a single producer and a single consumer.
+ * Positions are advanced without the lock, it's taken only by a side
+ * which has to sleep on a full or empty queue and by the one waking it. */
+typedef struct st_musicRing
+{
+    st_musicSlot_t* p_slots;
+    uint32_t        depth;
+    /* Slots are filled at head and consumed at tail, the positions grow
+     * monotonically and each one is written by its side only */
+    _Alignas(CACHE_LINE) _Atomic uint32_t head;
+    _Alignas(CACHE_LINE) _Atomic uint32_t tail;
+    /* Sides sleeping on the condition */
+    _Alignas(CACHE_LINE) _Atomic uint32_t waiters;
+    /* Set if either side gave up, the other one stops waiting */
+    _Atomic uint8_t stop;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    /* Fill level in permille summed over all pushes, for the report */
+    uint64_t        fill;
+    uint64_t        pushes;
+} st_musicRing_t;
+
+/* Reader and writer stages around the encoder of one file */
+typedef struct st_musicPipe
+{
+    st_musicRing_t  inRing;
+    st_musicRing_t  outRing;
+    st_encoder_t*   p_in;
+    st_encoder_t*   p_out;
+    st_musicSeg_t*  p_seg;
+    uint64_t        dataLeft;
+    uint32_t        blockSize;
+    uint8_t         bytesPS;
+    /* Samples are passed to LAME as they are */
+    uint8_t         direct;
+    /* Converter of integer samples unless direct */
+    os_splitFlop_t  p_split;
+    /* Set by the writer if output failed */
+    int8_t          err;
+} st_musicPipe_t;
+
+/* Part of a file header in memory, the chunk walk moves it forward */
+typedef struct st_musicHdr
+{
+    const st_encDir_t* p_dir;
+    const char*     p_fname;
+    uint8_t*        p_buf;
+    /* Offset of the buffer in the file and amount of bytes in it */
+    uint64_t        base;
+    uint32_t        len;
+} st_musicHdr_t;
+
+/* Entry of the order in which probed files are submitted */
+typedef struct st_musicOrder
+{
+    uint64_t        weight;
+    const char*     p_fname;
+    uint32_t        idx;
+} st_musicOrder_t;
+
 /*
  * --- Variables ------------------------------------------------------------ *
  */
-static pthread_mutex_t music_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Processed bytes and time spent per block size, shared by all threads */
+static _Atomic uint64_t music_tuneBytes[TUNE_CLASSES];
+static _Atomic uint64_t music_tuneNsec[TUNE_CLASSES];
+/* Files and bytes of samples processed on each NUMA node */
+static _Atomic uint64_t music_nodeFiles[MAX_NODES];
+static _Atomic uint64_t music_nodeBytes[MAX_NODES];
+/* Files converted by the current worker thread */
+static _Thread_local uint32_t music_procCnt;
+/* Queue fill statistics of all pipelines, read and write stage */
+static _Atomic uint64_t music_pipeFill[2];
+static _Atomic uint64_t music_pipePushes[2];
+/* Samples data of all probed files and the part of it encoded so far,
+ * the total grows while the scan goes on */
+static _Atomic uint64_t music_totalBytes;
+static _Atomic uint64_t music_doneBytes;
+/* Files probed and rejected and milliseconds of audio found by probes */
+static _Atomic uint64_t music_probed;
+static _Atomic uint64_t music_rejected;
+static _Atomic uint64_t music_probedMsec;
+/* Files which failed to convert */
+static _Atomic uint64_t music_failed;
+/* Start of encoding and the last time progress was printed */
+static _Atomic int64_t music_startNsec;
+static _Atomic int64_t music_progressNsec;
 
 /*
  * --- Local Functions Declaration ------------------------------------------ *
  */
 
 /**
- * \brief     Prepare input WAVE file and process headers
+ * \brief     Get bytes of a header at an offset in the file. They are taken
+ *            from the buffer if it holds them, otherwise the buffer is
+ *            refilled from the offset with a single read.
  *
- * \param     p_lame        Pointer to currently used lame instance
- * \param     p_enc         Pointer to file description
- * \return    Negative for failure, otherwise OK
+ * \param     p_hdr         Header in memory
+ * \param     off           Offset in the file
+ * \param     need          Amount of bytes wanted, up to PROBE_SIZE
+ * \return    Pointer to the bytes, NULL if the file ends before them
  */
-static int8_t __wavePrepare(lame_t p_lame, st_encoder_t* p_enc);
+static const uint8_t* __hdrAt(st_musicHdr_t* p_hdr, uint64_t off, uint32_t need);
 
 /**
- * \brief     Prepare for further processing void input file. Detect format.
+ * \brief     Parse WAVE header walking RIFF chunks up to samples data.
+ *            Throws RuntimeException if the file isn't supported.
  *
- * \param     p_lame        Pointer to currently used lame instance
- * \param     p_enc         Pointer to file description
+ * \param     p_hdr         Header in memory holding the RIFF header
+ * \param     p_fdesc       File descriptor where to store the header
+ * \return    Nothing
+ */
+static void __waveProbe(st_musicHdr_t* p_hdr, st_encFDesc_t* p_fdesc);
+
+/**
+ * \brief     Read and parse the header of a file. Unsupported files are
+ *            reported and marked to be rejected.
+ *
+ * \param     p_fdesc       File descriptor where to store the header
+ * \return    Nothing
+ */
+static void __musicProbe(st_encFDesc_t* p_fdesc);
+
+/**
+ * \brief     Open an input file and position it at samples data. Header
+ *            found by the probe is taken as is, otherwise it's probed now.
+ *
+ * \param     p_enc         Encoder file descriptor
+ * \param     p_fdesc       File descriptor from the table
  * \return    Negative for failure, otherwise OK
  */
-static int8_t __musicPrepare(lame_t p_lame, st_encoder_t* p_enc);
+static int8_t __musicOpen(st_encoder_t* p_enc, st_encFDesc_t* p_fdesc);
+
+/**
+ * \brief     Create LAME instance set up for the format of a file,
+ *            parameters are not initialized yet
+ *
+ * \param     p_enc         Prepared input file
+ * \return    LAME instance, NULL for failure
+ */
+static lame_t __lameCreate(const st_encoder_t* p_enc);
 
 /**
  * \brief     Prepare encoder structure, open and prepare a given filename
  *
  * \param     inout         Point the direction (1 - Read, 0 - Write)
  * \param     p_lame        Pointer to currently used lame instance
- * \param     path          Absolute or relative path to file
+ * \param     p_dir         Directory of the file
+ * \param     p_fname       Name of the file within the directory
  * \return    Negative for failure, otherwise OK
  */
-static int8_t __encPrepare(uint8_t inout, st_encoder_t * enc, const char* path);
+static int8_t __encPrepare(uint8_t inout, st_encoder_t * enc, const st_encDir_t* p_dir,
+                           const char* p_fname);
+
+/**
+ * \brief     Check whether samples are passed to LAME as they are, without
+ *            splitting them into channel buffers
+ *
+ * \param     bps           Bytes per Sample value
+ * \param     isFloat       Samples are IEEE floats
+ * \return    1 if samples are passed directly, otherwise 0
+ */
+static uint8_t __isDirect(uint8_t bps, uint8_t isFloat);
 
 /**
- * \brief     Read bytes from given IN buffer, flop them according
- *            Bytes Sample value and store in two output structures
+ * \brief     Encode a block of interleaved samples. Integer samples are
+ *            split into channel buffers by the converter bound to the file,
+ *            floats and native 16-bit samples are passed to LAME as they are.
  *
- * \param     p_in          Pointer for IN data
- * \param     inSize        IN data size
- * \param     p_outL        Pointer where to store data for left speaker
- * \param     p_outR        Pointer where to store data for right speaker
- * \param     maxOut        Maximum output size
+ * \param     p_lame        Initialized LAME instance
+ * \param     p_split       Converter of the file, NULL if direct
+ * \param     p_data        Samples, aligned to the sample size if direct
+ * \param     samples       Amount of samples of all channels
  * \param     bps           Bytes per Sample value
+ * \param     isFloat       Samples are IEEE floats
+ * \param     pp_channels   Buffers for each channel, unused if direct
+ * \param     p_outBuf      Output buffer
+ * \param     outSize       Size of the output buffer
+ * \return    Length of encoded data or negative LAME error
+ */
+static int32_t __encodeBlock(lame_t p_lame, os_splitFlop_t p_split, uint8_t* p_data,
+                             uint32_t samples, uint8_t bps, uint8_t isFloat,
+                             int32_t** pp_channels, uint8_t* p_outBuf, uint32_t outSize);
+
+/**
+ * \brief     Choose a block size class for a file. The initial guess
+ *            depends on the data length, then a neighbour class is taken
+ *            if it showed better throughput so far. Classes which weren't
+ *            measured yet are tried first.
+ *
+ * \param     dataLength    Length of samples data in the file
+ * \return    Block size class, block size is (1 << (class + TUNE_MIN_SHIFT))
+ */
+static uint8_t __tuneClass(uint64_t dataLength);
+
+/**
+ * \brief     Account throughput of a file processed with a given class
+ *
+ * \param     cls           Block size class used for the file
+ * \param     bytes         Amount of processed samples data
+ * \param     p_start       Time when processing has started
+ * \return    Nothing
+ */
+static void __tuneUpdate(uint8_t cls, uint64_t bytes, struct timespec* p_start);
+
+/**
+ * \brief     Allocate a buffer aligned to the cache line
+ *
+ * \param     size          Required size of the buffer
+ * \return    Pointer to the buffer, NULL on failure
+ */
+static void* __allocBuf(size_t size);
+
+/**
+ * \brief     Weight of a file for scheduling, samples data length if it
+ *            was probed, otherwise the size of the file
+ *
+ * \param     p_fdesc       File descriptor from the scan
+ * \return    Weight in bytes
+ */
+static uint64_t __schedWeight(const st_encFDesc_t* p_fdesc);
+
+/**
+ * \brief     qsort comparators of st_musicOrder_t for largest and smallest
+ *            first policies, equal files are ordered by name to keep the
+ *            order stable
+ */
+static int __schedLargest(const void* p_a, const void* p_b);
+static int __schedSmallest(const void* p_a, const void* p_b);
+
+/**
+ * \brief     Get the length of MPEG Layer III frame from its header
+ *
+ * \param     p_buf         Pointer to the frame header
+ * \param     left          Amount of bytes available under the pointer
+ * \return    Frame length in bytes, negative if it's not a valid header
+ */
+static int32_t __mp3FrameLen(const uint8_t* p_buf, uint32_t left);
+
+/**
+ * \brief     Estimate the length of the MP3 output from the duration of
+ *            the input and the bitrate settings of the encoder
+ *
+ * \param     p_lame        LAME instance with initialized parameters
+ * \return    Expected length in bytes, 0 if it's unknown
+ */
+static uint64_t __mp3Estimate(lame_t p_lame);
+
+/**
+ * \brief     Split a file into segments if it's long enough and segmented
+ *            encoding is enabled. Segments are published for all threads.
+ *
+ * \param     p_lame        LAME instance initialized for the whole file
+ * \param     p_out         Name of the output file
+ * \param     p_fdesc       File descriptor, marked done once the output is
+ *                          written, its directory is kept open until then
+ * \param     p_opts        Encoding options
+ * \return    1 if the file was split, otherwise 0
+ */
+static int8_t __splitCreate(lame_t p_lame, const char* p_out, st_encFDesc_t* p_fdesc,
+                            const st_encOpts_t* p_opts);
+
+/**
+ * \brief     Finish a segment: cut off frames of overlaps, write all
+ *            segments which are ready in order and close the output file
+ *            after the last one.
+ *
+ * \param     p_split       Split file
+ * \param     seg           Index of the finished segment
+ * \param     err           Negative if the segment failed
+ * \return    Nothing
+ */
+static void __splitDone(st_musicSplit_t* p_split, int32_t seg, int8_t err);
+
+/**
+ * \brief     Store encoded data to the output file or segment buffer
+ *
+ * \param     p_out         Output file, used if p_seg is NULL
+ * \param     p_seg         Segment buffer or NULL
+ * \param     p_buf         Encoded data
+ * \param     len           Length of encoded data
+ * \return    Negative for failure, otherwise OK
+ */
+static int8_t __musicOut(st_encoder_t* p_out, st_musicSeg_t* p_seg,
+                         uint8_t* p_buf, int32_t len);
+
+/**
+ * \brief     Read, convert and encode samples data of an input file
+ *
+ * \param     p_lame        Initialized LAME instance
+ * \param     p_in          Input file positioned at samples to encode
+ * \param     p_out         Output file, used if p_seg is NULL
+ * \param     p_seg         Segment buffer or NULL
+ * \param     dataLeft      Length of samples data to encode
+ * \param     p_opts        Encoding options
+ * \return    Negative for failure, otherwise OK
+ */
+static int8_t __encodeData(lame_t p_lame, st_encoder_t* p_in, st_encoder_t* p_out,
+                           st_musicSeg_t* p_seg, uint64_t dataLeft,
+                           const st_encOpts_t* p_opts);
+
+/**
+ * \brief     Allocate a queue of blocks
+ *
+ * \param     p_ring        Queue to initialize
+ * \param     depth         Amount of blocks in the queue
+ * \param     slotSize      Size of each block
+ * \return    Negative for failure, otherwise OK
+ */
+static int8_t __ringInit(st_musicRing_t* p_ring, uint32_t depth, uint32_t slotSize);
+
+/**
+ * \brief     Free a queue of blocks and account its fill statistics
+ *
+ * \param     p_ring        Queue to free
+ * \param     stage         Index of the stage for the report
+ * \return    Nothing
+ */
+static void __ringFree(st_musicRing_t* p_ring, uint8_t stage);
+
+/**
+ * \brief     Producer side: wait for a free block and push it once filled.
+ *            Waiting blocks the producer while the consumer is behind.
+ *
+ * \param     p_ring        Queue
+ * \return    Free block, NULL if the queue was stopped
+ */
+static st_musicSlot_t* __ringAcquire(st_musicRing_t* p_ring);
+static void __ringPush(st_musicRing_t* p_ring);
+
+/**
+ * \brief     Consumer side: wait for a filled block and pop it once used
+ *
+ * \param     p_ring        Queue
+ * \return    Filled block, NULL if the queue was stopped
+ */
+static st_musicSlot_t* __ringPeek(st_musicRing_t* p_ring);
+static void __ringPop(st_musicRing_t* p_ring);
+
+/**
+ * \brief     Stop a queue, both sides return from waiting
+ *
+ * \param     p_ring        Queue
+ * \return    Nothing
+ */
+static void __ringStop(st_musicRing_t* p_ring);
+
+/**
+ * \brief     Sleep until the queue moves past a position of the other side
+ *            or it's stopped, and wake up the other side after a move
+ *
+ * \param     p_ring        Queue
+ * \param     p_pos         Position of the other side
+ * \param     pos           Position seen last
+ * \return    Nothing
+ */
+static void __ringWait(st_musicRing_t* p_ring, _Atomic uint32_t* p_pos, uint32_t pos);
+static void __ringWake(st_musicRing_t* p_ring);
+
+/**
+ * \brief     Reader stage, reads blocks of the input file into the queue.
+ *            An empty read before the end of the data stops the queue, so
+ *            the file fails.
+ *
+ * \param     p_arg         Pipeline of the file
+ * \return    NULL
+ */
+static void* __pipeReader(void* p_arg);
+
+/**
+ * \brief     Writer stage, writes encoded blocks from the queue
+ *
+ * \param     p_arg         Pipeline of the file
+ * \return    NULL
+ */
+static void* __pipeWriter(void* p_arg);
+
+/**
+ * \brief     Encode stage, converts and encodes blocks between the reader
+ *            and the writer stage running on their own threads
+ *
+ * \param     p_lame        Initialized LAME instance
+ * \param     p_pipe        Pipeline of the file
+ * \param     pp_channels   Buffers for each channel
+ * \param     outSize       Size of the output blocks
+ * \param     depth         Amount of blocks in each queue
+ * \return    Negative for failure, otherwise OK
+ */
+static int8_t __encodePiped(lame_t p_lame, st_musicPipe_t* p_pipe, int32_t** pp_channels,
+                            uint32_t outSize, uint32_t depth);
+
+/**
+ * \brief     Encode a whole file or one segment of a split file
+ *
+ * \param     p_out         Name of the output file
+ * \param     p_fdesc       File descriptor, marked done once the output is written
+ * \param     p_opts        Encoding options
+ * \param     p_split       Split file or NULL for a whole file
+ * \param     seg           Index of segment to encode
+ * \return    Negative for failure, 0 if the file was split, otherwise OK
+ */
+static int8_t __procPart(const char* p_out, st_encFDesc_t* p_fdesc, const st_encOpts_t* p_opts,
+                         st_musicSplit_t* p_split, int32_t seg);
+
+/**
+ * \brief     Pool tasks: encode a segment of a split file, convert a file
+ *            of the table and probe a header of a file of the table
+ *
+ * \param     p_ctx         Split file or arguments with the table of files
+ * \param     idx           Index of segment or file
+ * \return    Nothing
+ */
+static void __taskSeg(void* p_ctx, uint32_t idx);
+
+/**
+ * \brief     Look a file up in the encode cache and link its output on
+ *            a hit. The key of the file is kept for storing it later.
+ *
+ * \param     p_out         Name of the output file
+ * \param     p_fdesc       File descriptor
+ * \param     p_opts        Encoding options with the cache
+ * \return    1 on a hit, otherwise 0
+ */
+static uint8_t __cacheFetch(const char* p_out, st_encFDesc_t* p_fdesc,
+                            const st_encOpts_t* p_opts);
+
+/**
+ * \brief     Store the completely written output of a file in the encode
+ *            cache if it has a key
+ *
+ * \param     p_out         Name of the output file
+ * \param     p_fdesc       File descriptor
+ * \param     p_opts        Encoding options with the cache
+ * \return    Nothing
+ */
+static void __cacheStore(const char* p_out, st_encFDesc_t* p_fdesc, const st_encOpts_t* p_opts);
+
+/**
+ * \brief     Account processed files and bytes to the NUMA node of the
+ *            calling thread
+ *
+ * \param     files         Amount of files
+ * \param     bytes         Amount of bytes
+ * \return    Nothing
+ */
+static void __nodeAccount(uint32_t files, uint64_t bytes);
+
+/**
+ * \brief     Print encoded share of all samples data and the estimated
+ *            time left, at most once per PROGRESS_NSEC for all threads
+ *
  * \return    Nothing
  */
-static void __flopBytes(uint8_t* p_in, uint16_t inSize, int32_t* p_outL,
-        int32_t* p_outR, uint16_t maxOut, uint8_t bps);
+static void __progress(void);
+
+/**
+ * \brief     Get monotonic time in nanoseconds
+ *
+ * \return    Time in nanoseconds
+ */
+static int64_t __clockNsec(void);
+static void __taskFile(void* p_ctx, uint32_t idx);
+static void __taskProbe(void* p_ctx, uint32_t idx);
 
 /*
  * --- Local Functions Definition ------------------------------------------- *
  */
-static int8_t __encPrepare(uint8_t inout, st_encoder_t* p_enc, const char* path)
+static int8_t __encPrepare(uint8_t inout, st_encoder_t* p_enc, const st_encDir_t* p_dir,
+                           const char* p_fname)
 {
     assert(p_enc != NULL);
-    assert(path != NULL);
+    assert(p_dir != NULL);
+    assert(p_fname != NULL);
 
     int8_t err = 0;
 
@@ -126,9 +627,19 @@ static int8_t __encPrepare(uint8_t inout, st_encoder_t* p_enc, const char* path)
         p_enc->fmt = en_music_invalid;
         p_enc->isFloat = en_music_invalid;
         p_enc->fsize = 0;
-        p_enc->path = path;
+        p_enc->p_dir = p_dir;
+        p_enc->p_fname = p_fname;
         p_enc->p_fp = NULL;
         p_enc->opened = 0;
+        p_enc->p_map = NULL;
+        p_enc->p_aio = NULL;
+        p_enc->p_wbuf = NULL;
+        p_enc->reserved = 0;
+        p_enc->temp = 0;
+        p_enc->tempSeq = 0;
+        p_enc->mapOff = 0;
+        p_enc->mapEnd = 0;
+        p_enc->dataLength = 0;
 
         /* Open the given files */
         if (os_fOpen(inout, p_enc) < 0)
@@ -140,401 +651,1627 @@ static int8_t __encPrepare(uint8_t inout, st_encoder_t* p_enc, const char* path)
     return (err);
 }
 
+static inline uint16_t __get16le(const uint8_t* p_buf)
+{
+    return ((uint16_t) (p_buf[0] | (p_buf[1] << 8)));
+}
+
+static inline uint32_t __get32le(const uint8_t* p_buf)
+{
+    return ((uint32_t) p_buf[0] | ((uint32_t) p_buf[1] << 8) |
+            ((uint32_t) p_buf[2] << 16) | ((uint32_t) p_buf[3] << 24));
+}
+
+static inline uint64_t __get64le(const uint8_t* p_buf)
+{
+    return ((uint64_t) __get32le(p_buf) | ((uint64_t) __get32le(p_buf + 4) << 32));
+}
+
+static inline uint32_t __get32be(const uint8_t* p_buf)
+{
+    return (((uint32_t) p_buf[0] << 24) | ((uint32_t) p_buf[1] << 16) |
+            ((uint32_t) p_buf[2] << 8) | (uint32_t) p_buf[3]);
+}
+
+static const uint8_t* __hdrAt(st_musicHdr_t* p_hdr, uint64_t off, uint32_t need)
+{
+    int32_t     len = 0;
+
+    if ((off >= p_hdr->base) && ((off - p_hdr->base) <= p_hdr->len) &&
+        ((p_hdr->len - (off - p_hdr->base)) >= need))
+        return (p_hdr->p_buf + (off - p_hdr->base));
+
+    /* Chunks past the buffer are reached with one read, skipped
+     * chunks in between aren't read at all */
+    len = os_fPeek(p_hdr->p_dir, p_hdr->p_fname, p_hdr->p_buf, PROBE_SIZE, off);
+    if (len < 0)
+    {
+        E4C_THROW(RuntimeException, "Failed to read the file");
+    }
+    p_hdr->base = off;
+    p_hdr->len = len;
+
+    return (((uint32_t) len >= need) ? p_hdr->p_buf : NULL);
+}
+
 /* Good illustration for a format
  * http://soundfile.sapp.org/doc/WaveFormat/
  * https://msdn.microsoft.com/en-us/library/windows/hardware/ff536383(v=vs.85).aspx*/
-static int8_t __wavePrepare(lame_t p_lame, st_encoder_t* p_enc)
+static void __waveProbe(st_musicHdr_t* p_hdr, st_encFDesc_t* p_fdesc)
 {
-    assert(p_enc != NULL);
-    assert(p_enc->p_fp != NULL);
-    assert(p_lame != NULL);
-
-    int8_t      err = 0;
-    int32_t         i32 = 0;
-    /* Mono by default */
-    int16_t         numChannels = 1;
-    /* 44100 by default */
-    int32_t         sampleRate = 44100;
-    /* 8 by default */
-    int32_t         bitsPerSample = 8;
-    int16_t         audioFmt = 0;
-    int32_t         chunkID = 0;
-    int32_t         chunkSize = 0;
-    int32_t         subChunkSize = 0;
-    uint32_t        dataLength = 0;
-    FILE*           p_fp = p_enc->p_fp;
+    const uint8_t*  p_chunk = NULL;
+    uint16_t        numChannels = 0;
+    uint32_t        sampleRate = 0;
+    uint16_t        bitsPerSample = 0;
+    uint16_t        audioFmt = 0;
+    uint32_t        frameBytes = 0;
+    /* Sample frames from the fact chunk, 0 if there is none */
+    uint64_t        factFrames = 0;
+    /* Sizes from the ds64 chunk of RF64 files */
+    uint64_t        ds64Data = 0;
+    uint64_t        ds64Frames = 0;
+    uint8_t         ds64Found = 0;
+    uint8_t         rf64 = 0;
+    uint32_t        chunkID = 0;
+    uint32_t        subChunkSize = 0;
+    uint64_t        dataLength = 0;
+    /* The first chunk follows RIFF, size and WAVE */
+    uint64_t        off = 12;
+    uint8_t         fmtFound = 0;
+
+    p_chunk = __hdrAt(p_hdr, 0, 12);
+    if ((p_chunk == NULL) || (__get32be(p_chunk + 8) != WAVE_ID_WAVE))
+    {
+        E4C_THROW(RuntimeException, "Not a WAVE audio format");
+    }
+    rf64 = ((__get32be(p_chunk) == WAVE_ID_RF64) || (__get32be(p_chunk) == WAVE_ID_BW64));
+    if (!rf64 && (__get32be(p_chunk) != WAVE_ID_RIFF))
+    {
+        E4C_THROW(RuntimeException, "Not a RIFF, RF64 or BW64 file");
+    }
 
-    E4C_TRY{
-        /* ChunkSize */
-        chunkSize = os_read32le(p_fp);
-        /* Format */
-        i32 = os_read32be(p_fp);
-        if (i32 != WAVE_ID_WAVE)
+    /* Sizes in the RIFF header are often wrong for streamed files,
+     * so chunks are walked until samples data or the end of the file */
+    for (;;)
+    {
+        p_chunk = __hdrAt(p_hdr, off, 8);
+        if (p_chunk == NULL)
         {
-            E4C_THROW(RuntimeException, "Not a WAVE audio format");
+            E4C_THROW(RuntimeException, "No samples data found");
         }
-        chunkSize -= 4;
-        while (chunkSize > 0 && (dataLength == 0))
+        chunkID = __get32be(p_chunk);
+        subChunkSize = __get32le(p_chunk + 4);
+        off += 8;
+
+        switch (chunkID)
         {
-            /* SubchunkID */
-            chunkID = os_read32be(p_fp);
-            /* SubchunkSize */
-            subChunkSize = os_read32le(p_fp);
-            chunkSize -= subChunkSize;
-            switch (chunkID)
+            case WAVE_ID_FMT:
+            if (subChunkSize < WAVE_FMT_SIZE)
             {
-                case WAVE_ID_FMT:
-                /* AudioFormat */
-                audioFmt = os_read16le(p_fp); subChunkSize -= 2;
-                /* NumChannels */
-                numChannels = os_read16le(p_fp); subChunkSize -= 2;
-                /* SampleRate */
-                sampleRate = os_read32le(p_fp); subChunkSize -= 4;
-                /* ByteRate */
-                os_read32le(p_fp); subChunkSize -= 4;
-                /* BlockAlign */
-                os_read16le(p_fp); subChunkSize -= 2;
-                /* BitPerSample */
-                bitsPerSample = os_read16le(p_fp);subChunkSize -= 2;
-
-                /* WAVE_FORMAT_EXTENSIBLE support */
-                if ((subChunkSize > 9) && (audioFmt == WAVE_FORMAT_EXTENSIBLE))
-                {
-                    /* cbSize */
-                    os_read16le(p_fp); subChunkSize -= 2;
-                    /* ValidBitsPerSample */
-                    bitsPerSample = os_read16le(p_fp); subChunkSize -= 2;
-                    /* dwChannelMask */
-                    i32 = os_read32le(p_fp); subChunkSize -= 4;
-                    /* SubFormat */
-                    audioFmt = os_read16le(p_fp); subChunkSize -= 2;
-                    p_enc->isFloat = audioFmt;
-                }
+                E4C_THROW(RuntimeException, "Broken fmt chunk");
+            }
+            p_chunk = __hdrAt(p_hdr, off, (subChunkSize < WAVE_FMT_EXT_SIZE) ?
+                              WAVE_FMT_SIZE : WAVE_FMT_EXT_SIZE);
+            if (p_chunk == NULL)
+            {
+                E4C_THROW(RuntimeException, "Truncated header");
+            }
+            /* AudioFormat, NumChannels, SampleRate, ByteRate, BlockAlign
+             * and BitPerSample */
+            audioFmt = __get16le(p_chunk);
+            numChannels = __get16le(p_chunk + 2);
+            sampleRate = __get32le(p_chunk + 4);
+            bitsPerSample = __get16le(p_chunk + 14);
+
+            /* WAVE_FORMAT_EXTENSIBLE support, cbSize is followed by
+             * ValidBitsPerSample, dwChannelMask and SubFormat, which
+             * starts with the format */
+            if ((subChunkSize >= WAVE_FMT_EXT_SIZE) &&
+                (audioFmt == (uint16_t) WAVE_FORMAT_EXTENSIBLE))
+            {
+                bitsPerSample = __get16le(p_chunk + 18);
+                audioFmt = __get16le(p_chunk + 24);
+            }
 
-                if ((audioFmt != WAVE_FORMAT_PCM) &&
-                        ((audioFmt != WAVE_FORMAT_IEEE_FLOAT)))
-                {
-                    E4C_THROW(RuntimeException, "Non PCM file format is't supported");
-                }
+            if ((audioFmt != WAVE_FORMAT_PCM) && (audioFmt != WAVE_FORMAT_IEEE_FLOAT))
+            {
+                E4C_THROW(RuntimeException, "Non PCM file format is't supported");
+            }
+            p_fdesc->isFloat = (audioFmt == WAVE_FORMAT_IEEE_FLOAT);
+            if (p_fdesc->isFloat && (bitsPerSample != 32) && (bitsPerSample != 64))
+            {
+                E4C_THROW(RuntimeException, "Float samples must be 32 or 64 bit");
+            }
+            fmtFound = 1;
+            break;
 
-                if (os_fOffset(p_fp, (long) subChunkSize) < 0)
-                {
-                    E4C_THROW(RuntimeException, "Failed to skip data");
-                }
-                break;
-                case WAVE_ID_DATA:
-                dataLength = subChunkSize;
-                break;
-                default:
-                if (os_fOffset(p_fp, (long) subChunkSize) < 0)
-                {
-                    E4C_THROW(RuntimeException, "Failed to skip data");
-                }
-                break;
+            case WAVE_ID_DS64:
+            /* RIFF size, data size, sample frames and a table of sizes
+             * of other chunks, which aren't used */
+            p_chunk = (subChunkSize >= WAVE_DS64_SIZE) ?
+                      __hdrAt(p_hdr, off, WAVE_DS64_SIZE) : NULL;
+            if (!rf64 || (p_chunk == NULL))
+            {
+                E4C_THROW(RuntimeException, "Broken ds64 chunk");
             }
-        }
+            ds64Data = __get64le(p_chunk + 8);
+            ds64Frames = __get64le(p_chunk + 16);
+            ds64Found = 1;
+            break;
 
-        if (dataLength)
-        {
-            if (lame_set_num_channels(p_lame, numChannels) < 0)
+            case WAVE_ID_FACT:
+            /* Required for non-PCM formats, samples data might be padded */
+            p_chunk = (subChunkSize >= 4) ? __hdrAt(p_hdr, off, 4) : NULL;
+            if (p_chunk != NULL)
+                factFrames = __get32le(p_chunk);
+            if (rf64 && (factFrames == WAVE_SIZE_DS64))
+                factFrames = ds64Frames;
+            break;
+
+            case WAVE_ID_DATA:
+            if (!fmtFound)
+            {
+                E4C_THROW(RuntimeException, "No fmt chunk before samples data");
+            }
+            if ((numChannels < 1) || (numChannels > 2))
             {
                 E4C_THROW(RuntimeException, "Failed to setup WAVE numChannels,"
                         "LAME supports up to 2");
             }
-            if (lame_set_in_samplerate(p_lame, sampleRate) < 0)
+            if ((sampleRate == 0) || (sampleRate > INT32_MAX))
             {
                 E4C_THROW(RuntimeException, "Failed to setup WAVE sampleRate");
             }
-            /* DataLength == NumSamples * NumChannels * BitsPerSample/8 */
-            /* Make bytes from bits */
-            i32 = (bitsPerSample + 7) >> 3;
-            i32 *= numChannels;
-            /* Number of samples =  DataLength/(NumChannels * BytesPerSample) */
-            i32 = dataLength/i32;
-            lame_set_num_samples(p_lame, i32);
-            p_enc->bps = bitsPerSample;
+            if ((bitsPerSample == 0) || (bitsPerSample > (p_fdesc->isFloat ? 64 : 32)))
+            {
+                E4C_THROW(RuntimeException, "Unsupported bits per sample");
+            }
+
+            /* Data of an unfinished recording ends with the file */
+            dataLength = subChunkSize;
+            if (rf64 && (subChunkSize == WAVE_SIZE_DS64))
+            {
+                if (!ds64Found)
+                {
+                    E4C_THROW(RuntimeException, "No ds64 chunk before samples data");
+                }
+                dataLength = ds64Data;
+            }
+            if ((p_fdesc->fsize != 0) && (dataLength > (p_fdesc->fsize - off)))
+                dataLength = (p_fdesc->fsize > off) ? p_fdesc->fsize - off : 0;
+            frameBytes = ((bitsPerSample + 7) >> 3) * numChannels;
+            if ((factFrames != 0) && (dataLength > (uint64_t) factFrames * frameBytes))
+                dataLength = (uint64_t) factFrames * frameBytes;
+            if (dataLength < frameBytes)
+            {
+                E4C_THROW(RuntimeException, "No samples data found");
+            }
+
+            p_fdesc->channels = numChannels;
+            p_fdesc->sampleRate = sampleRate;
+            p_fdesc->bps = bitsPerSample;
+            p_fdesc->dataOffset = off;
+            p_fdesc->dataLength = dataLength;
+            return;
+
+            case WAVE_ID_LIST:
+            case WAVE_ID_CUE:
+            /* Metadata and cue points don't affect encoding */
+            default:
+            break;
+        }
+
+        /* Chunks are word aligned, odd sized ones are followed by a pad byte */
+        off += (uint64_t) subChunkSize + (subChunkSize & 1);
+    }
+}
+
+static void __musicProbe(st_encFDesc_t* p_fdesc)
+{
+    uint8_t         p_buf[PROBE_SIZE];
+    st_musicHdr_t   hdr = { .p_dir = p_fdesc->p_dir, .p_fname = p_fdesc->p_fname,
+                            .p_buf = p_buf, .base = 0, .len = 0 };
+    const uint8_t*  p_riff = NULL;
+
+    p_fdesc->probe = en_probe_none;
+    p_fdesc->isFloat = 0;
+    p_fdesc->dataOffset = 0;
+    p_fdesc->dataLength = 0;
+
+    E4C_TRY{
+        /* The whole header of a plain WAVE file fits the first read */
+        p_riff = __hdrAt(&hdr, 0, 12);
+        if ((p_riff == NULL) || ((__get32be(p_riff) != WAVE_ID_RIFF) &&
+            (__get32be(p_riff) != WAVE_ID_RF64) && (__get32be(p_riff) != WAVE_ID_BW64)))
+        {
+            E4C_THROW(RuntimeException, "Format not supported");
         }
+        __waveProbe(&hdr, p_fdesc);
+        p_fdesc->probe = en_probe_ok;
     }
     E4C_CATCH(RuntimeException)
     {
         const e4c_exception * e = e4c_get_exception();
-        fprintf(stderr, "Error: %s (%s).", e->name, e->message);
-        err = -1;
+        fprintf(stderr, "[%s] Rejected. Reason: %s (%s).\n", p_fdesc->p_fname,
+                e->name, e->message);
+        p_fdesc->probe = en_probe_bad;
+        p_fdesc->dataLength = 0;
     }
+}
 
-    return (err);
+static int8_t __musicOpen(st_encoder_t* p_enc, st_encFDesc_t* p_fdesc)
+{
+    /* Files are normally probed before, unless the pool failed to take
+     * the probe */
+    if (p_fdesc->probe == en_probe_none)
+        __musicProbe(p_fdesc);
+    if (p_fdesc->probe != en_probe_ok)
+        return (-1);
+
+    if (__encPrepare(MUSIC_IN, p_enc, p_fdesc->p_dir, p_fdesc->p_fname) < 0)
+        return (-1);
+
+    p_enc->fmt = en_music_wave;
+    p_enc->isFloat = p_fdesc->isFloat;
+    p_enc->bps = p_fdesc->bps;
+    p_enc->channels = p_fdesc->channels;
+    p_enc->sampleRate = p_fdesc->sampleRate;
+    p_enc->dataLength = p_fdesc->dataLength;
+
+    return (os_fOffset(p_enc->p_fp, p_fdesc->dataOffset));
 }
 
-/* Currently supports only WAVE headers */
-static int8_t __musicPrepare(lame_t p_lame, st_encoder_t* p_enc)
+static lame_t __lameCreate(const st_encoder_t* p_enc)
 {
-    assert(p_enc != NULL);
-    assert(p_enc->p_fp != NULL);
-    assert(p_lame != NULL);
+    lame_t      p_lame = lame_init();
+    /* DataLength == NumSamples * NumChannels * BitsPerSample/8 */
+    uint32_t    frameBytes = ((p_enc->bps + 7) >> 3) * p_enc->channels;
 
-    int32_t i32 = 0;
-    int8_t err = 0;
+    if (p_lame == NULL)
+        return (NULL);
 
-    /* In case of WAVE file it's a RIFF header*/
-    i32 = os_read32be(p_enc->p_fp);
-    if (i32 == WAVE_ID_RIFF)
-    {
-        p_enc->fmt = en_music_wave;
-        __wavePrepare(p_lame, p_enc);
-    }
-    else
+    if ((lame_set_num_channels(p_lame, p_enc->channels) < 0) ||
+        (lame_set_in_samplerate(p_lame, p_enc->sampleRate) < 0))
     {
-        os_fOffset(p_enc->p_fp, -4);
-        fprintf(stderr, "File [%*.*s]: %s", 1, 80, p_enc->path,
-                "Format not supported");
-        err = -1;
+        lame_close(p_lame);
+        return (NULL);
     }
+    lame_set_num_samples(p_lame, p_enc->dataLength / frameBytes);
+    lame_set_VBR(p_lame, vbr_default);
+    /* https://sourceforge.net/p/lame/mailman/message/18557283/
+     * before calling lame_init_param, disable automatic ID3 tag writing: */
+    lame_set_write_id3tag_automatic(p_lame, 0);
 
-    return (err);
+    return (p_lame);
+}
+
+static uint8_t __isDirect(uint8_t bps, uint8_t isFloat)
+{
+    return (isFloat || ((bps == sizeof(int16_t)) && MUSIC_NATIVE16));
 }
 
-static void __flopBytes(uint8_t* p_in, uint16_t inSize, int32_t* p_outL,
-        int32_t* p_outR, uint16_t maxOut, uint8_t bps)
+static int32_t __encodeBlock(lame_t p_lame, os_splitFlop_t p_split, uint8_t* p_data,
+                             uint32_t samples, uint8_t bps, uint8_t isFloat,
+                             int32_t** pp_channels, uint8_t* p_outBuf, uint32_t outSize)
 {
-    assert(p_in != NULL);
-    assert(p_outL != NULL);
+    uint8_t     numChannels = lame_get_num_channels(p_lame);
+    int32_t     numSamples = samples / numChannels;
 
-    /* Input pointer */
-    uint8_t* p_ip = (uint8_t *) p_in;
+    if (p_split != NULL)
+    {
+        p_split(p_data, pp_channels[0], pp_channels[1], bps * samples);
+        return (lame_encode_buffer_int(p_lame, pp_channels[0],
+                                       numChannels==2?pp_channels[1]:NULL,
+                                       numSamples, p_outBuf, outSize));
+    }
 
-    switch (bps)
+    if (isFloat)
     {
-    case 1:
-        os_splitFlopUI8(p_ip, p_outL, p_outR, inSize);
-        break;
-    case 2:
-        os_splitFlopI16(p_ip, p_outL, p_outR, inSize);
-        break;
-    case 3:
-        os_splitFlopI24(p_ip, p_outL, p_outR, inSize);
-        break;
-    case 4:
-        os_splitFlopI32(p_ip, p_outL, p_outR, inSize);
-        break;
+        /* LAME reads interleaved pairs only, mono is a single channel */
+        if (bps == sizeof(double))
+        {
+            if (numChannels == 2)
+                return (lame_encode_buffer_interleaved_ieee_double(p_lame,
+                        (const double*) p_data, numSamples, p_outBuf, outSize));
+            return (lame_encode_buffer_ieee_double(p_lame, (const double*) p_data,
+                    NULL, numSamples, p_outBuf, outSize));
+        }
+        if (numChannels == 2)
+            return (lame_encode_buffer_interleaved_ieee_float(p_lame,
+                    (const float*) p_data, numSamples, p_outBuf, outSize));
+        return (lame_encode_buffer_ieee_float(p_lame, (const float*) p_data,
+                NULL, numSamples, p_outBuf, outSize));
     }
-}
 
-/*
- * --- Global Functions Definition ------------------------------------------ *
- */
+    if (numChannels == 2)
+        return (lame_encode_buffer_interleaved(p_lame, (short*) p_data,
+                numSamples, p_outBuf, outSize));
+    return (lame_encode_buffer(p_lame, (const short*) p_data, NULL,
+            numSamples, p_outBuf, outSize));
+}
 
-int8_t music_procFile(char* p_dirPath, char* p_fname)
+static uint8_t __tuneClass(uint64_t dataLength)
 {
-    /* Absolute path to the file because it's too expensive to
-     * store absolute path for each file */
-    char p_path[MAX_FILEPATH] = { '\0' };
-
-    lame_t          p_lame = NULL;
-    /* Structure to hold info about input file */
-    st_encoder_t    inFile;
-    /* We create a separate buffer for each channel */
-    int32_t         p_channels[2][INBUF_SIZE];
-    /* Number of channels, will be detected further */
-    uint8_t         numChannels = 1;
-    /* We read inFile into this buffer bytewise */
-    uint8_t         p_inBuf[INBUF_SIZE];
-    /* Bytes per sample, will be detected further */
-    uint8_t         bytesPS = 0;
+    uint8_t     cls = 0;
+    uint8_t     best = 0;
+    uint64_t    bytes = 0;
+    uint64_t    nsec = 0;
+    /* Best throughput so far in bytes per nanosecond */
+    double      rate = 0;
+
+    /* Initial guess, the biggest class not exceeding the wanted size */
+    while ((cls + 1 < TUNE_CLASSES) &&
+           ((1u << (cls + 1 + TUNE_MIN_SHIFT)) <= (dataLength / TUNE_BLOCKS)))
+    {
+        cls++;
+    }
+    best = cls;
 
-    /* Structure to hold info about output file */
-    st_encoder_t    outFile =
-    { 0 };
-    /* LAME requires buffer of unsigned char as output */
-    uint8_t         p_outBuf[OUTBUF_SIZE];
+    for (int i = (cls > 0) ? cls - 1 : 0; (i <= cls + 1) && (i < TUNE_CLASSES); i++)
+    {
+        /* There is no point to try a block bigger than the file */
+        if ((i > cls) && ((1u << (i + TUNE_MIN_SHIFT)) > dataLength))
+            break;
 
-    /* We read data from a given file framewise,
-     * so we need to store its size  */
-    uint32_t        frameLen = 0;
+        bytes = atomic_load_explicit(&music_tuneBytes[i], memory_order_relaxed);
+        nsec = atomic_load_explicit(&music_tuneNsec[i], memory_order_relaxed);
+        if ((bytes == 0) || (nsec == 0))
+        {
+            best = i;
+            break;
+        }
+        if (((double) bytes / nsec) > rate)
+        {
+            rate = (double) bytes / nsec;
+            best = i;
+        }
+    }
 
-    /* Finite State Machine to store state of data processing
-     * entry -> en_mfsm_akkudata <->  en_mfsm_encode
-     *                            ->  en_mfsm_flush  -> en_mfsm_exit -> exit*/
-    en_musicFSM_t   encFSM = en_mfsm_akkudata;
-    int32_t         numSamples = 0;
-    int8_t          ret = 0;
+    return (best);
+}
 
-    /* Begin the exception context for a single thread */
-    e4c_context_begin(E4C_TRUE);
+static void __tuneUpdate(uint8_t cls, uint64_t bytes, struct timespec* p_start)
+{
+    struct timespec now;
+    int64_t         nsec = 0;
 
-    E4C_TRY{
-        p_lame = lame_init();
-        if (!p_lame)
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    nsec = (now.tv_sec - p_start->tv_sec) * 1000000000LL +
+           (now.tv_nsec - p_start->tv_nsec);
+    if (nsec > 0)
+    {
+        atomic_fetch_add_explicit(&music_tuneBytes[cls], bytes, memory_order_relaxed);
+        atomic_fetch_add_explicit(&music_tuneNsec[cls], nsec, memory_order_relaxed);
+    }
+}
+
+static void* __allocBuf(size_t size)
+{
+    /* aligned_alloc() wants the size to be a multiple of the alignment */
+    return (aligned_alloc(CACHE_LINE, (size + CACHE_LINE - 1) & ~(size_t) (CACHE_LINE - 1)));
+}
+
+static uint64_t __schedWeight(const st_encFDesc_t* p_fdesc)
+{
+    return (p_fdesc->dataLength ? p_fdesc->dataLength : p_fdesc->fsize);
+}
+
+static int __schedLargest(const void* p_a, const void* p_b)
+{
+    const st_musicOrder_t*  p_oa = p_a;
+    const st_musicOrder_t*  p_ob = p_b;
+
+    if (p_oa->weight != p_ob->weight)
+        return ((p_oa->weight < p_ob->weight) ? 1 : -1);
+
+    return (strcmp(p_oa->p_fname, p_ob->p_fname));
+}
+
+static int __schedSmallest(const void* p_a, const void* p_b)
+{
+    const st_musicOrder_t*  p_oa = p_a;
+    const st_musicOrder_t*  p_ob = p_b;
+
+    if (p_oa->weight != p_ob->weight)
+        return ((p_oa->weight < p_ob->weight) ? -1 : 1);
+
+    return (strcmp(p_oa->p_fname, p_ob->p_fname));
+}
+
+static int32_t __mp3FrameLen(const uint8_t* p_buf, uint32_t left)
+{
+    /* Layer III bitrates in kbps, MPEG1 and MPEG2/2.5 */
+    static const uint16_t bitrates[2][16] = {
+        { 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0 },
+        { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0 } };
+    /* Sample rates of MPEG1, MPEG2 is a half, MPEG2.5 is a quarter */
+    static const uint32_t rates[4] = { 44100, 48000, 32000, 0 };
+    uint8_t     ver = 0;
+    uint8_t     mpeg1 = 0;
+    uint32_t    bitrate = 0;
+    uint32_t    rate = 0;
+
+    if ((left < 4) || (p_buf[0] != 0xFF) || ((p_buf[1] & 0xE0) != 0xE0))
+        return (-1);
+
+    /* 3 - MPEG1, 2 - MPEG2, 0 - MPEG2.5; only Layer III is expected */
+    ver = (p_buf[1] >> 3) & 0x03;
+    if ((ver == 1) || (((p_buf[1] >> 1) & 0x03) != 1))
+        return (-1);
+    mpeg1 = (ver == 3);
+
+    bitrate = bitrates[!mpeg1][p_buf[2] >> 4] * 1000;
+    rate = rates[(p_buf[2] >> 2) & 0x03] >> (mpeg1 ? 0 : (ver == 2) ? 1 : 2);
+    if ((bitrate == 0) || (rate == 0))
+        return (-1);
+
+    return ((mpeg1 ? 144 : 72) * bitrate / rate + ((p_buf[2] >> 1) & 0x01));
+}
+
+static uint64_t __mp3Estimate(lame_t p_lame)
+{
+    /* Typical bitrates of VBR presets V0..V9 for stereo, kbit/s */
+    static const uint16_t   vbrRate[10] =
+    { 245, 225, 190, 175, 165, 130, 115, 100, 85, 65 };
+    uint64_t    numSamples = lame_get_num_samples(p_lame);
+    uint32_t    rate = lame_get_in_samplerate(p_lame);
+    int32_t     kbps = 0;
+    int32_t     q = 0;
+    uint64_t    len = 0;
+
+    if ((rate == 0) || (numSamples == 0) || (numSamples == MAX_UINT32))
+        return (0);
+
+    switch (lame_get_VBR(p_lame))
+    {
+        case vbr_off:
+            kbps = lame_get_brate(p_lame);
+            break;
+        case vbr_abr:
+            kbps = lame_get_VBR_mean_bitrate_kbps(p_lame);
+            break;
+        default:
+            q = lame_get_VBR_q(p_lame);
+            kbps = vbrRate[((q >= 0) && (q <= 9)) ? q : 4];
+            /* VBR spends about half on a single channel */
+            if (lame_get_num_channels(p_lame) == 1)
+                kbps /= 2;
+            break;
+    }
+    if (kbps <= 0)
+        return (0);
+
+    /* kbit/s are 125 bytes/s, the margin covers louder than usual
+     * content and the tag frame */
+    len = numSamples * kbps * 125 / rate;
+    return (len + len / MP3_EST_MARGIN);
+}
+
+static int8_t __splitCreate(lame_t p_lame, const char* p_out, st_encFDesc_t* p_fdesc,
+                            const st_encOpts_t* p_opts)
+{
+    st_musicSplit_t*    p_split = NULL;
+    st_pool_t*          p_pool = pool_self();
+    uint64_t            numSamples = lame_get_num_samples(p_lame);
+    uint32_t            rate = lame_get_in_samplerate(p_lame);
+    uint32_t            frameSize = lame_get_framesize(p_lame);
+    uint32_t            segSamples = 0;
+    uint32_t            segs = 0;
+
+    /* Segments are cut at MP3 frame boundaries, so there must be
+     * no resampling */
+    if ((p_opts->segLength == 0) || (frameSize == 0) ||
+        (lame_get_out_samplerate(p_lame) != rate))
+        return (0);
+
+    /* The decision mustn't depend on the amount of workers, the output
+     * of a split file differs and it's cached by the segment length */
+    segSamples = p_opts->segLength * rate;
+    segSamples -= segSamples % frameSize;
+    if ((segSamples == 0) || (numSamples < 2 * segSamples))
+        return (0);
+
+    p_split = calloc(1, sizeof(st_musicSplit_t));
+    if (p_split == NULL)
+        return (0);
+
+    p_split->p_out = strdup(p_out);
+    segs = (numSamples + segSamples - 1) / segSamples;
+    p_split->segs = segs;
+    p_split->p_segs = calloc(p_split->segs, sizeof(st_musicSeg_t));
+    if ((p_split->p_out == NULL) || (p_split->p_segs == NULL) ||
+        (__encPrepare(MUSIC_OUT, &p_split->outFile, p_fdesc->p_dir, p_split->p_out) < 0))
+    {
+        free(p_split->p_segs);
+        free(p_split->p_out);
+        free(p_split);
+        return (0);
+    }
+    p_split->p_fname = p_fdesc->p_fname;
+    p_split->p_fdesc = p_fdesc;
+    p_split->opts = *p_opts;
+    p_split->numSamples = numSamples;
+    p_split->segSamples = segSamples;
+    p_split->frameSize = frameSize;
+    p_split->overlap = SEG_OVERLAP * frameSize;
+    pthread_mutex_init(&p_split->lock, NULL);
+    os_fAioStart(&p_split->outFile, 0);
+    os_fReserve(&p_split->outFile, __mp3Estimate(p_lame));
+    /* Output is closed by the last segment, after the file task is over */
+    os_dirRetain(p_fdesc->p_dir);
+
+    /* Outside of the pool segments are encoded in order right here,
+     * the last one releases the split */
+    if (p_pool == NULL)
+    {
+        for (uint32_t seg = 0; seg < segs; seg++)
+            __taskSeg(p_split, seg);
+        return (1);
+    }
+
+    /* Segments go to the deque of this worker backwards, so it takes them
+     * from the first one, while idle workers steal from the last one */
+    for (int32_t seg = segs - 1; seg >= 0; seg--)
+    {
+        if (pool_submit(p_pool, __taskSeg, p_split, seg) < 0)
+            __splitDone(p_split, seg, -1);
+    }
+
+    return (1);
+}
+
+static void __splitDone(st_musicSplit_t* p_split, int32_t seg, int8_t err)
+{
+    st_musicSeg_t*  p_seg = &p_split->p_segs[seg];
+    uint64_t        start = (uint64_t) seg * p_split->segSamples;
+    uint64_t        feedStart = (seg == 0) ? 0 : start - p_split->overlap;
+    /* Frames encoded from the overlap before the segment are dropped */
+    uint32_t        drop = (start - feedStart) / p_split->frameSize;
+    /* Frames past the segment are dropped as well, the last segment
+     * keeps everything including the flushed frames */
+    uint32_t        keep = p_split->segSamples / p_split->frameSize;
+    uint32_t        from = 0;
+    uint32_t        off = 0;
+    uint32_t        frame = 0;
+    int32_t         len = 0;
+    uint8_t         last = 0;
+
+    /* Find bytes range of the frames to keep */
+    while ((err == 0) && (off < p_seg->len))
+    {
+        if (frame == drop)
+            from = off;
+        if ((seg != p_split->segs - 1) && (frame == drop + keep))
+            break;
+        len = __mp3FrameLen(p_seg->p_data + off, p_seg->len - off);
+        if (len < 0)
         {
-            E4C_THROW(RuntimeException,"LAME initialization failed. Exit.");
+            fprintf(stderr, "[%s] Broken MP3 stream in segment %lu.\n",
+                    p_split->p_fname, seg);
+            err = -1;
+            break;
         }
+        off += len;
+        frame++;
+    }
+    if (frame <= drop)
+        from = off;
+
+    pthread_mutex_lock(&p_split->lock);
+    if (err < 0)
+        p_split->err = -1;
+    p_seg->from = from;
+    p_seg->len = off;
+    p_seg->ready = 1;
+
+    /* Segments are written strictly in order, whoever completes
+     * the next awaited segment writes it and all ready ones after it */
+    while ((p_split->nextWrite < p_split->segs) &&
+           p_split->p_segs[p_split->nextWrite].ready)
+    {
+        p_seg = &p_split->p_segs[p_split->nextWrite];
+        if (p_split->err == 0)
+            os_fWrite(&p_split->outFile, p_seg->p_data + p_seg->from,
+                      p_seg->len - p_seg->from);
+        free(p_seg->p_data);
+        p_seg->p_data = NULL;
+        p_split->nextWrite++;
+    }
+    last = (++p_split->doneSegs == p_split->segs);
+    pthread_mutex_unlock(&p_split->lock);
 
-        /* Prepare full file path from filename and common directory */
-        if ((p_fname == NULL) || (p_dirPath == NULL))
+    if (last)
+    {
+        if ((p_split->err == 0) && (os_fCommit(&p_split->outFile) < 0))
+            p_split->err = -1;
+        os_fclose(&p_split->outFile);
+        p_split->p_fdesc->done = (p_split->err == 0);
+        if (p_split->err == 0)
+            __cacheStore(p_split->p_out, p_split->p_fdesc, &p_split->opts);
+        if (p_split->err == 0)
+            __nodeAccount(1, 0);
+        else
+            atomic_fetch_add_explicit(&music_failed, 1, memory_order_relaxed);
+        if (p_split->err == 0)
+            printf("[%s] Converting OK (%lu segments)\n", p_split->p_fname,
+                   p_split->segs);
+        else
+            fprintf(stderr, "[%s] Converting FAILED.\n", p_split->p_fname);
+        os_dirRelease(p_split->p_fdesc->p_dir);
+        pthread_mutex_destroy(&p_split->lock);
+        free(p_split->p_segs);
+        free(p_split->p_out);
+        free(p_split);
+    }
+}
+
+static int8_t __musicOut(st_encoder_t* p_out, st_musicSeg_t* p_seg,
+                         uint8_t* p_buf, int32_t len)
+{
+    uint8_t*    p_data = NULL;
+    uint32_t    size = 0;
+
+    if (p_seg == NULL)
+    {
+        os_fWrite(p_out, p_buf, len);
+        return (0);
+    }
+
+    if ((p_seg->len + len) > p_seg->size)
+    {
+        size = p_seg->size ? p_seg->size : (uint32_t) len;
+        while (size < (p_seg->len + len))
+            size *= 2;
+        p_data = realloc(p_seg->p_data, size);
+        if (p_data == NULL)
+            return (-1);
+        p_seg->p_data = p_data;
+        p_seg->size = size;
+    }
+    memcpy(p_seg->p_data + p_seg->len, p_buf, len);
+    p_seg->len += len;
+
+    return (0);
+}
+
+static int8_t __ringInit(st_musicRing_t* p_ring, uint32_t depth, uint32_t slotSize)
+{
+    memset(p_ring, 0, sizeof(st_musicRing_t));
+    pthread_mutex_init(&p_ring->lock, NULL);
+    pthread_cond_init(&p_ring->cond, NULL);
+
+    p_ring->p_slots = calloc(depth, sizeof(st_musicSlot_t));
+    if (p_ring->p_slots == NULL)
+        return (-1);
+    p_ring->depth = depth;
+
+    for (uint32_t i = 0; i < depth; i++)
+    {
+        p_ring->p_slots[i].p_buf = __allocBuf(slotSize);
+        if (p_ring->p_slots[i].p_buf == NULL)
+            return (-1);
+    }
+
+    return (0);
+}
+
+static void __ringFree(st_musicRing_t* p_ring, uint8_t stage)
+{
+    if (p_ring->p_slots != NULL)
+    {
+        for (uint32_t i = 0; i < p_ring->depth; i++)
+            free(p_ring->p_slots[i].p_buf);
+        free(p_ring->p_slots);
+    }
+    pthread_mutex_destroy(&p_ring->lock);
+    pthread_cond_destroy(&p_ring->cond);
+
+    atomic_fetch_add_explicit(&music_pipeFill[stage], p_ring->fill,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&music_pipePushes[stage], p_ring->pushes,
+                              memory_order_relaxed);
+}
+
+static void __ringWait(st_musicRing_t* p_ring, _Atomic uint32_t* p_pos, uint32_t pos)
+{
+    /* The sleeper is announced before the position is checked again and
+     * the other side moves before it checks for sleepers, both in the
+     * single total order, so either of them sees the other one */
+    pthread_mutex_lock(&p_ring->lock);
+    atomic_fetch_add(&p_ring->waiters, 1);
+    while (!atomic_load(&p_ring->stop) && (atomic_load(p_pos) == pos))
+        pthread_cond_wait(&p_ring->cond, &p_ring->lock);
+    atomic_fetch_sub(&p_ring->waiters, 1);
+    pthread_mutex_unlock(&p_ring->lock);
+}
+
+static void __ringWake(st_musicRing_t* p_ring)
+{
+    if (atomic_load(&p_ring->waiters) == 0)
+        return;
+
+    pthread_mutex_lock(&p_ring->lock);
+    pthread_cond_broadcast(&p_ring->cond);
+    pthread_mutex_unlock(&p_ring->lock);
+}
+
+static st_musicSlot_t* __ringAcquire(st_musicRing_t* p_ring)
+{
+    uint32_t    head = atomic_load_explicit(&p_ring->head, memory_order_relaxed);
+    uint32_t    tail = atomic_load_explicit(&p_ring->tail, memory_order_acquire);
+
+    while ((head - tail) == p_ring->depth)
+    {
+        if (atomic_load_explicit(&p_ring->stop, memory_order_relaxed))
+            return (NULL);
+        __ringWait(p_ring, &p_ring->tail, tail);
+        tail = atomic_load_explicit(&p_ring->tail, memory_order_acquire);
+    }
+    if (atomic_load_explicit(&p_ring->stop, memory_order_relaxed))
+        return (NULL);
+
+    return (&p_ring->p_slots[head % p_ring->depth]);
+}
+
+static void __ringPush(st_musicRing_t* p_ring)
+{
+    uint32_t    head = atomic_load_explicit(&p_ring->head, memory_order_relaxed) + 1;
+
+    /* Statistics belong to the producer, they're read after both sides
+     * are over */
+    p_ring->fill += (head - atomic_load_explicit(&p_ring->tail, memory_order_relaxed)) *
+                    1000 / p_ring->depth;
+    p_ring->pushes++;
+    atomic_store(&p_ring->head, head);
+    __ringWake(p_ring);
+}
+
+static st_musicSlot_t* __ringPeek(st_musicRing_t* p_ring)
+{
+    uint32_t    tail = atomic_load_explicit(&p_ring->tail, memory_order_relaxed);
+    uint32_t    head = atomic_load_explicit(&p_ring->head, memory_order_acquire);
+
+    while (head == tail)
+    {
+        if (atomic_load_explicit(&p_ring->stop, memory_order_relaxed))
+            return (NULL);
+        __ringWait(p_ring, &p_ring->head, head);
+        head = atomic_load_explicit(&p_ring->head, memory_order_acquire);
+    }
+    if (atomic_load_explicit(&p_ring->stop, memory_order_relaxed))
+        return (NULL);
+
+    return (&p_ring->p_slots[tail % p_ring->depth]);
+}
+
+static void __ringPop(st_musicRing_t* p_ring)
+{
+    atomic_store(&p_ring->tail, atomic_load_explicit(&p_ring->tail, memory_order_relaxed) + 1);
+    __ringWake(p_ring);
+}
+
+static void __ringStop(st_musicRing_t* p_ring)
+{
+    pthread_mutex_lock(&p_ring->lock);
+    atomic_store(&p_ring->stop, 1);
+    pthread_cond_broadcast(&p_ring->cond);
+    pthread_mutex_unlock(&p_ring->lock);
+}
+
+static void* __pipeReader(void* p_arg)
+{
+    st_musicPipe_t* p_pipe = (st_musicPipe_t*) p_arg;
+    st_musicSlot_t* p_slot = NULL;
+    uint8_t         bytesPS = p_pipe->bytesPS;
+    uint32_t        toRead = 0;
+
+    do
+    {
+        p_slot = __ringAcquire(&p_pipe->inRing);
+        if (p_slot == NULL)
+            break;
+
+        toRead = p_pipe->blockSize / bytesPS;
+        if (toRead > p_pipe->dataLeft / bytesPS)
+            toRead = p_pipe->dataLeft / bytesPS;
+
+        p_slot->p_data = p_slot->p_buf;
+        p_slot->len = os_fRead(p_pipe->p_in, &p_slot->p_data, bytesPS, toRead);
+        /* The block is used after next reads, only mapped data stays valid,
+         * samples passed to LAME as they are have to be aligned */
+        if ((p_slot->p_data != p_slot->p_buf) && ((p_pipe->p_in->p_map == NULL) ||
+            (p_pipe->direct && ((uintptr_t) p_slot->p_data % bytesPS))))
         {
-            E4C_THROW(ProgramSignalException, "Filename empty. Exit.");
+            memcpy(p_slot->p_buf, p_slot->p_data, p_slot->len * bytesPS);
+            p_slot->p_data = p_slot->p_buf;
+        }
+        /* Asynchronous reads stop at the end of their block, but nothing
+         * read before the end of the data means the file is truncated or
+         * failed to read */
+        if ((p_slot->len == 0) && (toRead > 0))
+        {
+            fprintf(stderr, "Failed to read input data.\n");
+            __ringStop(&p_pipe->inRing);
+            break;
         }
+        p_slot->last = (toRead == 0);
+        p_pipe->dataLeft -= p_slot->len * bytesPS;
 
-        /* Make a relative path from two inputs */
-        os_mkPath(p_path, p_dirPath, p_fname, MAX_FILEPATH);
+        __ringPush(&p_pipe->inRing);
+    } while (!p_slot->last);
 
-        /* Initialize encoder structure with all relevant values */
-        if (__encPrepare(MUSIC_IN, &inFile, p_path) < 0)
+    return (NULL);
+}
+
+static void* __pipeWriter(void* p_arg)
+{
+    st_musicPipe_t* p_pipe = (st_musicPipe_t*) p_arg;
+    st_musicSlot_t* p_slot = NULL;
+    uint8_t         last = 0;
+
+    while (!last && ((p_slot = __ringPeek(&p_pipe->outRing)) != NULL))
+    {
+        last = p_slot->last;
+        if (__musicOut(p_pipe->p_out, p_pipe->p_seg, p_slot->p_buf, p_slot->len) < 0)
         {
-            E4C_THROW(ProgramSignalException, "Encoder struct initialization failed. Exit.");
+            p_pipe->err = -1;
+            __ringStop(&p_pipe->outRing);
+            break;
         }
-        memset(p_channels[0], 0, INBUF_SIZE);
-        memset(p_channels[1], 0, INBUF_SIZE);
-        memset(p_inBuf, 0, INBUF_SIZE);
+        __ringPop(&p_pipe->outRing);
+    }
+
+    return (NULL);
+}
+
+static int8_t __encodePiped(lame_t p_lame, st_musicPipe_t* p_pipe, int32_t** pp_channels,
+                            uint32_t outSize, uint32_t depth)
+{
+    st_musicSlot_t* p_inSlot = NULL;
+    st_musicSlot_t* p_outSlot = NULL;
+    uint8_t         bytesPS = p_pipe->bytesPS;
+    pthread_t       reader;
+    pthread_t       writer;
+    uint8_t         stages = 0;
+    uint8_t         last = 0;
+    int32_t         mp3Len = 0;
+    int8_t          err = 0;
+
+    err = __ringInit(&p_pipe->inRing, depth, p_pipe->blockSize);
+    if (__ringInit(&p_pipe->outRing, depth, outSize) < 0)
+        err = -1;
+
+    if (err < 0)
+    {
+        fprintf(stderr, "Failed to allocate pipeline queues.\n");
+    }
+    else
+    {
+        if (pthread_create(&reader, NULL, __pipeReader, p_pipe) == 0)
+            stages++;
+        if ((stages == 1) && (pthread_create(&writer, NULL, __pipeWriter, p_pipe) == 0))
+            stages++;
+        if (stages < 2)
+            err = -1;
+    }
 
-        if (__musicPrepare(p_lame, &inFile) < 0)
+    while ((err == 0) && !last)
+    {
+        p_inSlot = __ringPeek(&p_pipe->inRing);
+        p_outSlot = __ringAcquire(&p_pipe->outRing);
+        if ((p_inSlot == NULL) || (p_outSlot == NULL))
         {
-            E4C_THROW(ProgramSignalException, "Failed to parse a header for input. Exit.");
+            err = -1;
+            break;
         }
 
-        lame_set_VBR(p_lame, vbr_default);
-        /* https://sourceforge.net/p/lame/mailman/message/18557283/
-         * before calling lame_init_param, disable automatic ID3 tag writing: */
-        lame_set_write_id3tag_automatic(p_lame, 0);
-        if (lame_init_params(p_lame) < 0)
+        last = p_inSlot->last;
+        if (last)
+        {
+            mp3Len = lame_encode_flush(p_lame, p_outSlot->p_buf, outSize);
+        }
+        else
         {
-            E4C_THROW(RuntimeException, "Failed to init LAME parameters. Exit.\n");
+            mp3Len = __encodeBlock(p_lame, p_pipe->p_split, p_inSlot->p_data,
+                                   p_inSlot->len, bytesPS, p_pipe->p_in->isFloat,
+                                   pp_channels, p_outSlot->p_buf, outSize);
         }
+        __ringPop(&p_pipe->inRing);
 
-        if (__encPrepare(MUSIC_OUT, &outFile, p_path) < 0)
+        if (mp3Len < 0)
         {
-            E4C_THROW(RuntimeException, "Encoder struct initialization failed. Exit.");
+            err = -1;
+            break;
         }
-        memset(p_outBuf, 0, OUTBUF_SIZE);
+        p_outSlot->len = mp3Len;
+        p_outSlot->last = last;
+        __ringPush(&p_pipe->outRing);
+    }
+
+    /* Let stages leave on failure, otherwise they finish by themselves */
+    if (err < 0)
+    {
+        __ringStop(&p_pipe->inRing);
+        __ringStop(&p_pipe->outRing);
+    }
+    if (stages > 0)
+        pthread_join(reader, NULL);
+    if (stages > 1)
+        pthread_join(writer, NULL);
 
-        numChannels = lame_get_num_channels(p_lame);
-        bytesPS = (inFile.bps + 7) >> 3;
-        do
+    __ringFree(&p_pipe->inRing, 0);
+    __ringFree(&p_pipe->outRing, 1);
+
+    return ((err < 0) ? err : p_pipe->err);
+}
+
+static int8_t __encodeData(lame_t p_lame, st_encoder_t* p_in, st_encoder_t* p_out,
+                           st_musicSeg_t* p_seg, uint64_t dataLeft,
+                           const st_encOpts_t* p_opts)
+{
+    /* We create a separate buffer for each channel unless samples
+     * are passed to LAME directly */
+    int32_t*        p_channels[2] = { NULL, NULL };
+    /* Number of channels */
+    uint8_t         numChannels = lame_get_num_channels(p_lame);
+    /* We read inFile into this buffer bytewise */
+    uint8_t*        p_inBuf = NULL;
+    /* Samples to convert, either p_inBuf or mapped inFile data */
+    uint8_t*        p_data = NULL;
+    /* Amount of samples to read at once */
+    uint32_t        toRead = 0;
+    /* Bytes per sample */
+    uint8_t         bytesPS = (p_in->bps + 7) >> 3;
+    uint8_t         direct = __isDirect(bytesPS, p_in->isFloat);
+    /* Integer samples are converted by a routine bound once per file */
+    os_splitFlop_t  p_split = direct ? NULL : os_splitFlopGet(bytesPS, numChannels);
+    /* LAME requires buffer of unsigned char as output */
+    uint8_t*        p_outBuf = NULL;
+    /* LAME needs 1.25 * samples + 7200 bytes in the worst case */
+    uint32_t        outSize = 0;
+    uint32_t        blockSize = p_opts->blockSize;
+    /* Reader and writer stages if pipelining is enabled */
+    st_musicPipe_t  pipe;
+    /* Block size class chosen by auto tuning */
+    uint8_t         tuneCls = 0;
+    uint8_t         tuned = 0;
+    uint64_t        dataLength = dataLeft;
+    struct timespec start;
+
+    /* We read data from a given file framewise,
+     * so we need to store its size  */
+    uint32_t        frameLen = 0;
+    /* Length of encoded data or negative LAME error */
+    int32_t         mp3Len = 0;
+
+    /* Finite State Machine to store state of data processing
+     * entry -> en_mfsm_akkudata <->  en_mfsm_encode
+     *                            ->  en_mfsm_flush  -> en_mfsm_exit -> exit*/
+    en_musicFSM_t   encFSM = en_mfsm_akkudata;
+    int8_t          err = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (blockSize == 0)
+    {
+        tuneCls = __tuneClass(dataLeft);
+        blockSize = 1u << (tuneCls + TUNE_MIN_SHIFT);
+        tuned = 1;
+    }
+    /* Block has to hold whole frames only */
+    blockSize -= blockSize % (bytesPS * numChannels);
+    outSize = (blockSize / bytesPS / numChannels) * 5 / 4 + 7200;
+
+    if (!direct)
+    {
+        p_channels[0] = __allocBuf((blockSize / bytesPS) * sizeof(int32_t));
+        p_channels[1] = __allocBuf((blockSize / bytesPS) * sizeof(int32_t));
+    }
+    /* Queues of the pipeline bring their own blocks */
+    if (p_opts->pipeDepth == 0)
+    {
+        p_inBuf = __allocBuf(blockSize);
+        p_outBuf = __allocBuf(outSize);
+    }
+    if ((!direct && ((p_channels[0] == NULL) || (p_channels[1] == NULL))) ||
+        ((p_opts->pipeDepth == 0) && ((p_inBuf == NULL) || (p_outBuf == NULL))))
+    {
+        fprintf(stderr, "Failed to allocate buffers.\n");
+        encFSM = en_mfsm_invalid;
+        err = -1;
+    }
+
+    /* Samples are read ahead asynchronously if possible, otherwise
+     * taken directly from the page cache if the file can be mapped,
+     * otherwise we read them through the FILE stream */
+    if (os_fAioStart(p_in, dataLeft) < 0)
+    {
+        os_fMap(p_in, dataLeft);
+    }
+
+    /* Reading and writing run on their own threads, so the encoder
+     * doesn't wait for the storage */
+    if ((err == 0) && (p_opts->pipeDepth != 0))
+    {
+        memset(&pipe, 0, sizeof(pipe));
+        pipe.p_in = p_in;
+        pipe.p_out = p_out;
+        pipe.p_seg = p_seg;
+        pipe.dataLeft = dataLeft;
+        pipe.blockSize = blockSize;
+        pipe.bytesPS = bytesPS;
+        pipe.direct = direct;
+        pipe.p_split = p_split;
+        err = __encodePiped(p_lame, &pipe, p_channels, outSize, p_opts->pipeDepth);
+        encFSM = en_mfsm_exit;
+    }
+
+    while (encFSM != en_mfsm_exit)
+    {
+        switch (encFSM)
         {
-            switch (encFSM)
+            case en_mfsm_akkudata:
             {
-                case en_mfsm_akkudata:
+                /* We read fixed portion of samples from file to
+                 * uin8_t buffer and try to  rearrange them in a channel
+                 * buffer of uint32_t so that LAME can
+                 * understand those files
+                 * Example:
+                 * 1) p_channels --> L[00:00:00:00]R[00:00:00:00]
+                 * 2) p_inBuf -->     [11:22:33:44:55:66:77:88]
+                 * 3) bytesPerSample = 4
+                 * 4) __swapBytes()
+                 * 5) p_channels --> L[44:33:22:11]R[88:77:66:55]
+                 * */
+                toRead = blockSize / bytesPS;
+                if (toRead > dataLeft / bytesPS)
+                    toRead = dataLeft / bytesPS;
+
+                p_data = p_inBuf;
+                frameLen = os_fRead(p_in, &p_data, bytesPS, toRead);
+                dataLeft -= frameLen * bytesPS;
+                if ((frameLen == 0) && (toRead > 0))
                 {
-                    /* We read fixed portion of samples from file to
-                     * uin8_t buffer and try to  rearrange them in a channel
-                     * buffer of uint32_t so that LAME can
-                     * understand those files
-                     * Example:
-                     * 1) p_channels --> L[00:00:00:00]R[00:00:00:00]
-                     * 2) p_inBuf -->     [11:22:33:44:55:66:77:88]
-                     * 3) bytesPerSample = 4
-                     * 4) __swapBytes()
-                     * 5) p_channels --> L[44:33:22:11]R[88:77:66:55]
-                     * */
-                    frameLen = os_fread_unlocked(p_inBuf, bytesPS, INBUF_SIZE/bytesPS, inFile.p_fp);
-
-                    if (frameLen == 0)
-                        encFSM = en_mfsm_flush;
-                    else
-                        encFSM = en_mfsm_encode;
+                    fprintf(stderr, "Failed to read input data.\n");
+                    encFSM = en_mfsm_invalid;
+                    err = -1;
                     break;
                 }
-                case en_mfsm_encode:
+                /* Samples passed to LAME as they are have to be aligned */
+                if (direct && ((uintptr_t) p_data % bytesPS))
                 {
-                    __flopBytes(p_inBuf,bytesPS * frameLen ,
-                                p_channels[0], numChannels==2?p_channels[1]:NULL, INBUF_SIZE,
-                                bytesPS);
-
-                    numSamples = frameLen/numChannels;
-
-                    if (numChannels == 2){
-                        frameLen = lame_encode_buffer_int(p_lame, p_channels[0], p_channels[1], 
-                                                          numSamples, p_outBuf, OUTBUF_SIZE);
-                    }
-                    else {
-                        frameLen = lame_encode_buffer_int(p_lame, p_channels[0], NULL,
-                                                          numSamples, p_outBuf, OUTBUF_SIZE);
-                    }
-                    if (frameLen < 0)
-                    {
-                        E4C_THROW(RuntimeException, "Failed to encode file. Exit.");
-                    }
-
-                    os_fwrite_unlocked(p_outBuf, 1, frameLen, outFile.p_fp);
-
-                    encFSM = en_mfsm_akkudata;
+                    memcpy(p_inBuf, p_data, frameLen * bytesPS);
+                    p_data = p_inBuf;
                 }
-                break;
 
-                case en_mfsm_flush:
+                if (frameLen == 0)
+                    encFSM = en_mfsm_flush;
+                else
+                    encFSM = en_mfsm_encode;
+                break;
+            }
+            case en_mfsm_encode:
+            {
+                mp3Len = __encodeBlock(p_lame, p_split, p_data, frameLen, bytesPS,
+                                       p_in->isFloat, p_channels, p_outBuf, outSize);
+                encFSM = en_mfsm_akkudata;
+                if ((mp3Len < 0) || (__musicOut(p_out, p_seg, p_outBuf, mp3Len) < 0))
                 {
-                    frameLen = lame_encode_flush(p_lame, p_outBuf, OUTBUF_SIZE);
-                    os_fwrite_unlocked(p_outBuf, frameLen, 1, outFile.p_fp);
-                    encFSM = en_mfsm_exit;
+                    encFSM = en_mfsm_invalid;
+                    err = -1;
                 }
-                break;
+            }
+            break;
 
-                case en_mfsm_invalid:
-                default:
+            case en_mfsm_flush:
+            {
+                mp3Len = lame_encode_flush(p_lame, p_outBuf, outSize);
                 encFSM = en_mfsm_exit;
-                break;
+                if ((mp3Len < 0) || (__musicOut(p_out, p_seg, p_outBuf, mp3Len) < 0))
+                {
+                    err = -1;
+                }
             }
-        }while (encFSM != en_mfsm_exit);
-        ret = 1;
+            break;
+
+            case en_mfsm_invalid:
+            default:
+            encFSM = en_mfsm_exit;
+            break;
+        }
+    }
 
-        printf("[%s] Converting OK \n", p_fname);
+    if (tuned && (err == 0))
+    {
+        __tuneUpdate(tuneCls, dataLength, &start);
+    }
+    if (err == 0)
+    {
+        __nodeAccount(0, dataLength);
+    }
+
+    free(p_inBuf);
+    free(p_channels[0]);
+    free(p_channels[1]);
+    free(p_outBuf);
+
+    return (err);
+}
+
+static int8_t __procPart(const char* p_out, st_encFDesc_t* p_fdesc, const st_encOpts_t* p_opts,
+                         st_musicSplit_t* p_split, int32_t seg)
+{
+    char*           p_fname = p_fdesc->p_fname;
+    lame_t          p_lame = NULL;
+    /* Structure to hold info about input file */
+    st_encoder_t    inFile =
+    { 0 };
+    /* Structure to hold info about output file */
+    st_encoder_t    outFile =
+    { 0 };
+    /* Output of a segment is collected here instead of outFile */
+    st_musicSeg_t*  p_seg = NULL;
+    /* Samples range of a segment including overlaps */
+    uint64_t        feedStart = 0;
+    uint64_t        feedEnd = 0;
+    /* Bytes per sample frame, will be detected further */
+    uint32_t        frameBytes = 0;
+    /* Samples data to encode */
+    uint64_t        dataLength = 0;
+    /* Whole file was written by this call */
+    uint8_t         written = 0;
+    uint8_t         split = 0;
+    int8_t          ret = 0;
+    /* Workers keep their exception context for all files */
+    uint8_t         ownCtx = !e4c_context_is_ready();
+
+    /* Begin the exception context for a single thread */
+    if (ownCtx)
+        e4c_context_begin(E4C_TRUE);
+
+    E4C_TRY{
+        /* Initialize encoder structure with all relevant values,
+         * the header is usually known from the probe already */
+        if (__musicOpen(&inFile, p_fdesc) < 0)
+        {
+            E4C_THROW(ProgramSignalException, "Failed to parse a header for input. Exit.");
+        }
+
+        frameBytes = ((inFile.bps + 7) >> 3) * inFile.channels;
+        dataLength = inFile.dataLength;
+
+        /* Every file gets a fresh instance, LAME can't reset its sample
+         * buffers, so the tail of a file would leak into the next one.
+         * Segments change their settings before initialization. */
+        p_lame = __lameCreate(&inFile);
+        if (!p_lame || ((p_split == NULL) && (lame_init_params(p_lame) < 0)))
+        {
+            E4C_THROW(RuntimeException,"LAME initialization failed. Exit.");
+        }
+
+        if (p_split != NULL)
+        {
+            /* Encode the segment together with overlaps on both sides,
+             * frames from overlaps prime the encoder and are dropped later */
+            p_seg = &p_split->p_segs[seg];
+            feedStart = (uint64_t) seg * p_split->segSamples;
+            feedStart = (seg == 0) ? 0 : feedStart - p_split->overlap;
+            feedEnd = (uint64_t) (seg + 1) * p_split->segSamples + p_split->overlap;
+            if (feedEnd > p_split->numSamples)
+                feedEnd = p_split->numSamples;
+
+            if (os_fOffset(inFile.p_fp, feedStart * frameBytes) < 0)
+            {
+                E4C_THROW(RuntimeException, "Failed to seek to a segment. Exit.");
+            }
+            dataLength = (feedEnd - feedStart) * frameBytes;
+            lame_set_num_samples(p_lame, feedEnd - feedStart);
+
+            /* Frames have to be self-contained to be stitched. The VBR
+             * tag frame would count the frames of one segment only, while
+             * the totals of the whole file aren't known to any encoder */
+            lame_set_out_samplerate(p_lame, lame_get_in_samplerate(p_lame));
+            lame_set_disable_reservoir(p_lame, 1);
+            lame_set_bWriteVbrTag(p_lame, 0);
+
+            if (lame_init_params(p_lame) < 0)
+            {
+                E4C_THROW(RuntimeException, "Failed to init LAME parameters. Exit.\n");
+            }
+        }
+
+        if ((p_split == NULL) && __splitCreate(p_lame, p_out, p_fdesc, p_opts))
+        {
+            /* Long file was split into segments for all threads, it's
+             * finished by the thread, which encodes the last segment */
+            split = 1;
+        }
+        else
+        {
+            if ((p_split == NULL) &&
+                (__encPrepare(MUSIC_OUT, &outFile, p_fdesc->p_dir, p_out) < 0))
+            {
+                E4C_THROW(RuntimeException, "Encoder struct initialization failed. Exit.");
+            }
+            /* Writes go in background if possible, the reservation
+             * doesn't give stdio a buffer then */
+            if (p_split == NULL)
+            {
+                os_fAioStart(&outFile, 0);
+                os_fReserve(&outFile, __mp3Estimate(p_lame));
+            }
+
+            if (__encodeData(p_lame, &inFile, &outFile, p_seg, dataLength,
+                             p_opts) < 0)
+            {
+                E4C_THROW(RuntimeException, "Failed to encode file. Exit.");
+            }
+
+            if ((p_split == NULL) && (os_fCommit(&outFile) < 0))
+            {
+                E4C_THROW(RuntimeException, "Failed to write file. Exit.");
+            }
+
+            if (p_split == NULL)
+            {
+                written = 1;
+                printf("[%s] Converting OK \n", p_fname);
+            }
+        }
+        ret = split ? 0 : 1;
     }
     E4C_CATCH (RuntimeException)
     {
         const e4c_exception * e = e4c_get_exception();
-        fprintf(stderr, "[%s] Converting FAILED. Reason: %s (%s).", e->name, e->message);
+        fprintf(stderr, "[%s] Converting FAILED. Reason: %s (%s).", p_fname, e->name, e->message);
         ret = -1;
     }
     E4C_CATCH (ProgramSignalException)
     {
         const e4c_exception * e = e4c_get_exception();
-        fprintf(stderr, "[%s] Converting FAILED. Reason: %s (%s).", e->name, e->message);
+        fprintf(stderr, "[%s] Converting FAILED. Reason: %s (%s).", p_fname, e->name, e->message);
         ret = -1;
     }
 
-    lame_close(p_lame);
+    if (p_lame != NULL)
+        lame_close(p_lame);
 
     /* Leave exception context */
-    e4c_context_end();
+    if (ownCtx)
+        e4c_context_end();
 
     os_fclose(&inFile);
     os_fclose(&outFile);
 
+    /* Split files are completed by their last segment */
+    if (written)
+    {
+        p_fdesc->done = 1;
+        __cacheStore(p_out, p_fdesc, p_opts);
+    }
+
+    if (p_split != NULL)
+    {
+        __splitDone(p_split, seg, (ret < 0) ? -1 : 0);
+    }
+
+    return (ret);
+}
+
+static uint8_t __cacheFetch(const char* p_out, st_encFDesc_t* p_fdesc,
+                            const st_encOpts_t* p_opts)
+{
+    st_encoder_t    inFile = { 0 };
+
+    /* Samples are hashed in a pass of their own, as the lookup has to
+     * happen before encoding starts */
+    p_fdesc->key = 0;
+    if (__musicOpen(&inFile, p_fdesc) == 0)
+    {
+        p_fdesc->key = cache_key(&inFile, p_opts);
+    }
+    os_fclose(&inFile);
+
+    if (p_fdesc->key == 0)
+        return (0);
+
+    if (cache_fetch(p_opts->p_cache, p_fdesc->key, p_fdesc->p_dir, p_out) < 0)
+        return (0);
+
+    atomic_fetch_add_explicit(&music_doneBytes, p_fdesc->dataLength, memory_order_relaxed);
+    return (1);
+}
+
+static void __cacheStore(const char* p_out, st_encFDesc_t* p_fdesc, const st_encOpts_t* p_opts)
+{
+    if ((p_opts->p_cache == NULL) || (p_fdesc->key == 0))
+        return;
+
+    cache_store(p_opts->p_cache, p_fdesc->key, p_fdesc->p_dir, p_out);
+}
+
+static void __nodeAccount(uint32_t files, uint64_t bytes)
+{
+    uint32_t    node = os_cpuNode();
+
+    if (node >= MAX_NODES)
+        node = MAX_NODES - 1;
+
+    atomic_fetch_add_explicit(&music_nodeFiles[node], files, memory_order_relaxed);
+    atomic_fetch_add_explicit(&music_nodeBytes[node], bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&music_doneBytes, bytes, memory_order_relaxed);
+}
+
+static void __progress(void)
+{
+    uint64_t    done = atomic_load_explicit(&music_doneBytes, memory_order_relaxed);
+    uint64_t    total = atomic_load_explicit(&music_totalBytes, memory_order_relaxed);
+    int64_t     last = atomic_load_explicit(&music_progressNsec, memory_order_relaxed);
+    int64_t     now = __clockNsec();
+    int64_t     start = 0;
+    uint64_t    eta = 0;
+
+    if ((total == 0) || (done == 0) || ((now - last) < PROGRESS_NSEC))
+        return;
+
+    /* Only one of the threads which noticed the period is over prints */
+    if (!atomic_compare_exchange_strong(&music_progressNsec, &last, now))
+        return;
+
+    /* Segments are encoded with overlaps, so the count runs a bit ahead.
+     * Until the scan is over the total covers the files found so far. */
+    if (done > total)
+        done = total;
+    start = atomic_load_explicit(&music_startNsec, memory_order_relaxed);
+    eta = (uint64_t) ((double) (now - start) / 1000000000.0 *
+                      (total - done) / done);
+    printf("Progress: %lu%%, ETA %lu s\n", done * 100 / total, eta);
+}
+
+static int64_t __clockNsec(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec * 1000000000LL + now.tv_nsec);
+}
+
+static void __taskSeg(void* p_ctx, uint32_t idx)
+{
+    st_musicSplit_t*    p_split = (st_musicSplit_t*) p_ctx;
+
+    __procPart(p_split->p_out, p_split->p_fdesc, &p_split->opts, p_split, idx);
+    __progress();
+}
+
+static void __taskFile(void* p_ctx, uint32_t idx)
+{
+    st_encArg_t*    p_tArgs = (st_encArg_t*) p_ctx;
+    st_encFDesc_t*  p_fdesc = ENC_FDESC(p_tArgs, idx);
+    int8_t          ret = 0;
+
+    /* Files in directory order are probed right before conversion */
+    if (p_fdesc->probe == en_probe_none)
+        __taskProbe(p_ctx, idx);
+    if (p_fdesc->probe != en_probe_bad)
+    {
+        /* Split files are accounted once their last segment is written */
+        ret = music_procFile(p_fdesc, &p_tArgs->opts);
+        if (ret > 0)
+            __nodeAccount(1, 0);
+        else if (ret < 0)
+            atomic_fetch_add_explicit(&music_failed, 1, memory_order_relaxed);
+        if (ret >= 0)
+            music_procCnt++;
+        __progress();
+    }
+
+    /* Split files hold a reference of their own */
+    os_dirRelease(p_fdesc->p_dir);
+}
+
+static void __taskProbe(void* p_ctx, uint32_t idx)
+{
+    st_encArg_t*    p_tArgs = (st_encArg_t*) p_ctx;
+    st_encFDesc_t*  p_fdesc = ENC_FDESC(p_tArgs, idx);
+
+    __musicProbe(p_fdesc);
+
+    if (p_fdesc->probe == en_probe_bad)
+    {
+        atomic_fetch_add_explicit(&music_rejected, 1, memory_order_relaxed);
+        return;
+    }
+    if (p_fdesc->probe != en_probe_ok)
+        return;
+
+    atomic_fetch_add_explicit(&music_probed, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&music_totalBytes, p_fdesc->dataLength, memory_order_relaxed);
+    atomic_fetch_add_explicit(&music_probedMsec, p_fdesc->dataLength * 1000 /
+                              (((p_fdesc->bps + 7) >> 3) * p_fdesc->channels * p_fdesc->sampleRate),
+                              memory_order_relaxed);
+}
+
+/*
+ * --- Global Functions Definition ------------------------------------------ *
+ */
+
+int8_t music_procFile(st_encFDesc_t* p_fdesc, const st_encOpts_t* p_opts)
+{
+    /* Only the name of the output is built, files are opened
+     * relative to their directory */
+    char*   p_out = NULL;
+    int8_t  ret = 0;
+
+    if ((p_fdesc == NULL) || (p_fdesc->p_fname == NULL) || (p_fdesc->p_dir == NULL))
+    {
+        fprintf(stderr, "Filename empty. Exit.\n");
+        return (-1);
+    }
+    p_out = malloc(strlen(p_fdesc->p_fname) + sizeof(".mp3"));
+    if (p_out == NULL)
+    {
+        fprintf(stderr, "[%s] Failed to allocate the output name.\n", p_fdesc->p_fname);
+        return (-1);
+    }
+    os_outPath(p_out, p_fdesc->p_fname);
+
+    /* Identical samples encoded before with the same settings */
+    if ((p_opts->p_cache != NULL) && __cacheFetch(p_out, p_fdesc, p_opts))
+    {
+        p_fdesc->done = 1;
+        printf("[%s] Converting OK (cached)\n", p_fdesc->p_fname);
+        free(p_out);
+        return (1);
+    }
+
+    ret = __procPart(p_out, p_fdesc, p_opts, NULL, 0);
+    free(p_out);
+
     return (ret);
 }
 
-void* music_procFiles(void* p_threadarg)
+void music_found(st_encArg_t* p_tArgs, uint32_t idx)
 {
-    assert(p_threadarg != NULL);
+    assert(p_tArgs != NULL);
+    assert(p_tArgs->p_pool != NULL);
 
-    st_encArg_t*   p_tArg = (st_encArg_t*) p_threadarg;
-    int32_t         tArgIndex = -1;
-    uint16_t        procFiles = 0;
-    uint16_t        tID = p_tArg->threadID;
+    int64_t     start = 0;
+    int64_t     now = 0;
 
-    while (1)
+    /* The clock starts with the first file found, files are found by
+     * any of the scanning threads */
+    if (atomic_load_explicit(&music_startNsec, memory_order_relaxed) == 0)
     {
-        tArgIndex = -1;
+        now = __clockNsec();
+        if (atomic_compare_exchange_strong(&music_startNsec, &start, now))
+            atomic_store(&music_progressNsec, now);
+    }
 
-        pthread_mutex_lock(&music_mutex);
-        for (int i = 0; i < p_tArg->files; i++)
+    /* Other orders need all headers, so only the probe starts now */
+    if (p_tArgs->sched != en_sched_fifo)
+    {
+        pool_submit(p_tArgs->p_pool, __taskProbe, p_tArgs, idx);
+        return;
+    }
+
+    /* Files found by workers scanning subdirectories would go to their
+     * deques newest first, so they're queued in the order found */
+    if (pool_inject(p_tArgs->p_pool, __taskFile, p_tArgs, idx) < 0)
+    {
+        fprintf(stderr, "[%s] Failed to submit file.\n", ENC_FDESC(p_tArgs, idx)->p_fname);
+        os_dirRelease(ENC_FDESC(p_tArgs, idx)->p_dir);
+    }
+}
+
+int32_t music_schedule(st_pool_t* p_pool, st_encArg_t* p_tArgs)
+{
+    assert(p_pool != NULL);
+    assert(p_tArgs != NULL);
+
+    st_musicOrder_t*    p_order = NULL;
+    st_encFDesc_t*      p_fdesc = NULL;
+    int32_t             files = 0;
+    int32_t             submitted = 0;
+
+    /* Files in directory order were submitted by the scan already */
+    if ((p_tArgs->sched == en_sched_fifo) || (p_tArgs->files < 1))
+        return (0);
+
+    /* Headers are tiny compared to the samples, so reading them
+     * upfront is cheap, sizes alone are skewed by extra chunks */
+    pool_wait(p_pool);
+
+    p_order = malloc(p_tArgs->files * sizeof(st_musicOrder_t));
+    if (p_order == NULL)
+    {
+        fprintf(stderr, "Error: Failed to allocate memory for the order\n");
+        return (0);
+    }
+    /* Files rejected by the probe were reported already */
+    for (int i = 0; i < p_tArgs->files; i++)
+    {
+        p_fdesc = ENC_FDESC(p_tArgs, i);
+        if (p_fdesc->probe == en_probe_bad)
         {
-            if (p_tArg->p_fdesc[i].flocked == 0)
-            {
-                p_tArg->p_fdesc[i].flocked = 1;
-                tArgIndex = i;
-                break;
-            }
+            os_dirRelease(p_fdesc->p_dir);
+            continue;
         }
-        pthread_mutex_unlock(&music_mutex);
+        p_order[files].weight = __schedWeight(p_fdesc);
+        p_order[files].p_fname = p_fdesc->p_fname;
+        p_order[files].idx = i;
+        files++;
+    }
+    qsort(p_order, files, sizeof(st_musicOrder_t),
+          (p_tArgs->sched == en_sched_largest) ? __schedLargest : __schedSmallest);
 
-        if (tArgIndex >= 0) {
-            music_procFile(p_tArg->p_trgPath, p_tArg->p_fdesc[tArgIndex].p_fname);
-            procFiles++;
-        }else
-            break;
+    /* Probes aren't part of the conversion time */
+    atomic_store(&music_startNsec, __clockNsec());
+    atomic_store(&music_progressNsec, atomic_load(&music_startNsec));
+
+    /* Files from outside of the pool are served in the order of submission */
+    for (int i = 0; i < files; i++)
+    {
+        if (pool_submit(p_pool, __taskFile, p_tArgs, p_order[i].idx) < 0)
+        {
+            fprintf(stderr, "[%s] Failed to submit file.\n", p_order[i].p_fname);
+            os_dirRelease(ENC_FDESC(p_tArgs, p_order[i].idx)->p_dir);
+            continue;
+        }
+        submitted++;
+    }
+    free(p_order);
+
+    return (submitted);
+}
+
+void music_workerEnter(uint32_t id)
+{
+    /* Begin the exception context once for all tasks of the thread */
+    e4c_context_begin(E4C_TRUE);
+    music_procCnt = 0;
+}
+
+void music_workerLeave(uint32_t id)
+{
+    e4c_context_end();
+
+    printf("[%lu] Thread converted %lu files\n", id, music_procCnt);
+}
+
+void music_report(void)
+{
+    uint64_t    pushes[2];
+    uint64_t    fill[2];
+    uint64_t    files = 0;
+    uint64_t    bytes = 0;
+
+    printf("Probed: %lu files, %lu s of audio, %lu rejected\n",
+           atomic_load(&music_probed), atomic_load(&music_probedMsec) / 1000,
+           atomic_load(&music_rejected));
+    if (atomic_load(&music_failed) > 0)
+        printf("Failed: %lu files\n", atomic_load(&music_failed));
+
+    for (int i = 0; i < 2; i++)
+    {
+        pushes[i] = atomic_load_explicit(&music_pipePushes[i], memory_order_relaxed);
+        fill[i] = atomic_load_explicit(&music_pipeFill[i], memory_order_relaxed);
+    }
+
+    for (uint32_t i = 0; i < MAX_NODES; i++)
+    {
+        files = atomic_load_explicit(&music_nodeFiles[i], memory_order_relaxed);
+        bytes = atomic_load_explicit(&music_nodeBytes[i], memory_order_relaxed);
+        if (files || bytes)
+            printf("Node %lu: %lu files, %lu bytes\n", i, files, bytes);
     }
 
-    printf("[%lu] Thread converted %lu files\n",tID, procFiles);
-    pthread_exit(NULL);
-	return NULL;
+    /* Almost full read queue means the encoders are the bottleneck,
+     * almost full write queue means the storage is */
+    if (pushes[0] && pushes[1])
+    {
+        printf("Pipeline queues fill: read %lu.%lu%%, write %lu.%lu%%\n",
+               fill[0] / pushes[0] / 10, fill[0] / pushes[0] % 10,
+               fill[1] / pushes[1] / 10, fill[1] / pushes[1] % 10);
+    }
 }
@@ -13,30 +13,200 @@
 /*
  * --- Includes ------------------------------------------------------------- *
  */
-
+/* sched_getaffinity() and CPU_COUNT() */
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <limits.h>
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <stdatomic.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 
 #include <errno.h>
+#ifdef OS_IOURING
+#include <liburing.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 #include "encoder.h"
 #include "os.h"
+#include "state.h"
+#include "pool.h"
 #include "e4c.h"
 
 /*
  * --- Macro Definitions ---------------------------------------------------- *
  */
+#if defined(__x86_64__) || defined(__i386__)
+#define OS_SPLIT_X86    1
+#else
+#define OS_SPLIT_X86    0
+#endif
+
+/* Converters are written once for any channel count and instantiated
+ * for mono and stereo, so the channel check is resolved at compile time */
+#define OS_SPLIT_INLINE static inline __attribute__((always_inline))
+#define OS_SPLIT_SPECIALIZE(name, attr)                                       \
+    attr static void name##Mono(uint8_t* from, int32_t* toFir,                \
+                                int32_t* toSec, uint32_t toMaxOff)            \
+    {                                                                         \
+        (void) toSec;                                                         \
+        name(from, toFir, NULL, toMaxOff);                                    \
+    }                                                                         \
+    attr static void name##Stereo(uint8_t* from, int32_t* toFir,              \
+                                  int32_t* toSec, uint32_t toMaxOff)          \
+    {                                                                         \
+        if (toSec == NULL)                                                    \
+            __builtin_unreachable();                                          \
+        name(from, toFir, toSec, toMaxOff);                                   \
+    }
+
+/* cgroup v2 hierarchy, the own cgroup is listed in /proc/self/cgroup */
+#define OS_CGROUP_ROOT  "/sys/fs/cgroup"
+#define OS_CGROUP_SELF  "/proc/self/cgroup"
+/* Buffer to copy files which can't be linked */
+#define OS_COPY_BLOCK   (64 * 1024)
+/* Mapped pages this far behind the read position are released. Blocks
+ * queued by a pipeline point into the mapping, so it covers the deepest
+ * queue of the largest blocks. It's a multiple of any page size. */
+#define OS_MAP_KEEP     ((uint64_t) MAX_PIPE_DEPTH * MAX_BLOCK_SIZE)
+/* Directory entries are read in batches of this size */
+#define OS_DENTS_SIZE   (1 << 20)
+/* Directories held open for their files take up to this part of the
+ * descriptor limit, the rest is left for files and the scan */
+#define OS_DIR_SHARE    2
+/* Outputs are written in blocks of this size, it's a multiple of any
+ * filesystem block */
+#define OS_WRITE_BLOCK  (1 << 20)
+#define OS_WRITE_ALIGN  4096
+/* Temporary names keep this much of the name, the rest is taken by
+ * ".<pid>.<seq>.tmp" of up to 26 characters */
+#define OS_TEMP_KEEP    (NAME_MAX - 26)
+/* Hyper-threads sharing a physical core with a CPU */
+#define OS_CPU_SIBLINGS "/sys/devices/system/cpu/cpu%lu/topology/thread_siblings_list"
+
+#ifdef OS_IOURING
+/* Amount of requests in flight per file */
+#define OS_AIO_DEPTH    8
+/* Size of one request. It's a multiple of every possible frame size
+ * (1..4 or 8 bytes per sample, 1..2 channels, so 1..16 bytes) and of
+ * the page size, so frames never cross blocks */
+#define OS_AIO_BLOCK    (24 * 2048)
+#define OS_AIO_ALIGN    4096
+#endif
 
 /*
  * --- Type Definitions ----------------------------------------------------- *
  */
+#ifdef OS_IOURING
+typedef struct st_osAioBlk
+{
+    /* File offset of the block */
+    uint64_t        off;
+    /* Bytes requested and bytes already transferred */
+    uint32_t        want;
+    uint32_t        got;
+    /* Request is in flight */
+    uint8_t         busy;
+} st_osAioBlk_t;
+
+/* io_uring state of a single opened file */
+typedef struct st_osAio
+{
+    struct io_uring ring;
+    int             fd;
+    /* Direction, 1 - Write, 0 - Read */
+    uint8_t         write;
+    /* First failure reported by the kernel, negative errno */
+    int             err;
+    /* OS_AIO_DEPTH blocks of OS_AIO_BLOCK bytes */
+    uint8_t*        p_mem;
+    st_osAioBlk_t   blk[OS_AIO_DEPTH];
+    /* Block which is consumed now (or filled for writing) and its offset */
+    uint32_t        head;
+    uint32_t        headOff;
+    /* File offset for the next request and the end of data to read */
+    uint64_t        off;
+    uint64_t        end;
+} st_osAio_t;
+#endif /* OS_IOURING */
+
+/* Directory opened for a scan */
+typedef struct st_osDir
+{
+    int             fd;
+#ifdef __linux__
+    /* Batch of entries from getdents64 and position in it */
+    uint8_t*        p_buf;
+    long            len;
+    long            pos;
+#else
+    DIR*            p_dir;
+#endif
+} st_osDir_t;
+
+/* Scan of a directory tree, shared by the scans of all its directories */
+typedef struct st_osScan
+{
+    st_encArg_t*    p_tArgs;
+    os_fFound_t     p_found;
+    /* Output root, its subtree isn't scanned if it's inside the input */
+    dev_t           outDev;
+    ino_t           outIno;
+    /* Guards the table of files, the list of directories and pending */
+    pthread_mutex_t lock;
+    pthread_cond_t  done;
+    /* Directories found and not scanned yet, the scan is over at 0 */
+    uint32_t        pending;
+} st_osScan_t;
+
+/* Output waiting for a group commit on the stack of its thread */
+typedef struct st_osCommit
+{
+    st_encoder_t*   p_enc;
+    /* Result, valid once done is set */
+    int8_t          err;
+    uint8_t         done;
+    /* Directory is synced for the group already */
+    uint8_t         synced;
+    struct st_osCommit* p_next;
+} st_osCommit_t;
+
+/* Pool task to scan a subdirectory */
+typedef struct st_osScanTask
+{
+    st_osScan_t*    p_scan;
+    st_encDir_t*    p_dir;
+} st_osScanTask_t;
+
+#ifdef __linux__
+/* Entry layout of getdents64, glibc doesn't export it before 2.30 */
+typedef struct st_osDent
+{
+    uint64_t        d_ino;
+    int64_t         d_off;
+    uint16_t        d_reclen;
+    uint8_t         d_type;
+    char            d_name[];
+} st_osDent_t;
+#endif
+
 /**
  * \brief     Substitute filename extension from input to mp3
  *            We already checked several times that data here is
@@ -56,14 +226,287 @@ static char * __extSubstitute(char* to, const char* from);
  */
 static int8_t __extIsSupported(const char* from);
 
+/**
+ * \brief     Start reading entries of an opened directory
+ * \param     p_dir         Directory state to fill
+ * \param     fd            Descriptor of the directory, stays owned by
+ *                          the caller
+ * \return    Negative for failure, otherwise OK
+ */
+static int8_t __dirOpen(st_osDir_t* p_dir, int fd);
+
+/**
+ * \brief     Get the next entry of a directory, entries are read from
+ *            the kernel in batches of OS_DENTS_SIZE
+ * \param     p_dir         Directory state
+ * \param     p_type        Where to store the entry type, DT_UNKNOWN if
+ *                          the file system doesn't report it
+ * \return    Name of the entry valid until the next call, NULL at the end
+ */
+static const char* __dirNext(st_osDir_t* p_dir, uint8_t* p_type);
+
+/**
+ * \brief     Close a directory opened with __dirOpen()
+ * \param     p_dir         Directory state
+ * \return    Nothing
+ */
+static void __dirClose(st_osDir_t* p_dir);
+
+/**
+ * \brief     Append a file to the table, a new chunk is allocated when
+ *            the last one is full, found files never move
+ * \param     p_tArgs       Arguments with the table of files
+ * \param     p_fdesc       File to append, its name is duplicated
+ * \return    Negative for failure, otherwise index of the file
+ */
+static int32_t __fdescAdd(st_encArg_t* p_tArgs, const st_encFDesc_t* p_fdesc);
+
+/**
+ * \brief     Add a directory to the list of the tree, it's referenced by
+ *            its parent until it's opened
+ * \param     p_scan        Scan of the tree
+ * \param     p_parent      Parent directory, NULL for the root
+ * \param     p_name        Name within the parent, copied
+ * \return    Directory, NULL for failure
+ */
+static st_encDir_t* __dirAdd(st_osScan_t* p_scan, st_encDir_t* p_parent,
+                             const char* p_name);
+
+/**
+ * \brief     Drop a reference to a directory, its descriptors are closed
+ *            with the last one
+ * \param     p_dir         Directory
+ * \return    Nothing
+ */
+static void __dirRelease(st_encDir_t* p_dir);
+
+/**
+ * \brief     Get the directory which keeps descriptors for the files of
+ *            a directory: the directory itself if it's held, otherwise
+ *            the root, which is held for the whole run
+ * \param     p_dir         Directory
+ * \return    Held directory
+ */
+static inline st_encDir_t* __dirBase(const st_encDir_t* p_dir);
+
+/**
+ * \brief     Get the descriptor of the directory where outputs of a
+ *            directory's files are written
+ * \param     p_dir         Directory, NULL for the current directory
+ * \return    Descriptor of the mirror, of the directory itself if outputs
+ *            are written next to inputs, or AT_FDCWD
+ */
+static inline int __dirOutFd(const st_encDir_t* p_dir);
+
+/**
+ * \brief     Resolve a file of a directory for the *at() calls. Files of
+ *            held directories are taken by name, files of other ones by
+ *            the path from the root.
+ * \param     p_dir         Directory, NULL if p_fname is a path
+ * \param     p_fname       Name of the file
+ * \param     out           Take the mirror in the output tree
+ * \param     p_rel         Buffer for the path, PATH_MAX long
+ * \param     pp_name       Where to store the name to pass with the descriptor
+ * \return    Descriptor to pass, -1 if the path doesn't fit
+ */
+static int __dirAt(const st_encDir_t* p_dir, const char* p_fname, uint8_t out,
+                   char* p_rel, const char** pp_name);
+
+/**
+ * \brief     Scan an opened directory: files are appended to the table,
+ *            subdirectories are submitted to the pool. The directory is
+ *            released at the end.
+ * \param     p_scan        Scan of the tree
+ * \param     p_dir         Opened directory
+ * \return    Nothing
+ */
+static void __dirScan(st_osScan_t* p_scan, st_encDir_t* p_dir);
+
+/**
+ * \brief     Count a directory as scanned, the last one ends the scan
+ * \param     p_scan        Scan of the tree
+ * \return    Nothing
+ */
+static void __dirDone(st_osScan_t* p_scan);
+
+/**
+ * \brief     Pool task: open a subdirectory relative to its parent, create
+ *            its mirror in the output tree and scan it
+ * \param     p_ctx         st_osScanTask_t, freed by the task
+ * \param     idx           Unused
+ * \return    Nothing
+ */
+static void __taskDir(void* p_ctx, uint32_t idx);
+
+/**
+ * \brief     Copy a file into a new one, sharing its blocks if the file
+ *            system supports reflinks
+ * \param     fromFd        Directory of the existing file or AT_FDCWD
+ * \param     p_from        Name of the existing file
+ * \param     toFd          Directory of the new file or AT_FDCWD
+ * \param     p_to          Name of the new file, must not exist
+ * \return    Negative for failure, otherwise OK
+ */
+static int8_t __fCopy(int fromFd, const char* p_from, int toFd, const char* p_to);
+
+/**
+ * \brief     Build the temporary name of an output. Long names are cut,
+ *            the process and the sequence number keep it unique.
+ * \param     p_tmp         String where to store result, PATH_MAX long
+ * \param     p_name        Name of the output, see __dirAt()
+ * \param     seq           Sequence number of the output
+ * \return    Negative if the name doesn't fit, otherwise OK
+ */
+static int8_t __tempName(char* p_tmp, const char* p_name, uint32_t seq);
+
+/**
+ * \brief     Write out everything collected for an output and cut its
+ *            preallocated space to the written length
+ * \param     p_enc         Encoder file descriptor of an output file
+ * \return    Negative if any write failed, otherwise OK
+ */
+static int8_t __fFinish(st_encoder_t* p_enc);
+
+/**
+ * \brief     Rename an output from its temporary name to its own one
+ * \param     p_enc         Encoder file descriptor of an output file
+ * \param     sync          Sync the directory after the rename
+ * \return    Negative for failure, otherwise OK
+ */
+static int8_t __fPublish(st_encoder_t* p_enc, uint8_t sync);
+
+/**
+ * \brief     Sync the directory which holds a file
+ * \param     dirFd         Directory the name is relative to
+ * \param     p_name        Name of the file, might be a relative path
+ * \return    Negative for failure, otherwise OK
+ */
+static int8_t __syncDir(int dirFd, const char* p_name);
+
+/**
+ * \brief     Sync data of a file which isn't opened
+ * \param     dirFd         Directory the name is relative to
+ * \param     p_name        Name of the file
+ * \return    Negative for failure, otherwise OK
+ */
+static int8_t __syncFile(int dirFd, const char* p_name);
+
+/**
+ * \brief     Sync and publish a group of outputs, each of their
+ *            directories is synced once after all renames
+ * \param     p_group       List of outputs
+ * \return    Nothing, results are stored in the list
+ */
+static void __syncGroup(st_osCommit_t* p_group);
+
+/**
+ * \brief     Plain C implementations of os_splitFlop*() functions for
+ *            mono and stereo. Parameters are the same as for os_splitFlop*().
+ */
+static void __splitUI8ScalarMono(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff);
+static void __splitUI8ScalarStereo(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff);
+static void __splitI16ScalarMono(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff);
+static void __splitI16ScalarStereo(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff);
+static void __splitI24ScalarMono(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff);
+static void __splitI24ScalarStereo(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff);
+static void __splitI32ScalarMono(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff);
+static void __splitI32ScalarStereo(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff);
+
+#if OS_SPLIT_X86
+/**
+ * \brief     SSE2 and AVX2 implementations of os_splitFlop*() functions for
+ *            mono and stereo. Parameters are the same as for os_splitFlop*().
+ */
+static void __splitUI8Sse2Mono(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff);
+static void __splitUI8Sse2Stereo(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff);
+static void __splitI16Sse2Mono(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff);
+static void __splitI16Sse2Stereo(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff);
+static void __splitI24Sse2Mono(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff);
+static void __splitI24Sse2Stereo(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff);
+static void __splitI32Sse2Mono(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff);
+static void __splitI32Sse2Stereo(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff);
+static void __splitUI8Avx2Mono(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff);
+static void __splitUI8Avx2Stereo(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff);
+static void __splitI16Avx2Mono(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff);
+static void __splitI16Avx2Stereo(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff);
+static void __splitI24Avx2Mono(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff);
+static void __splitI24Avx2Stereo(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff);
+static void __splitI32Avx2Mono(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff);
+static void __splitI32Avx2Stereo(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff);
+#endif
+
 /*
  * --- Variables ------------------------------------------------------------ *
- * /
+ */
+/* Converters by bytes per sample and channels, selected by
+ * os_splitFlopInit(), plain C until then */
+static os_splitFlop_t os_split[4][2] =
+{
+    { __splitUI8ScalarMono, __splitUI8ScalarStereo },
+    { __splitI16ScalarMono, __splitI16ScalarStereo },
+    { __splitI24ScalarMono, __splitI24ScalarStereo },
+    { __splitI32ScalarMono, __splitI32ScalarStereo }
+};
+/* All implementations of the converters, the missing ones are NULL */
+static const os_splitFlop_t os_splitImpl[en_split_impls][4][2] =
+{
+    [en_split_scalar] = {
+        { __splitUI8ScalarMono, __splitUI8ScalarStereo },
+        { __splitI16ScalarMono, __splitI16ScalarStereo },
+        { __splitI24ScalarMono, __splitI24ScalarStereo },
+        { __splitI32ScalarMono, __splitI32ScalarStereo } },
+#if OS_SPLIT_X86
+    [en_split_sse2] = {
+        { __splitUI8Sse2Mono, __splitUI8Sse2Stereo },
+        { __splitI16Sse2Mono, __splitI16Sse2Stereo },
+        { __splitI24Sse2Mono, __splitI24Sse2Stereo },
+        { __splitI32Sse2Mono, __splitI32Sse2Stereo } },
+    [en_split_avx2] = {
+        { __splitUI8Avx2Mono, __splitUI8Avx2Stereo },
+        { __splitI16Avx2Mono, __splitI16Avx2Stereo },
+        { __splitI24Avx2Mono, __splitI24Avx2Stereo },
+        { __splitI32Avx2Mono, __splitI32Avx2Stereo } },
+#endif
+};
+/* Makes names of temporary files unique within the process */
+static _Atomic uint32_t os_tmpSeq = 0;
+/* Descriptors of held directories and their limit, see OS_DIR_SHARE */
+static _Atomic uint32_t os_dirFds = 0;
+static uint32_t os_dirFdMax = 0;
+/* Durability of outputs, see os_fCommit() */
+static en_encSync_t os_syncMode = en_sync_none;
+/* Outputs waiting for the next group commit and whether one runs now */
+static pthread_mutex_t os_syncLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t os_syncDone = PTHREAD_COND_INITIALIZER;
+static st_osCommit_t* os_syncQueue = NULL;
+static uint8_t os_syncBusy = 0;
+#ifdef OS_IOURING
+/* Set once io_uring turned out to be unavailable on this system */
+static _Atomic uint8_t os_aioBroken = 0;
+#endif
 
 
 /*
  * --- Local Functions Declaration ------------------------------------------ *
  */
+
+/**
+ * \brief     Get CPU limit of the process from cgroup v2 cpu.max quotas
+ *            of its cgroup and all parents
+ *
+ * \return    Amount of CPUs rounded up, 0 if there is no limit
+ */
+static uint32_t __cgroupCpus(void);
+
+/**
+ * \brief     Check whether a CPU shares its physical core with a lower
+ *            numbered CPU from the set
+ *
+ * \param     cpu           CPU to check
+ * \param     p_set         Allowed CPUs
+ * \return    1 if there is such a sibling, otherwise 0
+ */
+static uint8_t __cpuIsSibling(uint32_t cpu, const cpu_set_t* p_set);
 static char * __extSubstitute(char* to, const char* from)
 {
     assert(to != NULL);
@@ -74,10 +517,54 @@ static char * __extSubstitute(char* to, const char* from)
     strcpy (to, from);
     lastdot = strrchr (to, '.');
     if (lastdot != NULL)
-        snprintf(lastdot, MAX_FILEPATH,".mp3");
+        strcpy(lastdot, ".mp3");
     return to;
 }
 
+static int8_t __fCopy(int fromFd, const char* p_from, int toFd, const char* p_to)
+{
+    uint8_t*    p_buf = NULL;
+    ssize_t     len = 0;
+    int8_t      err = 0;
+    uint8_t     cloned = 0;
+    int         fdIn = -1;
+    int         fdOut = -1;
+
+    fdIn = openat(fromFd, p_from, O_RDONLY | O_CLOEXEC);
+    if (fdIn < 0)
+        return (-1);
+    fdOut = openat(toFd, p_to, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (fdOut < 0)
+    {
+        close(fdIn);
+        return (-1);
+    }
+
+#ifdef FICLONE
+    cloned = (ioctl(fdOut, FICLONE, fdIn) == 0);
+#endif
+    if (!cloned)
+    {
+        p_buf = malloc(OS_COPY_BLOCK);
+        if (p_buf == NULL)
+            err = -1;
+        while ((err == 0) && ((len = read(fdIn, p_buf, OS_COPY_BLOCK)) != 0))
+        {
+            if ((len < 0) || (write(fdOut, p_buf, len) != len))
+                err = -1;
+        }
+        free(p_buf);
+    }
+
+    close(fdIn);
+    if (close(fdOut) != 0)
+        err = -1;
+    if (err < 0)
+        unlinkat(toFd, p_to, 0);
+
+    return (err);
+}
+
 /* 0 not supported, < 0 error, 1 supported */
 static int8_t __extIsSupported(const char* from)
 {
@@ -99,6 +586,368 @@ static int8_t __extIsSupported(const char* from)
     return (ret);
 }
 
+static int8_t __dirOpen(st_osDir_t* p_dir, int fd)
+{
+    memset(p_dir, 0, sizeof(st_osDir_t));
+    p_dir->fd = fd;
+
+#ifdef __linux__
+    p_dir->p_buf = malloc(OS_DENTS_SIZE);
+    if (p_dir->p_buf == NULL)
+        return (-1);
+#else
+    /* The stream closes its descriptor, so it gets a copy */
+    p_dir->fd = dup(fd);
+    if (p_dir->fd < 0)
+        return (-1);
+    p_dir->p_dir = fdopendir(p_dir->fd);
+    if (p_dir->p_dir == NULL)
+    {
+        close(p_dir->fd);
+        return (-1);
+    }
+#endif
+
+    return (0);
+}
+
+static const char* __dirNext(st_osDir_t* p_dir, uint8_t* p_type)
+{
+#ifdef __linux__
+    st_osDent_t*    p_dent = NULL;
+
+    /* One call returns as many entries as fit the buffer, which saves
+     * round trips on network file systems */
+    if (p_dir->pos >= p_dir->len)
+    {
+        p_dir->len = syscall(SYS_getdents64, p_dir->fd, p_dir->p_buf, OS_DENTS_SIZE);
+        p_dir->pos = 0;
+        if (p_dir->len <= 0)
+            return (NULL);
+    }
+
+    p_dent = (st_osDent_t*) (p_dir->p_buf + p_dir->pos);
+    p_dir->pos += p_dent->d_reclen;
+    *p_type = p_dent->d_type;
+
+    return (p_dent->d_name);
+#else
+    struct dirent*  p_dent = readdir(p_dir->p_dir);
+
+    if (p_dent == NULL)
+        return (NULL);
+    *p_type = p_dent->d_type;
+
+    return (p_dent->d_name);
+#endif
+}
+
+static void __dirClose(st_osDir_t* p_dir)
+{
+#ifdef __linux__
+    free(p_dir->p_buf);
+#else
+    /* Descriptor is owned by the stream */
+    closedir(p_dir->p_dir);
+#endif
+}
+
+static int32_t __fdescAdd(st_encArg_t* p_tArgs, const st_encFDesc_t* p_fdesc)
+{
+    uint32_t        idx = p_tArgs->files;
+    st_encFDesc_t*  p_new = NULL;
+
+    if (idx >= (uint32_t) FDESC_CHUNKS * FDESC_CHUNK)
+        return (-1);
+
+    /* Only the list of chunks is allocated upfront */
+    if (p_tArgs->pp_fdesc == NULL)
+    {
+        p_tArgs->pp_fdesc = calloc(FDESC_CHUNKS, sizeof(st_encFDesc_t*));
+        if (p_tArgs->pp_fdesc == NULL)
+            return (-1);
+    }
+    if ((idx & (FDESC_CHUNK - 1)) == 0)
+    {
+        p_tArgs->pp_fdesc[idx >> FDESC_SHIFT] = malloc(FDESC_CHUNK * sizeof(st_encFDesc_t));
+        if (p_tArgs->pp_fdesc[idx >> FDESC_SHIFT] == NULL)
+            return (-1);
+    }
+
+    p_new = ENC_FDESC(p_tArgs, idx);
+    *p_new = *p_fdesc;
+    p_new->p_fname = strdup(p_fdesc->p_fname);
+    if (p_new->p_fname == NULL)
+        return (-1);
+    p_tArgs->files++;
+
+    return (idx);
+}
+
+static st_encDir_t* __dirAdd(st_osScan_t* p_scan, st_encDir_t* p_parent,
+                             const char* p_name)
+{
+    st_encDir_t*    p_dir = calloc(1, sizeof(st_encDir_t));
+
+    if (p_dir == NULL)
+        return (NULL);
+    if ((p_name != NULL) && ((p_dir->p_name = strdup(p_name)) == NULL))
+    {
+        free(p_dir);
+        return (NULL);
+    }
+    p_dir->p_parent = p_parent;
+    p_dir->fd = -1;
+    p_dir->outFd = -1;
+    atomic_init(&p_dir->refs, 1);
+    if (p_parent != NULL)
+        atomic_fetch_add(&p_parent->refs, 1);
+
+    pthread_mutex_lock(&p_scan->lock);
+    p_dir->p_next = p_scan->p_tArgs->p_dirs;
+    p_scan->p_tArgs->p_dirs = p_dir;
+    p_scan->pending++;
+    pthread_mutex_unlock(&p_scan->lock);
+
+    return (p_dir);
+}
+
+static void __dirRelease(st_encDir_t* p_dir)
+{
+    if (atomic_fetch_sub(&p_dir->refs, 1) != 1)
+        return;
+
+    if (p_dir->held)
+        atomic_fetch_sub(&os_dirFds, (p_dir->fd >= 0) + (p_dir->outFd >= 0));
+    if (p_dir->fd >= 0)
+        close(p_dir->fd);
+    if (p_dir->outFd >= 0)
+        close(p_dir->outFd);
+    p_dir->fd = -1;
+    p_dir->outFd = -1;
+}
+
+static inline st_encDir_t* __dirBase(const st_encDir_t* p_dir)
+{
+    if (!p_dir->held)
+    {
+        while (p_dir->p_parent != NULL)
+            p_dir = p_dir->p_parent;
+    }
+
+    return ((st_encDir_t*) p_dir);
+}
+
+static inline int __dirOutFd(const st_encDir_t* p_dir)
+{
+    if (p_dir == NULL)
+        return (AT_FDCWD);
+
+    return ((p_dir->outFd >= 0) ? p_dir->outFd : p_dir->fd);
+}
+
+static int __dirAt(const st_encDir_t* p_dir, const char* p_fname, uint8_t out,
+                   char* p_rel, const char** pp_name)
+{
+    const st_encDir_t* p_base = NULL;
+
+    *pp_name = p_fname;
+    if (p_dir == NULL)
+        return (AT_FDCWD);
+
+    /* Mirrors have the same layout, so the path is the same for both */
+    p_base = __dirBase(p_dir);
+    if (p_base != p_dir)
+    {
+        if (os_dirPath(p_rel, NULL, p_dir, p_fname, PATH_MAX) < 0)
+            return (-1);
+        *pp_name = p_rel;
+    }
+
+    return (out ? __dirOutFd(p_base) : p_base->fd);
+}
+
+static void __dirScan(st_osScan_t* p_scan, st_encDir_t* p_dir)
+{
+    st_encArg_t*    p_tArgs = p_scan->p_tArgs;
+    st_osDir_t      dir;
+    st_encDir_t*    p_sub = NULL;
+    st_osScanTask_t* p_task = NULL;
+    const char*     p_name = NULL;
+    uint8_t         type = DT_UNKNOWN;
+    struct stat     st;
+    st_encFDesc_t   fdesc;
+    /* Names in a directory don't exceed NAME_MAX */
+    char            p_mp3[NAME_MAX + sizeof(".mp3")];
+    uint8_t         fresh = 0;
+    int32_t         idx = 0;
+
+    if (__dirOpen(&dir, p_dir->fd) < 0)
+    {
+        fprintf(stderr, "Error : Failed to read directory %s.\n",
+                (p_dir->p_name != NULL) ? p_dir->p_name : p_tArgs->p_trgPath);
+        __dirRelease(p_dir);
+        __dirDone(p_scan);
+        return;
+    }
+
+    while ((p_name = __dirNext(&dir, &type)) != NULL)
+    {
+        /* Skip unsupported files and already processed files */
+        if (!strcmp (p_name, "."))
+            continue;
+        if (!strcmp (p_name, ".."))
+            continue;
+
+        /* Some file systems don't report the type of entries,
+         * links to directories aren't followed */
+        if ((type == DT_UNKNOWN) &&
+            (fstatat(p_dir->fd, p_name, &st, AT_SYMLINK_NOFOLLOW) == 0) &&
+            S_ISDIR(st.st_mode))
+            type = DT_DIR;
+        if (type == DT_DIR)
+        {
+            /* Subtrees are scanned by the pool, or right here if it
+             * doesn't take them */
+            p_sub = __dirAdd(p_scan, p_dir, p_name);
+            p_task = malloc(sizeof(st_osScanTask_t));
+            if ((p_sub == NULL) || (p_task == NULL))
+            {
+                fprintf(stderr, "Error : Failed to allocate memory for directory\n");
+                free(p_task);
+                if (p_sub != NULL)
+                {
+                    __dirRelease(p_dir);
+                    __dirRelease(p_sub);
+                    __dirDone(p_scan);
+                }
+                continue;
+            }
+            p_task->p_scan = p_scan;
+            p_task->p_dir = p_sub;
+            if (pool_submit(p_tArgs->p_pool, __taskDir, p_task, 0) < 0)
+                __taskDir(p_task, 0);
+            continue;
+        }
+        if (__extIsSupported(p_name) <= 0)
+            continue;
+
+        /* Size is taken relative to the opened directory,
+         * so no path has to be built */
+        memset(&fdesc, 0, sizeof(fdesc));
+        fdesc.p_fname = (char*) p_name;
+        fdesc.p_dir = p_dir;
+        if (fstatat(p_dir->fd, p_name, &st, 0) == 0)
+        {
+            /* Links to directories */
+            if (S_ISDIR(st.st_mode))
+                continue;
+            fdesc.fsize = st.st_size;
+            fdesc.mtime = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        }
+
+        /* Files converted before with the same size, time and settings
+         * are skipped unless their output is gone */
+        fresh = (p_tArgs->p_state != NULL) && (strlen(p_name) <= NAME_MAX) &&
+                state_fresh(p_tArgs->p_state, &fdesc) &&
+                (fstatat(__dirOutFd(p_dir), __extSubstitute(p_mp3, p_name), &st, 0) == 0) &&
+                S_ISREG(st.st_mode) && (st.st_size > 0);
+
+        pthread_mutex_lock(&p_scan->lock);
+        if (fresh)
+            p_tArgs->skipped++;
+        else
+            idx = __fdescAdd(p_tArgs, &fdesc);
+        pthread_mutex_unlock(&p_scan->lock);
+        /* Directory which the file is opened through stays open
+         * until the file is finished */
+        if (!fresh && (idx >= 0))
+            os_dirRetain(p_dir);
+        if (fresh)
+            continue;
+
+        if (idx < 0) {
+            fprintf(stderr, "Error : Failed to allocate memory for file descriptor\n");
+            break;
+        }
+        /* Conversion of the file may start before the scan is over */
+        if (p_scan->p_found != NULL)
+            p_scan->p_found(p_tArgs, idx);
+    }
+    __dirClose(&dir);
+
+    __dirRelease(p_dir);
+    __dirDone(p_scan);
+}
+
+static void __dirDone(st_osScan_t* p_scan)
+{
+    pthread_mutex_lock(&p_scan->lock);
+    if (--p_scan->pending == 0)
+        pthread_cond_signal(&p_scan->done);
+    pthread_mutex_unlock(&p_scan->lock);
+}
+
+static void __taskDir(void* p_ctx, uint32_t idx)
+{
+    st_osScanTask_t* p_task = (st_osScanTask_t*) p_ctx;
+    st_osScan_t*    p_scan = p_task->p_scan;
+    st_encDir_t*    p_dir = p_task->p_dir;
+    st_encDir_t*    p_parent = p_dir->p_parent;
+    struct stat     st;
+    uint32_t        fds = 0;
+
+    free(p_task);
+
+    p_dir->fd = openat(p_parent->fd, p_dir->p_name,
+                       O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if ((p_dir->fd >= 0) && (p_parent->outFd >= 0))
+    {
+        /* Output root inside the input tree isn't scanned */
+        if ((fstat(p_dir->fd, &st) == 0) && (st.st_dev == p_scan->outDev) &&
+            (st.st_ino == p_scan->outIno))
+        {
+            close(p_dir->fd);
+            p_dir->fd = -1;
+            __dirRelease(p_parent);
+            __dirRelease(p_dir);
+            __dirDone(p_scan);
+            return;
+        }
+        if ((mkdirat(p_parent->outFd, p_dir->p_name, 0777) != 0) && (errno != EEXIST))
+            fprintf(stderr, "Error : Failed to create output directory %s.\n", p_dir->p_name);
+        p_dir->outFd = openat(p_parent->outFd, p_dir->p_name,
+                              O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (p_dir->outFd < 0)
+        {
+            close(p_dir->fd);
+            p_dir->fd = -1;
+        }
+    }
+    /* Directory is held open for its files while descriptors last,
+     * otherwise they are opened through the root */
+    if (p_dir->fd >= 0)
+    {
+        fds = 1 + (p_dir->outFd >= 0);
+        if (atomic_fetch_add(&os_dirFds, fds) + fds <= os_dirFdMax)
+            p_dir->held = 1;
+        else
+            atomic_fetch_sub(&os_dirFds, fds);
+    }
+    /* Parent is kept open until all its subdirectories are opened */
+    __dirRelease(p_parent);
+
+    if (p_dir->fd < 0)
+    {
+        fprintf(stderr, "Error : Failed to open directory %s.\n", p_dir->p_name);
+        __dirRelease(p_dir);
+        __dirDone(p_scan);
+        return;
+    }
+
+    __dirScan(p_scan, p_dir);
+}
+
 /*
  * --- Global Functions Definition ------------------------------------------ *
  */
@@ -106,15 +955,20 @@ static int8_t __extIsSupported(const char* from)
 int8_t os_fOpen(uint8_t read, st_encoder_t * p_enc)
 {
 	assert(p_enc != NULL);
-	assert(p_enc->path != NULL);
+	assert(p_enc->p_dir != NULL);
+	assert(p_enc->p_fname != NULL);
 
 	int8_t  err = 0;
 	struct  stat st;
 	int     fd = 0;
+	char    p_rel[PATH_MAX];
+	char    p_tmp[PATH_MAX];
+	const char* p_name = NULL;
+	int     dirFd = __dirAt(p_enc->p_dir, p_enc->p_fname, !read, p_rel, &p_name);
 
 	E4C_TRY {
 		if (read) {
-		    fd = open(p_enc->path, O_RDONLY);
+		    fd = openat(dirFd, p_name, O_RDONLY | O_CLOEXEC);
 			if (fd == -1) {
 				E4C_THROW(RuntimeException, "Failed to open a file\n");
 			}
@@ -137,20 +991,19 @@ int8_t os_fOpen(uint8_t read, st_encoder_t * p_enc)
             }
 
         } else {
-            char* mp3Filename = NULL;
-            if ((mp3Filename = malloc (strlen (p_enc->path) + 1)) == NULL) {
-                E4C_THROW(RuntimeException, "Failed to allocate memmory "
-                                            "for filename.\n");
+            /* Open a file to write under a temporary name, an existing
+             * output might be linked to the cache, so it's replaced by
+             * the rename on commit instead of being overwritten */
+            p_enc->tempSeq = atomic_fetch_add(&os_tmpSeq, 1);
+            if (__tempName(p_tmp, p_name, p_enc->tempSeq) < 0) {
+                E4C_THROW(RuntimeException, "Path is too long.\n");
             }
-            __extSubstitute(mp3Filename, p_enc->path);
-
-            /* Open a file to write*/
-            fd = open(mp3Filename, O_RDWR|O_CREAT, 0666);
-            free(mp3Filename);
+            fd = openat(dirFd, p_tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
             if (fd == -1) {
                 E4C_THROW(RuntimeException, "Failed to open a file.\n");
             }
             p_enc->opened = 1;
+            p_enc->temp = 1;
 
             p_enc->p_fp = fdopen(fd, "wb");
             if (p_enc->p_fp == NULL) {
@@ -171,16 +1024,54 @@ int8_t os_fOpen(uint8_t read, st_encoder_t * p_enc)
 	    if (p_enc->opened) {
 	        close(fd);
 	    }
+	    if (p_enc->temp) {
+	        unlinkat(dirFd, p_tmp, 0);
+	        p_enc->temp = 0;
+	    }
 
         const e4c_exception * e = e4c_get_exception();
-        fprintf(stderr, "Error: %s (%s) [%s].", e->name, e->message, p_enc->path);
+        fprintf(stderr, "Error: %s (%s) [%s].", e->name, e->message, p_enc->p_fname);
         err = -1;
 	}
 
 	return (err);
 }
 
-int8_t os_fOffset(FILE* p_fp, int32_t off)
+int32_t os_fPeek(const st_encDir_t* p_dir, const char* p_fname, uint8_t* p_buf,
+                 uint32_t len, uint64_t off)
+{
+    assert(p_dir != NULL);
+    assert(p_fname != NULL);
+    assert(p_buf != NULL);
+
+    char        p_rel[PATH_MAX];
+    const char* p_name = NULL;
+    int         dirFd = __dirAt(p_dir, p_fname, 0, p_rel, &p_name);
+    int         fd = openat(dirFd, p_name, O_RDONLY | O_CLOEXEC);
+    ssize_t     got = 0;
+    uint32_t    total = 0;
+
+    if (fd == -1) {
+        return (-1);
+    }
+
+    /* Short reads happen at the end of the file or on signals only */
+    while (total < len) {
+        got = pread(fd, p_buf + total, len - total, off + total);
+        if ((got < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (got <= 0) {
+            break;
+        }
+        total += got;
+    }
+    close(fd);
+
+    return ((got < 0) ? -1 : (int32_t) total);
+}
+
+int8_t os_fOffset(FILE* p_fp, int64_t off)
 {
     int8_t err = 0;
     /* Find the end of the file in a safe way */
@@ -191,237 +1082,1335 @@ int8_t os_fOffset(FILE* p_fp, int32_t off)
     return (err);
 }
 
-int32_t os_fExplore(st_encArg_t* p_tArgs)
+int8_t os_fMap(st_encoder_t* p_enc, uint64_t len)
 {
+    assert(p_enc != NULL);
+    assert(p_enc->p_fp != NULL);
 
-    assert(p_tArgs != NULL);
-    assert(p_tArgs->p_trgPath != NULL);
-
-    DIR*            dirDesc = NULL;
-    struct dirent*  dirFile = NULL;
-    int32_t         dirSize = 0;
+    int8_t  err = 0;
+    off_t   off = ftello(p_enc->p_fp);
+    void*   p_map = MAP_FAILED;
 
-    /* Scanning the in directory */
-    if ((dirDesc = opendir (p_tArgs->p_trgPath)) == NULL) {
-        fprintf(stderr, "Error : Failed to open input directory.\n");
-        dirSize = -1;
+    if ((off < 0) || ((uint64_t) off >= p_enc->fsize) || (p_enc->fsize > SIZE_MAX)) {
+        err = -1;
     } else {
-        /* While we have files or correctly reallocated memory keep reading*/
-        while ((dirFile = readdir(dirDesc)))
-        {
-            /* Skip all directories, unsupported files and already processed files */
-            if (!strcmp (dirFile->d_name, "."))
-                continue;
-            if (!strcmp (dirFile->d_name, ".."))
-                continue;
-            if (dirFile->d_type == 4)
-                continue;
-            if (__extIsSupported(dirFile->d_name) <= 0)
-                continue;
-
-            /* Allocate memory for file descriptor  */
-            if (dirSize == 0) {
-                p_tArgs->p_fdesc = malloc(sizeof(st_encFDesc_t));
-            } else {
-                p_tArgs->p_fdesc = realloc(p_tArgs->p_fdesc, (dirSize+1)*sizeof(st_encFDesc_t));
-            }
-
-            /* Check result of malloc/realloc */
-            if (p_tArgs->p_fdesc == NULL) {
-                fprintf(stderr, "Error : Failed to allocate memory for file descriptor\n");
-                dirSize = -1;
-                break;
-            }
-
-            /* We've found a file, duplicate memory*/
-            p_tArgs->p_fdesc[dirSize].p_fname = strdup(dirFile->d_name);
-            p_tArgs->p_fdesc[dirSize].flocked = 0;
-            /* Move pointer to a next element in array of filenames */
-            /* Increment file amount of files */
-            dirSize++;
+        p_map = mmap(NULL, p_enc->fsize, PROT_READ, MAP_PRIVATE,
+                     fileno(p_enc->p_fp), 0);
+        if (p_map == MAP_FAILED) {
+            err = -1;
         }
-        if (dirSize == 0) {
-            free(p_tArgs->p_fdesc);
-        }
-        p_tArgs->files = dirSize;
     }
 
-    return (dirSize);
-}
+    if (err == 0) {
+        /* We walk through samples only once from the beginning to the end */
+        madvise(p_map, p_enc->fsize, MADV_SEQUENTIAL);
 
-inline void os_mkPath(char* p_path, char* p_dirPath, char* p_fname, uint16_t lim)
-{
-    snprintf(p_path,lim,"%s/%s",p_dirPath,p_fname);
-}
+        p_enc->p_map = p_map;
+        p_enc->mapOff = off;
+        p_enc->mapFree = off - off % OS_MAP_KEEP;
+        if (len > (p_enc->fsize - off)) {
+            len = p_enc->fsize - off;
+        }
+        p_enc->mapEnd = off + len;
+    }
 
-inline uint32_t os_fread_unlocked(void* p_buf, size_t size, size_t cnt, FILE* p_fp)
-{
-    return (fread_unlocked(p_buf, size, cnt, p_fp));
+    return (err);
 }
 
-inline void os_fwrite_unlocked(void* p_buf, size_t size, size_t cnt, FILE* p_fp)
+#ifdef OS_IOURING
+static void __aioSubmit(st_osAio_t* p_aio, uint32_t idx)
 {
-    fwrite_unlocked(p_buf, size, cnt, p_fp);
-}
+    st_osAioBlk_t*      p_blk = &p_aio->blk[idx];
+    struct io_uring_sqe* p_sqe = NULL;
+    uint8_t*            p_buf = p_aio->p_mem + idx * OS_AIO_BLOCK + p_blk->got;
 
-inline void os_fclose(st_encoder_t* p_enc)
-{
-    if (p_enc->opened)
-        fclose( p_enc->p_fp);
-}
+    /* There are as much ring entries as blocks, so a free entry always exists */
+    p_sqe = io_uring_get_sqe(&p_aio->ring);
+    assert(p_sqe != NULL);
 
-int32_t os_read32be(FILE* p_fp)
-{
-    uint8_t data[4] = { 0, 0, 0, 0 };
-    fread_unlocked(data, 1, 4, p_fp);
-    {
-        int32_t const high = data[0];
-        int32_t const medh = data[1];
-        int32_t const medl = data[2];
-        int32_t const low = data[3];
-        return (high << 24) | (medh << 16) | (medl << 8) | low;
+    if (p_aio->write) {
+        io_uring_prep_write(p_sqe, p_aio->fd, p_buf, p_blk->want - p_blk->got,
+                            p_blk->off + p_blk->got);
+    } else {
+        io_uring_prep_read(p_sqe, p_aio->fd, p_buf, p_blk->want - p_blk->got,
+                           p_blk->off + p_blk->got);
     }
+    io_uring_sqe_set_data(p_sqe, p_blk);
+    p_blk->busy = 1;
+    io_uring_submit(&p_aio->ring);
 }
 
-int32_t os_read32le(FILE* p_fp)
+static int8_t __aioWait(st_osAio_t* p_aio, uint32_t idx)
 {
-    uint8_t data[4] = { 0, 0, 0, 0 };
-    fread_unlocked(data, 1, 4, p_fp);
-    {
-        int32_t const high = data[3];
-        int32_t const medh = data[2];
-        int32_t const medl = data[1];
-        int32_t const low = data[0];
-        return (high << 24) | (medh << 16) | (medl << 8) | low;
-    }
-}
+    struct io_uring_cqe* p_cqe = NULL;
+    st_osAioBlk_t*      p_blk = NULL;
+    int                 res = 0;
 
-int16_t os_read16be(FILE* p_fp)
-{
-    uint8_t data[2] = { 0, 0};
-    fread_unlocked(data, 1, 2, p_fp);
+    /* Completions come in any order, so we account all of them
+     * until the one we need arrives */
+    while (p_aio->blk[idx].busy && (p_aio->err == 0))
     {
-        int32_t const high = data[0];
-        int32_t const low = data[1];
-        return (high << 8) | low;
+        res = io_uring_wait_cqe(&p_aio->ring, &p_cqe);
+        if (res < 0) {
+            p_aio->err = res;
+            break;
+        }
+        p_blk = io_uring_cqe_get_data(p_cqe);
+        res = p_cqe->res;
+        io_uring_cqe_seen(&p_aio->ring, p_cqe);
+
+        p_blk->busy = 0;
+        if (res < 0) {
+            p_aio->err = res;
+        } else if (res == 0) {
+            /* End of file, data chunk is shorter than its header says */
+            p_blk->want = p_blk->got;
+        } else {
+            p_blk->got += res;
+            /* Short transfer, request the rest of the block */
+            if (p_blk->got < p_blk->want)
+                __aioSubmit(p_aio, p_blk - p_aio->blk);
+        }
     }
+
+    return ((p_aio->err == 0) ? 0 : -1);
 }
 
-int16_t os_read16le(FILE* p_fp)
+static void __aioNext(st_osAio_t* p_aio, uint32_t idx)
 {
-    uint8_t data[2] = { 0, 0 };
-    fread_unlocked(data, 1, 2, p_fp);
-    {
-        int32_t const high = data[1];
-        int32_t const low = data[0];
-        return (high << 8) | low;
+    st_osAioBlk_t*  p_blk = &p_aio->blk[idx];
+
+    p_blk->off = p_aio->off;
+    p_blk->got = 0;
+    p_blk->want = 0;
+    if (p_aio->off < p_aio->end) {
+        p_blk->want = OS_AIO_BLOCK;
+        if ((p_aio->end - p_aio->off) < OS_AIO_BLOCK)
+            p_blk->want = p_aio->end - p_aio->off;
+        p_aio->off += p_blk->want;
+        __aioSubmit(p_aio, idx);
     }
 }
 
-inline void os_splitFlopUI8(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff)
+static uint32_t __aioRead(st_osAio_t* p_aio, uint8_t** pp_buf, size_t size, size_t cnt)
 {
-    int     i = 0;
-    uint8_t off = sizeof(uint8_t);
+    st_osAioBlk_t*  p_blk = NULL;
+    size_t          avail = 0;
 
     while (1)
     {
-        if (((i + off) < toMaxOff) && (toFir != NULL))
-        {
-            *toFir = (from[i] ^ 0x80) << 24;
-            toFir++;
-            i += off;
-        }
+        if (__aioWait(p_aio, p_aio->head) < 0)
+            return (0);
 
-        if (((i + off) < toMaxOff) && (toSec != NULL))
+        p_blk = &p_aio->blk[p_aio->head];
+        if ((p_aio->headOff + size) <= p_blk->got)
+            break;
+
+        /* Nothing was left in the block, so there is no more data */
+        if (p_blk->got == 0)
+            return (0);
+
+        /* Block is consumed, request the next portion into it */
+        __aioNext(p_aio, p_aio->head);
+        p_aio->head = (p_aio->head + 1) % OS_AIO_DEPTH;
+        p_aio->headOff = 0;
+    }
+
+    avail = (p_blk->got - p_aio->headOff) / size;
+    if (cnt > avail)
+        cnt = avail;
+
+    *pp_buf = p_aio->p_mem + p_aio->head * OS_AIO_BLOCK + p_aio->headOff;
+    p_aio->headOff += cnt * size;
+
+    return (cnt);
+}
+
+static void __aioFlush(st_osAio_t* p_aio)
+{
+    st_osAioBlk_t*  p_blk = &p_aio->blk[p_aio->head];
+
+    if (p_aio->headOff == 0)
+        return;
+
+    p_blk->off = p_aio->off;
+    p_blk->want = p_aio->headOff;
+    p_blk->got = 0;
+    __aioSubmit(p_aio, p_aio->head);
+
+    p_aio->off += p_aio->headOff;
+    p_aio->head = (p_aio->head + 1) % OS_AIO_DEPTH;
+    p_aio->headOff = 0;
+}
+
+static void __aioWrite(st_osAio_t* p_aio, uint8_t* p_buf, size_t len)
+{
+    size_t  part = 0;
+
+    while ((len > 0) && (p_aio->err == 0))
+    {
+        /* The block might be still in flight since the last round */
+        if ((p_aio->headOff == 0) && (__aioWait(p_aio, p_aio->head) < 0))
+            break;
+
+        part = OS_AIO_BLOCK - p_aio->headOff;
+        if (part > len)
+            part = len;
+        memcpy(p_aio->p_mem + p_aio->head * OS_AIO_BLOCK + p_aio->headOff,
+               p_buf, part);
+        p_aio->headOff += part;
+        p_buf += part;
+        len -= part;
+
+        if (p_aio->headOff == OS_AIO_BLOCK)
+            __aioFlush(p_aio);
+    }
+}
+
+static int8_t __aioClose(st_encoder_t* p_enc)
+{
+    st_osAio_t* p_aio = p_enc->p_aio;
+    /* Writes stop at the first failure */
+    int8_t      err = (p_aio->err != 0) ? -1 : 0;
+
+    if (p_aio->write) {
+        __aioFlush(p_aio);
+        p_enc->fsize = p_aio->off;
+    }
+
+    /* Even reads have to be finished, before buffers are released */
+    for (uint32_t i = 0; i < OS_AIO_DEPTH; i++)
+    {
+        p_aio->err = 0;
+        __aioWait(p_aio, i);
+        if (p_aio->write && (p_aio->err != 0)) {
+            fprintf(stderr, "Error: Failed to write a file (%s) [%s].",
+                    strerror(-p_aio->err), p_enc->p_fname);
+            err = -1;
+        }
+    }
+
+    io_uring_queue_exit(&p_aio->ring);
+    free(p_aio->p_mem);
+    free(p_aio);
+    p_enc->p_aio = NULL;
+
+    return (err);
+}
+#endif /* OS_IOURING */
+
+static int8_t __tempName(char* p_tmp, const char* p_name, uint32_t seq)
+{
+    const char* p_base = strrchr(p_name, '/');
+    int         dirLen = 0;
+
+    p_base = (p_base != NULL) ? p_base + 1 : p_name;
+    dirLen = p_base - p_name;
+    if (snprintf(p_tmp, PATH_MAX, "%.*s%.*s.%lu.%lu.tmp", dirLen, p_name, OS_TEMP_KEEP,
+                 p_base, (uint32_t) getpid(), seq) >= PATH_MAX)
+        return (-1);
+
+    return (0);
+}
+
+static int8_t __fFinish(st_encoder_t* p_enc)
+{
+    int8_t      err = 0;
+
+    /* io_uring keeps the written length, the stream only its position */
+#ifdef OS_IOURING
+    if (p_enc->p_aio)
+        err = __aioClose(p_enc);
+    else
+#endif
+    {
+        if ((fflush(p_enc->p_fp) != 0) || ferror(p_enc->p_fp))
+            err = -1;
+        p_enc->fsize = ftello(p_enc->p_fp);
+    }
+
+    /* Preallocated space behind the written data is given back */
+    if ((err == 0) && (p_enc->fsize < p_enc->reserved) &&
+        (ftruncate(fileno(p_enc->p_fp), p_enc->fsize) != 0))
+        err = -1;
+    p_enc->reserved = 0;
+
+    return (err);
+}
+
+static int8_t __fPublish(st_encoder_t* p_enc, uint8_t sync)
+{
+    char        p_rel[PATH_MAX];
+    char        p_tmp[PATH_MAX];
+    const char* p_name = NULL;
+    int         dirFd = __dirAt(p_enc->p_dir, p_enc->p_fname, 1, p_rel, &p_name);
+
+    if ((dirFd == -1) || (__tempName(p_tmp, p_name, p_enc->tempSeq) < 0))
+        return (-1);
+
+    if (renameat(dirFd, p_tmp, dirFd, p_name) != 0)
+        return (-1);
+    p_enc->temp = 0;
+
+    if (sync)
+        return (__syncDir(dirFd, p_name));
+
+    return (0);
+}
+
+static int8_t __syncDir(int dirFd, const char* p_name)
+{
+    char        p_path[PATH_MAX];
+    const char* p_slash = strrchr(p_name, '/');
+    int         fd = dirFd;
+    int8_t      err = 0;
+
+    /* Files of directories which aren't held are named by their path */
+    if (p_slash != NULL)
+    {
+        memcpy(p_path, p_name, p_slash - p_name);
+        p_path[p_slash - p_name] = '\0';
+        fd = openat(dirFd, p_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1)
+            return (-1);
+    }
+
+    if (fsync(fd) != 0)
+        err = -1;
+    if (fd != dirFd)
+        close(fd);
+
+    return (err);
+}
+
+static int8_t __syncFile(int dirFd, const char* p_name)
+{
+    int         fd = openat(dirFd, p_name, O_RDONLY | O_CLOEXEC);
+    int8_t      err = 0;
+
+    if (fd == -1)
+        return (-1);
+
+    if (fsync(fd) != 0)
+        err = -1;
+    close(fd);
+
+    return (err);
+}
+
+static void __syncGroup(st_osCommit_t* p_group)
+{
+    st_osCommit_t*  p_com = NULL;
+    st_osCommit_t*  p_same = NULL;
+    char            p_rel[PATH_MAX];
+    const char*     p_name = NULL;
+    int             dirFd = -1;
+    int8_t          err = 0;
+
+    /* Data of each output is stable before its name appears */
+    for (p_com = p_group; p_com != NULL; p_com = p_com->p_next)
+    {
+        p_com->err = -1;
+        if (fsync(fileno(p_com->p_enc->p_fp)) == 0)
+            p_com->err = __fPublish(p_com->p_enc, 0);
+    }
+
+    /* One sync of a directory covers all renames of the group in it */
+    for (p_com = p_group; p_com != NULL; p_com = p_com->p_next)
+    {
+        if ((p_com->err < 0) || p_com->synced)
+            continue;
+
+        dirFd = __dirAt(p_com->p_enc->p_dir, p_com->p_enc->p_fname, 1, p_rel, &p_name);
+        err = __syncDir(dirFd, p_name);
+        for (p_same = p_com; p_same != NULL; p_same = p_same->p_next)
         {
-            *toSec = (from[i] ^ 0x80) << 24;
-            toSec++;
-            i += off;
+            if ((p_same->p_enc->p_dir != p_com->p_enc->p_dir) || (p_same->err < 0))
+                continue;
+            p_same->synced = 1;
+            p_same->err = err;
         }
+    }
+}
 
-        if ((i + off) == toMaxOff)
-            break;
+int8_t os_fAioStart(st_encoder_t* p_enc, uint64_t len)
+{
+    assert(p_enc != NULL);
+    assert(p_enc->p_fp != NULL);
+
+    int8_t      err = -1;
+#ifdef OS_IOURING
+    st_osAio_t* p_aio = NULL;
+    off_t       off = ftello(p_enc->p_fp);
+    int         ret = 0;
+
+    if (atomic_load_explicit(&os_aioBroken, memory_order_relaxed) || (off < 0))
+        return (err);
+
+    p_aio = calloc(1, sizeof(st_osAio_t));
+    if (p_aio == NULL)
+        return (err);
+
+    if (posix_memalign((void**) &p_aio->p_mem, OS_AIO_ALIGN,
+                       OS_AIO_DEPTH * OS_AIO_BLOCK) != 0) {
+        free(p_aio);
+        return (err);
     }
+
+    ret = io_uring_queue_init(OS_AIO_DEPTH, &p_aio->ring, 0);
+    if (ret < 0) {
+        /* Kernel doesn't support io_uring or it's forbidden for us,
+         * there is no need to try it for every file again */
+        if ((ret == -ENOSYS) || (ret == -EPERM))
+            atomic_store_explicit(&os_aioBroken, 1, memory_order_relaxed);
+        free(p_aio->p_mem);
+        free(p_aio);
+        return (err);
+    }
+
+    p_aio->fd = fileno(p_enc->p_fp);
+    p_aio->off = off;
+    p_enc->p_aio = p_aio;
+
+    if (len == 0) {
+        /* Output file, writes are collected in blocks and go in background */
+        p_aio->write = 1;
+    } else {
+        /* Input file, keep all blocks busy with read requests from now on */
+        if (len > (p_enc->fsize - off))
+            len = p_enc->fsize - off;
+        p_aio->end = off + len;
+        for (uint32_t i = 0; i < OS_AIO_DEPTH; i++)
+            __aioNext(p_aio, i);
+    }
+    err = 0;
+#endif /* OS_IOURING */
+
+    return (err);
 }
 
-inline void os_splitFlopI16(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff)
+void os_fReserve(st_encoder_t* p_enc, uint64_t len)
 {
-    int     i = 0;
-    uint8_t off = sizeof(int16_t);
+    assert(p_enc != NULL);
+    assert(p_enc->p_fp != NULL);
+
+    /* stdio takes its own small buffer unless one is given. Writes
+     * through io_uring are collected in its blocks, so none is needed. */
+    if ((p_enc->p_aio == NULL) &&
+        ((posix_memalign((void**) &p_enc->p_wbuf, OS_WRITE_ALIGN, OS_WRITE_BLOCK) != 0) ||
+         (setvbuf(p_enc->p_fp, (char*) p_enc->p_wbuf, _IOFBF, OS_WRITE_BLOCK) != 0))) {
+        free(p_enc->p_wbuf);
+        p_enc->p_wbuf = NULL;
+    }
 
-    while (1)
+#ifdef __linux__
+    /* Only extents are allocated, unlike posix_fallocate() which falls
+     * back to writing zeros where it isn't supported */
+    if ((len > 0) && (fallocate(fileno(p_enc->p_fp), 0, 0, len) == 0))
+        p_enc->reserved = len;
+#else
+    (void) len;
+#endif
+}
+
+void os_fSyncMode(en_encSync_t mode)
+{
+    os_syncMode = mode;
+}
+
+int8_t os_fCommit(st_encoder_t* p_enc)
+{
+    assert(p_enc != NULL);
+    assert(p_enc->temp);
+
+    st_osCommit_t   commit = { .p_enc = p_enc, .err = 0, .done = 0 };
+    st_osCommit_t*  p_group = NULL;
+    st_osCommit_t*  p_next = NULL;
+
+    if (__fFinish(p_enc) < 0)
+        return (-1);
+
+    switch (os_syncMode)
     {
-        if (((i + off) < toMaxOff) && (toFir != NULL))
+        case en_sync_file:
+            if (fsync(fileno(p_enc->p_fp)) != 0)
+                return (-1);
+            return (__fPublish(p_enc, 1));
+
+        case en_sync_group:
+#ifdef __linux__
+            /* Write-back starts now, so the group mostly waits for data
+             * which is on its way already */
+            sync_file_range(fileno(p_enc->p_fp), 0, 0, SYNC_FILE_RANGE_WRITE);
+#endif
+            pthread_mutex_lock(&os_syncLock);
+            commit.p_next = os_syncQueue;
+            os_syncQueue = &commit;
+            while (!commit.done)
+            {
+                if (os_syncBusy)
+                {
+                    pthread_cond_wait(&os_syncDone, &os_syncLock);
+                    continue;
+                }
+
+                /* Whoever finds no group in progress takes all waiting
+                 * outputs, the ones coming meanwhile form the next group */
+                os_syncBusy = 1;
+                p_group = os_syncQueue;
+                os_syncQueue = NULL;
+                pthread_mutex_unlock(&os_syncLock);
+                __syncGroup(p_group);
+                pthread_mutex_lock(&os_syncLock);
+                os_syncBusy = 0;
+                for (; p_group != NULL; p_group = p_next)
+                {
+                    p_next = p_group->p_next;
+                    p_group->done = 1;
+                }
+                pthread_cond_broadcast(&os_syncDone);
+            }
+            pthread_mutex_unlock(&os_syncLock);
+            return (commit.err);
+
+        case en_sync_none:
+        default:
+            return (__fPublish(p_enc, 0));
+    }
+}
+
+int32_t os_fExplore(st_encArg_t* p_tArgs, os_fFound_t p_found)
+{
+
+    assert(p_tArgs != NULL);
+    assert(p_tArgs->p_trgPath != NULL);
+
+    st_osScan_t     scan = { .p_tArgs = p_tArgs, .p_found = p_found, .pending = 0 };
+    st_encDir_t*    p_root = NULL;
+    struct stat     st;
+    struct rlimit   lim;
+
+    /* Directories stay open until all their files are converted,
+     * so the soft limit of descriptors is raised as far as allowed */
+    if (getrlimit(RLIMIT_NOFILE, &lim) == 0) {
+        if ((lim.rlim_cur < lim.rlim_max) && (lim.rlim_max != RLIM_INFINITY)) {
+            lim.rlim_cur = lim.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &lim);
+            getrlimit(RLIMIT_NOFILE, &lim);
+        }
+        os_dirFdMax = (lim.rlim_cur < UINT32_MAX) ? lim.rlim_cur / OS_DIR_SHARE :
+                                                    UINT32_MAX / OS_DIR_SHARE;
+    }
+
+    pthread_mutex_init(&scan.lock, NULL);
+    pthread_cond_init(&scan.done, NULL);
+
+    p_root = __dirAdd(&scan, NULL, NULL);
+    if (p_root == NULL) {
+        fprintf(stderr, "Error : Failed to allocate memory for directory\n");
+        p_tArgs->files = -1;
+    } else {
+        /* Scanning the in directory */
+        p_root->fd = open(p_tArgs->p_trgPath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (p_root->fd < 0) {
+            fprintf(stderr, "Error : Failed to open input directory.\n");
+            p_tArgs->files = -1;
+        }
+        /* Outputs are written to a mirror of the tree */
+        if ((p_root->fd >= 0) && (p_tArgs->p_outPath != NULL)) {
+            if (os_mkDir(p_tArgs->p_outPath) == 0)
+                p_root->outFd = open(p_tArgs->p_outPath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if ((p_root->outFd < 0) || (fstat(p_root->outFd, &st) != 0)) {
+                fprintf(stderr, "Error : Failed to open output directory.\n");
+                p_tArgs->files = -1;
+            } else {
+                scan.outDev = st.st_dev;
+                scan.outIno = st.st_ino;
+            }
+        }
+        if (p_tArgs->files < 0) {
+            __dirRelease(p_root);
+            __dirDone(&scan);
+        } else {
+            /* Root is held for the whole run, files of directories which
+             * aren't held are opened through it */
+            p_root->held = 1;
+            atomic_fetch_add(&os_dirFds, 1 + (p_root->outFd >= 0));
+            atomic_fetch_add(&p_root->refs, 1);
+            __dirScan(&scan, p_root);
+        }
+    }
+
+    /* Subdirectories are scanned by the pool */
+    pthread_mutex_lock(&scan.lock);
+    while (scan.pending > 0)
+        pthread_cond_wait(&scan.done, &scan.lock);
+    pthread_mutex_unlock(&scan.lock);
+
+    pthread_cond_destroy(&scan.done);
+    pthread_mutex_destroy(&scan.lock);
+
+    return (p_tArgs->files);
+}
+
+void os_dirRetain(st_encDir_t* p_dir)
+{
+    assert(p_dir != NULL);
+
+    atomic_fetch_add(&__dirBase(p_dir)->refs, 1);
+}
+
+void os_dirRelease(st_encDir_t* p_dir)
+{
+    assert(p_dir != NULL);
+
+    __dirRelease(__dirBase(p_dir));
+}
+
+static uint32_t __cgroupCpus(void)
+{
+    char        p_path[MAX_FILEPATH] = { '\0' };
+    char        p_line[MAX_FILEPATH] = { '\0' };
+    char*       p_cut = NULL;
+    FILE*       p_fp = NULL;
+    uint64_t    quota = 0;
+    uint64_t    period = 0;
+    uint32_t    cpus = 0;
+    size_t      len = 0;
+
+    /* The only line of v2 hierarchy is "0::/path" */
+    if ((p_fp = fopen(OS_CGROUP_SELF, "r")) == NULL)
+        return (0);
+    while (fgets(p_line, sizeof(p_line), p_fp) != NULL)
+    {
+        if (strncmp(p_line, "0::", 3) == 0)
         {
-            *toFir = from[i + 1] << 24 | from[i] << 16;
-            toFir++;
-            i += off;
+            len = strcspn(p_line + 3, "\n");
+            p_line[3 + len] = '\0';
+            snprintf(p_path, sizeof(p_path), "%s%s", OS_CGROUP_ROOT, p_line + 3);
+            break;
         }
+    }
+    fclose(p_fp);
+    if (p_path[0] == '\0')
+        return (0);
 
-        if (((i + off) < toMaxOff) && (toSec != NULL))
+    /* Any parent may be limited stricter, the smallest quota wins */
+    while (1)
+    {
+        len = strlen(p_path);
+        strncat(p_path, "/cpu.max", sizeof(p_path) - len - 1);
+        if ((p_fp = fopen(p_path, "r")) != NULL)
         {
-            *toSec = from[i + 1] << 24 | from[i] << 16;
-            toSec++;
-            i += off;
+            /* "max 100000" if unlimited, otherwise "quota period" */
+            if ((fscanf(p_fp, "%lu %lu", &quota, &period) == 2) && (period > 0))
+            {
+                quota = (quota + period - 1) / period;
+                if ((quota > 0) && ((cpus == 0) || (quota < cpus)))
+                    cpus = quota;
+            }
+            fclose(p_fp);
         }
+        p_path[len] = '\0';
 
-        if ((i + off) == toMaxOff)
+        p_cut = strrchr(p_path, '/');
+        if ((p_cut == NULL) || (len <= strlen(OS_CGROUP_ROOT)))
             break;
+        *p_cut = '\0';
     }
+
+    return (cpus);
 }
 
-inline void os_splitFlopI24(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff)
+static uint8_t __cpuIsSibling(uint32_t cpu, const cpu_set_t* p_set)
 {
-    int     i = 0;
-    uint8_t off = 3;
+    char            p_path[MAX_FILEPATH] = { '\0' };
+    FILE*           p_fp = NULL;
+    unsigned long   from = 0;
+    unsigned long   to = 0;
+    uint8_t         sibling = 0;
+    int             sep = 0;
+
+    snprintf(p_path, sizeof(p_path), OS_CPU_SIBLINGS, cpu);
+    if ((p_fp = fopen(p_path, "r")) == NULL)
+        return (0);
+
+    /* List of ranges like "0-1" or "0,64" */
+    while (!sibling && (fscanf(p_fp, "%lu", &from) == 1))
+    {
+        to = from;
+        sep = fgetc(p_fp);
+        if ((sep == '-') && (fscanf(p_fp, "%lu", &to) == 1))
+            sep = fgetc(p_fp);
 
-    while (1)
+        for (unsigned long i = from; (i <= to) && (i < cpu); i++)
+        {
+            if (CPU_ISSET(i, p_set))
+                sibling = 1;
+        }
+        if (sep != ',')
+            break;
+    }
+    fclose(p_fp);
+
+    return (sibling);
+}
+
+uint32_t os_cpuList(uint32_t** pp_cpus, uint8_t smt)
+{
+    cpu_set_t   set;
+    uint32_t    cpus = 0;
+
+    *pp_cpus = NULL;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) != 0)
+        return (0);
+
+    *pp_cpus = malloc(CPU_COUNT(&set) * sizeof(uint32_t));
+    if (*pp_cpus == NULL)
+        return (0);
+
+    for (uint32_t i = 0; i < CPU_SETSIZE; i++)
+    {
+        if (!CPU_ISSET(i, &set))
+            continue;
+        /* Only the first hyper-thread of each physical core */
+        if (!smt && __cpuIsSibling(i, &set))
+            continue;
+        (*pp_cpus)[cpus++] = i;
+    }
+
+    return (cpus);
+}
+
+int8_t os_cpuPin(uint32_t cpu)
+{
+    cpu_set_t   set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    return ((pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0) ? 0 : -1);
+}
+
+uint32_t os_cpuNode(void)
+{
+    unsigned    cpu = 0;
+    unsigned    node = 0;
+
+    /* Kernels without NUMA report node 0 */
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+        return (0);
+
+    return (node);
+}
+
+uint32_t os_cpuCount(void)
+{
+    cpu_set_t   set;
+    long        online = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t    cpus = (online > 0) ? online : 1;
+    uint32_t    quota = 0;
+
+    /* Only CPUs we are allowed to run on count */
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        cpus = CPU_COUNT(&set);
+
+    /* Containers are often limited by a quota rather than by affinity */
+    quota = __cgroupCpus();
+    if ((quota > 0) && (quota < cpus))
+        cpus = quota;
+
+    return ((cpus > 0) ? cpus : 1);
+}
+
+inline void os_mkPath(char* p_path, char* p_dirPath, char* p_fname, uint16_t lim)
+{
+    snprintf(p_path,lim,"%s/%s",p_dirPath,p_fname);
+}
+
+int8_t os_dirPath(char* p_path, const char* p_root, const st_encDir_t* p_dir,
+                  const char* p_fname, uint32_t lim)
+{
+    size_t      len = strlen(p_fname);
+    size_t      off = 0;
+
+    /* Length first, then the path is filled from its end */
+    if (p_root != NULL)
+        len += strlen(p_root) + 1;
+    for (const st_encDir_t* p_it = p_dir; (p_it != NULL) && (p_it->p_name != NULL);
+         p_it = p_it->p_parent)
+        len += strlen(p_it->p_name) + 1;
+    if (len >= lim)
+        return (-1);
+
+    off = len - strlen(p_fname);
+    memcpy(p_path + off, p_fname, strlen(p_fname) + 1);
+    for (const st_encDir_t* p_it = p_dir; (p_it != NULL) && (p_it->p_name != NULL);
+         p_it = p_it->p_parent)
+    {
+        p_path[--off] = '/';
+        off -= strlen(p_it->p_name);
+        memcpy(p_path + off, p_it->p_name, strlen(p_it->p_name));
+    }
+    if (p_root != NULL)
     {
-        if (((i + off) < toMaxOff) && (toFir != NULL))
+        p_path[--off] = '/';
+        memcpy(p_path, p_root, off);
+    }
+
+    return (0);
+}
+
+void os_outPath(char* p_to, const char* p_from)
+{
+    __extSubstitute(p_to, p_from);
+}
+
+int8_t os_fLink(const st_encDir_t* p_fromDir, const char* p_from,
+                const st_encDir_t* p_toDir, const char* p_to)
+{
+    char        p_fromRel[PATH_MAX];
+    char        p_toRel[PATH_MAX];
+    char        p_tmp[PATH_MAX];
+    int         fromFd = __dirAt(p_fromDir, p_from, 1, p_fromRel, &p_from);
+    int         toFd = __dirAt(p_toDir, p_to, 1, p_toRel, &p_to);
+
+    /* The target appears at once, readers never see a partial file */
+    if (__tempName(p_tmp, p_to, atomic_fetch_add(&os_tmpSeq, 1)) < 0)
+        return (-1);
+
+    if ((linkat(fromFd, p_from, toFd, p_tmp, 0) != 0) &&
+        (__fCopy(fromFd, p_from, toFd, p_tmp) < 0))
+        return (-1);
+
+    /* The target is made as durable as an encoded output. A link is
+     * published on its own, there is nothing to wait for a group. */
+    if (((os_syncMode != en_sync_none) && (__syncFile(toFd, p_tmp) < 0)) ||
+        (renameat(toFd, p_tmp, toFd, p_to) != 0))
+    {
+        unlinkat(toFd, p_tmp, 0);
+        return (-1);
+    }
+
+    if (os_syncMode != en_sync_none)
+        return (__syncDir(toFd, p_to));
+
+    return (0);
+}
+
+int8_t os_mkDir(const char* p_path)
+{
+    struct stat st;
+
+    if ((mkdir(p_path, 0777) != 0) &&
+        ((errno != EEXIST) || (stat(p_path, &st) != 0) || !S_ISDIR(st.st_mode)))
+        return (-1);
+
+    return (0);
+}
+
+inline uint32_t os_fread_unlocked(void* p_buf, size_t size, size_t cnt, FILE* p_fp)
+{
+    return (fread_unlocked(p_buf, size, cnt, p_fp));
+}
+
+inline void os_fwrite_unlocked(void* p_buf, size_t size, size_t cnt, FILE* p_fp)
+{
+    fwrite_unlocked(p_buf, size, cnt, p_fp);
+}
+
+inline uint32_t os_fRead(st_encoder_t* p_enc, uint8_t** pp_buf, size_t size, size_t cnt)
+{
+    size_t avail = 0;
+
+#ifdef OS_IOURING
+    if (p_enc->p_aio)
+        return (__aioRead(p_enc->p_aio, pp_buf, size, cnt));
+#endif
+    if (p_enc->p_map == NULL)
+        return (fread_unlocked(*pp_buf, size, cnt, p_enc->p_fp));
+
+    avail = (p_enc->mapEnd - p_enc->mapOff) / size;
+    if (cnt > avail)
+        cnt = avail;
+
+    *pp_buf = p_enc->p_map + p_enc->mapOff;
+    p_enc->mapOff += cnt * size;
+
+    /* Released pages are read from the file again if they are touched */
+    if ((p_enc->mapOff - p_enc->mapFree) >= 2 * OS_MAP_KEEP) {
+        madvise(p_enc->p_map + p_enc->mapFree, OS_MAP_KEEP, MADV_DONTNEED);
+        p_enc->mapFree += OS_MAP_KEEP;
+    }
+
+    return (cnt);
+}
+
+inline void os_fWrite(st_encoder_t* p_enc, uint8_t* p_buf, size_t len)
+{
+#ifdef OS_IOURING
+    if (p_enc->p_aio) {
+        __aioWrite(p_enc->p_aio, p_buf, len);
+        return;
+    }
+#endif
+    fwrite_unlocked(p_buf, 1, len, p_enc->p_fp);
+}
+
+inline void os_fclose(st_encoder_t* p_enc)
+{
+    char        p_rel[PATH_MAX];
+    char        p_tmp[PATH_MAX];
+    const char* p_name = NULL;
+    int         dirFd = -1;
+
+#ifdef OS_IOURING
+    if (p_enc->p_aio)
+        __aioClose(p_enc);
+#endif
+    if (p_enc->p_map)
+        munmap(p_enc->p_map, p_enc->fsize);
+    if (p_enc->opened)
+        fclose( p_enc->p_fp);
+    /* Output which wasn't committed is dropped, the old one stays */
+    if (p_enc->temp) {
+        dirFd = __dirAt(p_enc->p_dir, p_enc->p_fname, 1, p_rel, &p_name);
+        if ((dirFd != -1) && (__tempName(p_tmp, p_name, p_enc->tempSeq) == 0))
+            unlinkat(dirFd, p_tmp, 0);
+        p_enc->temp = 0;
+    }
+    free(p_enc->p_wbuf);
+    p_enc->p_wbuf = NULL;
+}
+
+/*
+ * Scalar converters. They are used as a fallback on CPUs without SIMD
+ * support and to process tails which don't fill a whole vector.
+ */
+OS_SPLIT_INLINE void __splitUI8Scalar(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff)
+{
+    uint32_t i = 0;
+
+    if (toSec == NULL)
+    {
+        for (i = 0; i < toMaxOff; i++)
+            toFir[i] = (from[i] ^ 0x80) << 24;
+    }
+    else
+    {
+        for (i = 0; (i + 2) <= toMaxOff; i += 2)
         {
-            *toFir = from[i + 2] << 24 | from[i + 1] << 16 | from[i] << 8;
-            toFir++;
-            i += off;
+            *toFir++ = (from[i] ^ 0x80) << 24;
+            *toSec++ = (from[i + 1] ^ 0x80) << 24;
         }
+    }
+}
 
-        if (((i + off) < toMaxOff) && (toSec != NULL))
+OS_SPLIT_INLINE void __splitI16Scalar(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff)
+{
+    uint32_t i = 0;
+
+    if (toSec == NULL)
+    {
+        for (i = 0; (i + 2) <= toMaxOff; i += 2)
+            *toFir++ = from[i + 1] << 24 | from[i] << 16;
+    }
+    else
+    {
+        for (i = 0; (i + 4) <= toMaxOff; i += 4)
         {
-            *toSec = from[i + 2] << 24 | from[i + 1] << 16 | from[i] << 8;
-            toSec++;
-            i += off;
+            *toFir++ = from[i + 1] << 24 | from[i] << 16;
+            *toSec++ = from[i + 3] << 24 | from[i + 2] << 16;
         }
+    }
+}
 
-        if ((i + off) == toMaxOff)
-            break;
+OS_SPLIT_INLINE void __splitI24Scalar(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff)
+{
+    uint32_t i = 0;
+
+    if (toSec == NULL)
+    {
+        for (i = 0; (i + 3) <= toMaxOff; i += 3)
+            *toFir++ = from[i + 2] << 24 | from[i + 1] << 16 | from[i] << 8;
+    }
+    else
+    {
+        for (i = 0; (i + 6) <= toMaxOff; i += 6)
+        {
+            *toFir++ = from[i + 2] << 24 | from[i + 1] << 16 | from[i] << 8;
+            *toSec++ = from[i + 5] << 24 | from[i + 4] << 16 | from[i + 3] << 8;
+        }
     }
 }
 
-inline void os_splitFlopI32(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff)
+OS_SPLIT_INLINE void __splitI32Scalar(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff)
 {
-    int     i = 0;
-    uint8_t off = sizeof(int32_t);
+    uint32_t i = 0;
 
-    while (1)
+    if (toSec == NULL)
+    {
+        for (i = 0; (i + 4) <= toMaxOff; i += 4)
+            *toFir++ = from[i + 3] << 24 | from[i + 2] << 16 | from[i + 1] << 8 | from[i];
+    }
+    else
+    {
+        for (i = 0; (i + 8) <= toMaxOff; i += 8)
+        {
+            *toFir++ = from[i + 3] << 24 | from[i + 2] << 16 | from[i + 1] << 8 | from[i];
+            *toSec++ = from[i + 7] << 24 | from[i + 6] << 16 | from[i + 5] << 8 | from[i + 4];
+        }
+    }
+}
+
+OS_SPLIT_SPECIALIZE(__splitUI8Scalar, )
+OS_SPLIT_SPECIALIZE(__splitI16Scalar, )
+OS_SPLIT_SPECIALIZE(__splitI24Scalar, )
+OS_SPLIT_SPECIALIZE(__splitI32Scalar, )
+
+#if OS_SPLIT_X86
+/*
+ * SSE2 converters. WAVE samples are little-endian as x86 is, so every
+ * sample is moved to the upper bits of a 32 bits lane with shifts and
+ * unpacks only. Whatever doesn't fill a whole vector is left for the
+ * scalar version.
+ */
+OS_SPLIT_INLINE void __splitUI8Sse2(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff)
+{
+    const __m128i   zero = _mm_setzero_si128();
+    const __m128i   sign = _mm_set1_epi8((char) 0x80);
+    const __m128i   lowB = _mm_set1_epi16(0x00FF);
+    uint32_t        i = 0;
+    __m128i         x, l, r;
+
+    if (toSec == NULL)
+    {
+        for (i = 0; (i + 16) <= toMaxOff; i += 16, toFir += 16)
+        {
+            x = _mm_xor_si128(_mm_loadu_si128((__m128i*) (from + i)), sign);
+            l = _mm_unpacklo_epi8(zero, x);
+            r = _mm_unpackhi_epi8(zero, x);
+            _mm_storeu_si128((__m128i*) (toFir + 0), _mm_unpacklo_epi16(zero, l));
+            _mm_storeu_si128((__m128i*) (toFir + 4), _mm_unpackhi_epi16(zero, l));
+            _mm_storeu_si128((__m128i*) (toFir + 8), _mm_unpacklo_epi16(zero, r));
+            _mm_storeu_si128((__m128i*) (toFir + 12), _mm_unpackhi_epi16(zero, r));
+        }
+    }
+    else
     {
-        if (((i + off) < toMaxOff) && (toFir != NULL))
+        for (i = 0; (i + 16) <= toMaxOff; i += 16, toFir += 8, toSec += 8)
         {
-            *toFir = from[i + 3] << 24 | from[i + 2] << 16 | from[i + 1] << 8 | from[i];
-            toFir++;
-            i += off;
+            x = _mm_xor_si128(_mm_loadu_si128((__m128i*) (from + i)), sign);
+            /* Even bytes go to the left channel, odd ones to the right */
+            l = _mm_slli_epi16(_mm_and_si128(x, lowB), 8);
+            r = _mm_slli_epi16(_mm_srli_epi16(x, 8), 8);
+            _mm_storeu_si128((__m128i*) (toFir + 0), _mm_unpacklo_epi16(zero, l));
+            _mm_storeu_si128((__m128i*) (toFir + 4), _mm_unpackhi_epi16(zero, l));
+            _mm_storeu_si128((__m128i*) (toSec + 0), _mm_unpacklo_epi16(zero, r));
+            _mm_storeu_si128((__m128i*) (toSec + 4), _mm_unpackhi_epi16(zero, r));
         }
+    }
+    __splitUI8Scalar(from + i, toFir, toSec, toMaxOff - i);
+}
+
+OS_SPLIT_INLINE void __splitI16Sse2(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff)
+{
+    const __m128i   zero = _mm_setzero_si128();
+    const __m128i   highW = _mm_set1_epi32((int) 0xFFFF0000);
+    uint32_t        i = 0;
+    __m128i         x;
 
-        if (((i + off) < toMaxOff) && (toSec != NULL))
+    if (toSec == NULL)
+    {
+        for (i = 0; (i + 16) <= toMaxOff; i += 16, toFir += 8)
+        {
+            x = _mm_loadu_si128((__m128i*) (from + i));
+            _mm_storeu_si128((__m128i*) (toFir + 0), _mm_unpacklo_epi16(zero, x));
+            _mm_storeu_si128((__m128i*) (toFir + 4), _mm_unpackhi_epi16(zero, x));
+        }
+    }
+    else
+    {
+        for (i = 0; (i + 16) <= toMaxOff; i += 16, toFir += 4, toSec += 4)
         {
-            *toSec = from[i + 3] << 24 | from[i + 2] << 16 | from[i + 1] << 8 | from[i];
-            toSec++;
-            i += off;
+            /* Every 32 bits lane holds a frame: left is low, right is high */
+            x = _mm_loadu_si128((__m128i*) (from + i));
+            _mm_storeu_si128((__m128i*) toFir, _mm_slli_epi32(x, 16));
+            _mm_storeu_si128((__m128i*) toSec, _mm_and_si128(x, highW));
         }
+    }
+    __splitI16Scalar(from + i, toFir, toSec, toMaxOff - i);
+}
+
+/* Load 3 bytes sample together with the next byte, which is shifted out */
+static inline int32_t __load24(const uint8_t* from)
+{
+    uint32_t u32;
+
+    memcpy(&u32, from, sizeof(u32));
+    return ((int32_t) u32);
+}
 
-        if ((i + off) == toMaxOff)
+OS_SPLIT_INLINE void __splitI24Sse2(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff)
+{
+    uint32_t        i = 0;
+    __m128i         l, r;
+
+    /* SSE2 has no byte shuffle, so samples are gathered with unaligned
+     * loads. We always keep one spare byte for the last load. */
+    if (toSec == NULL)
+    {
+        for (i = 0; (i + 13) <= toMaxOff; i += 12, toFir += 4)
+        {
+            l = _mm_setr_epi32(__load24(from + i), __load24(from + i + 3),
+                               __load24(from + i + 6), __load24(from + i + 9));
+            _mm_storeu_si128((__m128i*) toFir, _mm_slli_epi32(l, 8));
+        }
+    }
+    else
+    {
+        for (i = 0; (i + 25) <= toMaxOff; i += 24, toFir += 4, toSec += 4)
+        {
+            l = _mm_setr_epi32(__load24(from + i), __load24(from + i + 6),
+                               __load24(from + i + 12), __load24(from + i + 18));
+            r = _mm_setr_epi32(__load24(from + i + 3), __load24(from + i + 9),
+                               __load24(from + i + 15), __load24(from + i + 21));
+            _mm_storeu_si128((__m128i*) toFir, _mm_slli_epi32(l, 8));
+            _mm_storeu_si128((__m128i*) toSec, _mm_slli_epi32(r, 8));
+        }
+    }
+    __splitI24Scalar(from + i, toFir, toSec, toMaxOff - i);
+}
+
+OS_SPLIT_INLINE void __splitI32Sse2(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff)
+{
+    uint32_t        i = 0;
+    __m128i         a, b;
+
+    if (toSec == NULL)
+    {
+        /* Samples are already in host order */
+        i = toMaxOff & ~3u;
+        memcpy(toFir, from, i);
+        toFir += i >> 2;
+    }
+    else
+    {
+        for (i = 0; (i + 32) <= toMaxOff; i += 32, toFir += 4, toSec += 4)
+        {
+            /* {L0 R0 L1 R1} -> {L0 L1 R0 R1} */
+            a = _mm_shuffle_epi32(_mm_loadu_si128((__m128i*) (from + i)),
+                                  _MM_SHUFFLE(3, 1, 2, 0));
+            b = _mm_shuffle_epi32(_mm_loadu_si128((__m128i*) (from + i + 16)),
+                                  _MM_SHUFFLE(3, 1, 2, 0));
+            _mm_storeu_si128((__m128i*) toFir, _mm_unpacklo_epi64(a, b));
+            _mm_storeu_si128((__m128i*) toSec, _mm_unpackhi_epi64(a, b));
+        }
+    }
+    __splitI32Scalar(from + i, toFir, toSec, toMaxOff - i);
+}
+
+OS_SPLIT_SPECIALIZE(__splitUI8Sse2, )
+OS_SPLIT_SPECIALIZE(__splitI16Sse2, )
+OS_SPLIT_SPECIALIZE(__splitI24Sse2, )
+OS_SPLIT_SPECIALIZE(__splitI32Sse2, )
+
+/*
+ * AVX2 converters. Byte shuffles are available here, so 24 bits samples
+ * and stereo deinterleaving don't need scalar loads anymore.
+ */
+__attribute__((target("avx2")))
+OS_SPLIT_INLINE void __splitUI8Avx2(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff)
+{
+    const __m128i   sign = _mm_set1_epi8((char) 0x80);
+    /* {L0 R0 L1 R1 ...} -> {L0 L1 ... L7 R0 R1 ... R7} */
+    const __m128i   deint = _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14,
+                                          1, 3, 5, 7, 9, 11, 13, 15);
+    uint32_t        i = 0;
+    __m128i         x;
+
+    if (toSec == NULL)
+    {
+        for (i = 0; (i + 16) <= toMaxOff; i += 16, toFir += 16)
+        {
+            x = _mm_xor_si128(_mm_loadu_si128((__m128i*) (from + i)), sign);
+            _mm256_storeu_si256((__m256i*) (toFir + 0),
+                    _mm256_slli_epi32(_mm256_cvtepu8_epi32(x), 24));
+            _mm256_storeu_si256((__m256i*) (toFir + 8),
+                    _mm256_slli_epi32(_mm256_cvtepu8_epi32(_mm_srli_si128(x, 8)), 24));
+        }
+    }
+    else
+    {
+        for (i = 0; (i + 16) <= toMaxOff; i += 16, toFir += 8, toSec += 8)
+        {
+            x = _mm_xor_si128(_mm_loadu_si128((__m128i*) (from + i)), sign);
+            x = _mm_shuffle_epi8(x, deint);
+            _mm256_storeu_si256((__m256i*) toFir,
+                    _mm256_slli_epi32(_mm256_cvtepu8_epi32(x), 24));
+            _mm256_storeu_si256((__m256i*) toSec,
+                    _mm256_slli_epi32(_mm256_cvtepu8_epi32(_mm_srli_si128(x, 8)), 24));
+        }
+    }
+    __splitUI8Scalar(from + i, toFir, toSec, toMaxOff - i);
+}
+
+__attribute__((target("avx2")))
+OS_SPLIT_INLINE void __splitI16Avx2(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff)
+{
+    const __m256i   highW = _mm256_set1_epi32((int) 0xFFFF0000);
+    uint32_t        i = 0;
+    __m256i         x;
+
+    if (toSec == NULL)
+    {
+        for (i = 0; (i + 16) <= toMaxOff; i += 16, toFir += 8)
+        {
+            x = _mm256_cvtepi16_epi32(_mm_loadu_si128((__m128i*) (from + i)));
+            _mm256_storeu_si256((__m256i*) toFir, _mm256_slli_epi32(x, 16));
+        }
+    }
+    else
+    {
+        for (i = 0; (i + 32) <= toMaxOff; i += 32, toFir += 8, toSec += 8)
+        {
+            x = _mm256_loadu_si256((__m256i*) (from + i));
+            _mm256_storeu_si256((__m256i*) toFir, _mm256_slli_epi32(x, 16));
+            _mm256_storeu_si256((__m256i*) toSec, _mm256_and_si256(x, highW));
+        }
+    }
+    __splitI16Scalar(from + i, toFir, toSec, toMaxOff - i);
+}
+
+__attribute__((target("avx2")))
+OS_SPLIT_INLINE void __splitI24Avx2(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff)
+{
+    /* Every 128 bits lane is loaded with 12 bytes of samples, each sample
+     * gets to the upper 3 bytes of its 32 bits lane, lowest byte is zero */
+    const __m256i   mono = _mm256_setr_epi8(
+            -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11,
+            -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+    /* The same for stereo, but frames are reordered as {L0 L1 R0 R1} */
+    const __m256i   stereo = _mm256_setr_epi8(
+            -1, 0, 1, 2, -1, 6, 7, 8, -1, 3, 4, 5, -1, 9, 10, 11,
+            -1, 0, 1, 2, -1, 6, 7, 8, -1, 3, 4, 5, -1, 9, 10, 11);
+    const __m256i   deint = _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7);
+    uint32_t        i = 0;
+    __m256i         x;
+
+    /* Every load reads 4 bytes after its 12 bytes of samples */
+    if (toSec == NULL)
+    {
+        for (i = 0; (i + 28) <= toMaxOff; i += 24, toFir += 8)
+        {
+            x = _mm256_inserti128_si256(_mm256_castsi128_si256(
+                    _mm_loadu_si128((__m128i*) (from + i))),
+                    _mm_loadu_si128((__m128i*) (from + i + 12)), 1);
+            _mm256_storeu_si256((__m256i*) toFir, _mm256_shuffle_epi8(x, mono));
+        }
+    }
+    else
+    {
+        for (i = 0; (i + 28) <= toMaxOff; i += 24, toFir += 4, toSec += 4)
+        {
+            x = _mm256_inserti128_si256(_mm256_castsi128_si256(
+                    _mm_loadu_si128((__m128i*) (from + i))),
+                    _mm_loadu_si128((__m128i*) (from + i + 12)), 1);
+            x = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(x, stereo), deint);
+            _mm_storeu_si128((__m128i*) toFir, _mm256_castsi256_si128(x));
+            _mm_storeu_si128((__m128i*) toSec, _mm256_extracti128_si256(x, 1));
+        }
+    }
+    __splitI24Scalar(from + i, toFir, toSec, toMaxOff - i);
+}
+
+__attribute__((target("avx2")))
+OS_SPLIT_INLINE void __splitI32Avx2(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff)
+{
+    const __m256i   deint = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    uint32_t        i = 0;
+    __m256i         x;
+
+    if (toSec == NULL)
+    {
+        __splitI32Sse2(from, toFir, toSec, toMaxOff);
+        return;
+    }
+
+    for (i = 0; (i + 32) <= toMaxOff; i += 32, toFir += 4, toSec += 4)
+    {
+        x = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((__m256i*) (from + i)), deint);
+        _mm_storeu_si128((__m128i*) toFir, _mm256_castsi256_si128(x));
+        _mm_storeu_si128((__m128i*) toSec, _mm256_extracti128_si256(x, 1));
+    }
+    __splitI32Scalar(from + i, toFir, toSec, toMaxOff - i);
+}
+
+OS_SPLIT_SPECIALIZE(__splitUI8Avx2, __attribute__((target("avx2"))))
+OS_SPLIT_SPECIALIZE(__splitI16Avx2, __attribute__((target("avx2"))))
+OS_SPLIT_SPECIALIZE(__splitI24Avx2, __attribute__((target("avx2"))))
+OS_SPLIT_SPECIALIZE(__splitI32Avx2, __attribute__((target("avx2"))))
+#endif /* OS_SPLIT_X86 */
+
+void os_splitFlopInit(void)
+{
+    /* The best one goes first */
+    for (int32_t impl = en_split_impls - 1; impl > en_split_scalar; impl--)
+    {
+        if (os_splitFlopImpl(impl, 1, 1) != NULL)
+        {
+            memcpy(os_split, os_splitImpl[impl], sizeof(os_split));
             break;
+        }
     }
 }
 
+os_splitFlop_t os_splitFlopImpl(en_osSplit_t impl, uint8_t bps, uint8_t channels)
+{
+    if ((impl >= en_split_impls) || (bps < 1) || (bps > 4) ||
+        (channels < 1) || (channels > 2))
+        return (NULL);
+
+#if OS_SPLIT_X86
+    __builtin_cpu_init();
+    if (((impl == en_split_avx2) && !__builtin_cpu_supports("avx2")) ||
+        ((impl == en_split_sse2) && !__builtin_cpu_supports("sse2")))
+        return (NULL);
+#endif
+
+    return (os_splitImpl[impl][bps - 1][channels - 1]);
+}
+
+os_splitFlop_t os_splitFlopGet(uint8_t bps, uint8_t channels)
+{
+    if ((bps < 1) || (bps > 4) || (channels < 1) || (channels > 2))
+        return (NULL);
+
+    return (os_split[bps - 1][channels - 1]);
+}
+
+inline void os_splitFlopUI8(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff)
+{
+    os_split[0][toSec != NULL](from, toFir, toSec, toMaxOff);
+}
+
+inline void os_splitFlopI16(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff)
+{
+    os_split[1][toSec != NULL](from, toFir, toSec, toMaxOff);
+}
+
+inline void os_splitFlopI24(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff)
+{
+    os_split[2][toSec != NULL](from, toFir, toSec, toMaxOff);
+}
+
+inline void os_splitFlopI32(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff)
+{
+    os_split[3][toSec != NULL](from, toFir, toSec, toMaxOff);
+}
+
 inline uint8_t os_flop_ui8i32(uint8_t* from, int32_t* to, uint32_t toOff, uint32_t toMaxOff)
 {
     uint8_t res = 1;
@@ -24,16 +24,35 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <stdatomic.h>
 #include <unistd.h>
 
 #include "encoder.h"
 #include "os.h"
+#include "state.h"
 #include "e4c.h"
 
 
 /*
  * --- Macro Definitions ---------------------------------------------------- *
  */
+/* Mono and stereo instances of the plain C converters, the channel
+ * check of the generic converter is resolved at compile time */
+#define OS_SPLIT_SPECIALIZE(fmt)                                              \
+    static void __split##fmt##Mono(uint8_t* from, int32_t* toFir,             \
+                                   int32_t* toSec, uint32_t toMaxOff)         \
+    {                                                                         \
+        (void) toSec;                                                         \
+        os_splitFlop##fmt(from, toFir, NULL, toMaxOff);                       \
+    }                                                                         \
+    static void __split##fmt##Stereo(uint8_t* from, int32_t* toFir,           \
+                                     int32_t* toSec, uint32_t toMaxOff)       \
+    {                                                                         \
+        os_splitFlop##fmt(from, toFir, toSec, toMaxOff);                      \
+    }
+
+/* Outputs are written in blocks of this size */
+#define OS_WRITE_BLOCK  (1 << 20)
 
 /*
  * --- Type Definitions ----------------------------------------------------- *
@@ -57,9 +76,58 @@ static char * __extSubstitute(char* to, const char* from);
  */
 static int8_t __extIsSupported(const char* from);
 
+/**
+ * \brief     Append a file to the table, a new chunk is allocated when
+ *            the last one is full, found files never move
+ * \param     p_encArg      Arguments with the table of files
+ * \param     p_fdesc       File to append, its name is duplicated
+ * \return    Negative for failure, otherwise index of the file
+ */
+static int32_t __fdescAdd(st_encArg_t* p_encArg, const st_encFDesc_t* p_fdesc);
+
+/**
+ * \brief     Scan a directory of the tree and its subdirectories one after
+ *            another, there are no descriptors of directories here, so
+ *            paths are built from the names
+ * \param     p_encArg      Arguments with the table of files
+ * \param     p_found       Called for every file added, might be NULL
+ * \param     p_dir         Directory to scan
+ * \return    Negative if the directory can't be read, otherwise OK
+ */
+static int8_t __dirExplore(st_encArg_t* p_encArg, os_fFound_t p_found,
+                           st_encDir_t* p_dir);
+
+/**
+ * \brief     Build the path of a file of a directory in the input tree or
+ *            in its mirror
+ * \param     p_path        String where to store result, MAX_PATH long
+ * \param     p_dir         Directory of the file, NULL if p_fname is a path
+ * \param     p_fname       Name of the file
+ * \param     out           Take the mirror in the output tree if it's set
+ * \return    Negative if the path doesn't fit, otherwise OK
+ */
+static int8_t __filePath(char* p_path, const st_encDir_t* p_dir, const char* p_fname,
+                         uint8_t out);
+
+/**
+ * \brief     Build the path of the temporary name of an output
+ * \param     p_path        String where to store result, MAX_PATH long
+ * \param     p_enc         Encoder file descriptor of an output file
+ * \return    Negative if the path doesn't fit, otherwise OK
+ */
+static int8_t __tempPath(char* p_path, const st_encoder_t* p_enc);
+
 /*
  * --- Variables ------------------------------------------------------------ *
- * /
+ */
+/* Roots of the tree given to os_fExplore(), there are no descriptors of
+ * directories here, so files are opened by paths built from them */
+static const char* os_inRoot = NULL;
+static const char* os_outRoot = NULL;
+/* Makes names of temporary files unique within the process */
+static _Atomic uint32_t os_tmpSeq = 0;
+/* Durability of outputs, see os_fCommit() */
+static en_encSync_t os_syncMode = en_sync_none;
 
 
 /*
@@ -74,7 +142,7 @@ static char * __extSubstitute(char* to, const char* from)
 
     lastdot = strrchr (to, '.');
     if (lastdot != NULL)
-        snprintf(lastdot, MAX_FILEPATH,".mp3");
+        strcpy(lastdot, ".mp3");
     return to;
 }
 
@@ -99,6 +167,171 @@ static int8_t __extIsSupported(const char* from)
     return (ret);
 }
 
+static int32_t __fdescAdd(st_encArg_t* p_encArg, const st_encFDesc_t* p_fdesc)
+{
+    uint32_t        idx = p_encArg->files;
+    st_encFDesc_t*  p_new = NULL;
+
+    if (idx >= (uint32_t) FDESC_CHUNKS * FDESC_CHUNK)
+        return (-1);
+
+    /* Only the list of chunks is allocated upfront */
+    if (p_encArg->pp_fdesc == NULL)
+    {
+        p_encArg->pp_fdesc = calloc(FDESC_CHUNKS, sizeof(st_encFDesc_t*));
+        if (p_encArg->pp_fdesc == NULL)
+            return (-1);
+    }
+    if ((idx & (FDESC_CHUNK - 1)) == 0)
+    {
+        p_encArg->pp_fdesc[idx >> FDESC_SHIFT] = malloc(FDESC_CHUNK * sizeof(st_encFDesc_t));
+        if (p_encArg->pp_fdesc[idx >> FDESC_SHIFT] == NULL)
+            return (-1);
+    }
+
+    p_new = ENC_FDESC(p_encArg, idx);
+    *p_new = *p_fdesc;
+    p_new->p_fname = strdup(p_fdesc->p_fname);
+    if (p_new->p_fname == NULL)
+        return (-1);
+    p_encArg->files++;
+
+    return (idx);
+}
+
+static int8_t __dirExplore(st_encArg_t* p_encArg, os_fFound_t p_found,
+                           st_encDir_t* p_dir)
+{
+    TCHAR 			p_path[MAX_PATH];
+    TCHAR 			p_mp3[MAX_PATH + sizeof(".mp3")];
+    TCHAR 			p_out[MAX_PATH];
+    int32_t         idx = 0;
+    st_encFDesc_t   fdesc;
+    st_encDir_t*    p_sub = NULL;
+	WIN32_FILE_ATTRIBUTE_DATA fad;
+	WIN32_FIND_DATA ffd;
+	HANDLE 			hFind = INVALID_HANDLE_VALUE;
+
+    /* Scanning the in directory */
+	if (os_dirPath(p_path, p_encArg->p_trgPath, p_dir, TEXT("*"), MAX_PATH) < 0)
+		return (-1);
+
+	// Find the first file in the directory.
+	hFind = FindFirstFile(p_path, &ffd);
+	if (INVALID_HANDLE_VALUE == hFind)
+	{
+		fprintf(stderr, "%s\n",TEXT("FindFirstFile"));
+		return (-1);
+	}
+
+	do {
+		if (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+		{
+			if (!strcmp(ffd.cFileName, ".") || !strcmp(ffd.cFileName, ".."))
+				continue;
+			/* Links aren't followed, they might make loops */
+			if (ffd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
+				continue;
+			p_sub = calloc(1, sizeof(st_encDir_t));
+			if ((p_sub == NULL) || ((p_sub->p_name = strdup(ffd.cFileName)) == NULL))
+			{
+				fprintf(stderr, "Error : Failed to allocate memory for directory\n");
+				free(p_sub);
+				continue;
+			}
+			p_sub->p_parent = p_dir;
+			p_sub->fd = -1;
+			p_sub->outFd = -1;
+			p_sub->p_next = p_encArg->p_dirs;
+			p_encArg->p_dirs = p_sub;
+
+			/* Output root inside the input tree isn't scanned */
+			if (p_encArg->p_outPath != NULL)
+			{
+				if ((os_dirPath(p_path, p_encArg->p_trgPath, p_sub, TEXT(""), MAX_PATH) == 0) &&
+					(os_dirPath(p_out, p_encArg->p_outPath, NULL, TEXT(""), MAX_PATH) == 0) &&
+					(_stricmp(p_path, p_out) == 0))
+					continue;
+				if ((os_dirPath(p_out, p_encArg->p_outPath, p_sub, TEXT(""), MAX_PATH) < 0) ||
+					(os_mkDir(p_out) < 0))
+				{
+					fprintf(stderr, "Error : Failed to create output directory %s.\n",
+							ffd.cFileName);
+					continue;
+				}
+			}
+			__dirExplore(p_encArg, p_found, p_sub);
+			continue;
+		}
+		if (__extIsSupported(ffd.cFileName) <= 0)
+			continue;
+
+		memset(&fdesc, 0, sizeof(fdesc));
+		fdesc.p_fname = ffd.cFileName;
+		fdesc.p_dir = p_dir;
+		fdesc.fsize = ((uint64_t) ffd.nFileSizeHigh << 32) | ffd.nFileSizeLow;
+		/* FILETIME counts 100 nanoseconds */
+		fdesc.mtime = (int64_t) (((uint64_t) ffd.ftLastWriteTime.dwHighDateTime << 32) |
+				ffd.ftLastWriteTime.dwLowDateTime) * 100;
+
+		/* Files converted before with the same size, time and settings
+		 * are skipped unless their output is gone */
+		if ((p_encArg->p_state != NULL) && state_fresh(p_encArg->p_state, &fdesc))
+		{
+			strcpy(p_mp3, ffd.cFileName);
+			__extSubstitute(p_mp3, ffd.cFileName);
+			if ((os_dirPath(p_out, (p_encArg->p_outPath != NULL) ? p_encArg->p_outPath :
+							p_encArg->p_trgPath, p_dir, p_mp3, MAX_PATH) == 0) &&
+				GetFileAttributesEx(p_out, GetFileExInfoStandard, &fad) &&
+				!(fad.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) &&
+				(fad.nFileSizeHigh || fad.nFileSizeLow))
+			{
+				p_encArg->skipped++;
+				continue;
+			}
+		}
+
+		idx = __fdescAdd(p_encArg, &fdesc);
+		if (idx < 0) {
+			fprintf(stderr, "Error : Failed to allocate memory for file descriptor\n");
+			break;
+		}
+		os_dirRetain(p_dir);
+		/* Conversion of the file may start before the scan is over */
+		if (p_found != NULL)
+			p_found(p_encArg, idx);
+	}while (FindNextFile(hFind, &ffd) != 0);
+	FindClose(hFind);
+
+    return (0);
+}
+
+static int8_t __filePath(char* p_path, const st_encDir_t* p_dir, const char* p_fname,
+                         uint8_t out)
+{
+    if (p_dir != NULL)
+        return (os_dirPath(p_path, (out && (os_outRoot != NULL)) ? os_outRoot : os_inRoot,
+                           p_dir, p_fname, MAX_PATH));
+
+    if (strlen(p_fname) >= MAX_PATH)
+        return (-1);
+    strcpy(p_path, p_fname);
+
+    return (0);
+}
+
+static int8_t __tempPath(char* p_path, const st_encoder_t* p_enc)
+{
+    TCHAR       p_out[MAX_PATH];
+
+    if ((__filePath(p_out, p_enc->p_dir, p_enc->p_fname, 1) < 0) ||
+        (snprintf(p_path, MAX_PATH, "%s.%lu.%lu.tmp", p_out, GetCurrentProcessId(),
+                  p_enc->tempSeq) >= MAX_PATH))
+        return (-1);
+
+    return (0);
+}
+
 
 /*
  * --- Global Functions Definition ------------------------------------------ *
@@ -106,15 +339,23 @@ static int8_t __extIsSupported(const char* from)
 int8_t os_fOpen(uint8_t read, st_encoder_t * p_enc)
 {
     assert(p_enc != NULL);
-    assert(p_enc->path != NULL);
+    assert(p_enc->p_dir != NULL);
+    assert(p_enc->p_fname != NULL);
 
     int8_t  err = 0;
 	struct  stat st;
     int     fd = 0;
+    TCHAR   p_path[MAX_PATH];
 
     E4C_TRY {
+        if (!read)
+            p_enc->tempSeq = atomic_fetch_add(&os_tmpSeq, 1);
+        if ((read ? __filePath(p_path, p_enc->p_dir, p_enc->p_fname, 0) :
+                    __tempPath(p_path, p_enc)) < 0) {
+            E4C_THROW(RuntimeException, "Path is too long.\n");
+        }
         if (read) {
-			fd = open(p_enc->path, O_RDONLY);
+			fd = open(p_path, O_RDONLY);
 			if (fd == -1) {
 				E4C_THROW(RuntimeException, "Failed to open a file\n");
 			}
@@ -131,26 +372,21 @@ int8_t os_fOpen(uint8_t read, st_encoder_t * p_enc)
                 E4C_THROW(RuntimeException, "Not a regular file.\n");
             }
 
-            p_enc->fsize = st.st_size;
-            if (p_enc->fsize == -1) {
+            /* st_size might be 32 bit */
+            p_enc->fsize = _filelengthi64(fd);
+            if (p_enc->fsize == (uint64_t) -1) {
                 E4C_THROW(RuntimeException, "Failed to calculate the size of a file.\n");
             }
 
         } else {
-            char* mp3Filename = NULL;
-            if ((mp3Filename = malloc (strlen (p_enc->path) + 1)) == NULL) {
-                E4C_THROW(RuntimeException, "Failed to allocate memory "
-                                            "for filename.\n");
-            }
-			strncpy (mp3Filename, p_enc->path, strlen(p_enc->path));
-            __extSubstitute(mp3Filename, p_enc->path);
-
-            /* Open a file to write*/
-			fd = open(mp3Filename, O_RDWR|O_CREAT);
-            free(mp3Filename);
+            /* Open a file to write under a temporary name, an existing
+             * output might be linked to the cache, so it's replaced by
+             * the rename on commit instead of being overwritten */
+			fd = open(p_path, O_RDWR|O_CREAT|O_TRUNC);
             if (fd == -1) {
                 E4C_THROW(RuntimeException, "Failed to open a file \n");
             }
+            p_enc->temp = 1;
 			
 			p_enc->p_fp = fdopen(fd, "wb");
 			if (p_enc->p_fp == NULL) {
@@ -168,80 +404,222 @@ int8_t os_fOpen(uint8_t read, st_encoder_t * p_enc)
         }
 
         const e4c_exception * e = e4c_get_exception();
-        fprintf(stderr, "Error: %s (%s) [%s].", e->name, e->message, p_enc->path);
+        fprintf(stderr, "Error: %s (%s) [%s].", e->name, e->message, p_enc->p_fname);
         err = -1;
     }
 
     return (err);
 }
 
-int8_t os_fOffset(FILE* p_fp, int32_t off)
+int32_t os_fPeek(const st_encDir_t* p_dir, const char* p_fname, uint8_t* p_buf,
+                 uint32_t len, uint64_t off)
+{
+    assert(p_dir != NULL);
+    assert(p_fname != NULL);
+    assert(p_buf != NULL);
+
+    TCHAR       p_path[MAX_PATH];
+    FILE*       p_fp = NULL;
+    size_t      got = 0;
+
+    if ((__filePath(p_path, p_dir, p_fname, 0) < 0) ||
+        ((p_fp = fopen(p_path, "rb")) == NULL))
+        return (-1);
+
+    if (_fseeki64(p_fp, off, SEEK_SET) == 0)
+        got = fread(p_buf, 1, len, p_fp);
+    else
+        got = (size_t) -1;
+    fclose(p_fp);
+
+    return ((got == (size_t) -1) ? -1 : (int32_t) got);
+}
+
+int8_t os_fOffset(FILE* p_fp, int64_t off)
 {
     int8_t err = 0;
     /* Find the end of the file in a safe way */
-    if (fseeko(p_fp, off , SEEK_CUR) != 0) {
+    if (_fseeki64(p_fp, off , SEEK_CUR) != 0) {
         err = -1;
     }
     return (err);
 }
 
-int32_t os_fExplore(st_encArg_t* p_encArg)
+int8_t os_fMap(st_encoder_t* p_enc, uint64_t len)
+{
+    /* Not supported yet, stream functions are used instead */
+    return (-1);
+}
+
+int8_t os_fAioStart(st_encoder_t* p_enc, uint64_t len)
+{
+    /* Not supported yet, stream functions are used instead */
+    return (-1);
+}
+
+void os_fSyncMode(en_encSync_t mode)
+{
+    os_syncMode = mode;
+}
+
+int8_t os_fCommit(st_encoder_t* p_enc)
+{
+    assert(p_enc != NULL);
+    assert(p_enc->temp);
+
+    TCHAR       p_path[MAX_PATH];
+    TCHAR       p_tmp[MAX_PATH];
+    DWORD       flags = MOVEFILE_REPLACE_EXISTING;
+    int8_t      err = 0;
+
+    if ((fflush(p_enc->p_fp) != 0) || ferror(p_enc->p_fp))
+        err = -1;
+
+    /* Directories can't be synced, the rename is written through
+     * instead, so groups are synced output by output */
+    if ((err == 0) && (os_syncMode != en_sync_none))
+    {
+        if (_commit(fileno(p_enc->p_fp)) != 0)
+            err = -1;
+        flags |= MOVEFILE_WRITE_THROUGH;
+    }
+
+    /* Opened files can't be renamed */
+    fclose(p_enc->p_fp);
+    p_enc->opened = 0;
+
+    if ((err == 0) &&
+        ((__filePath(p_path, p_enc->p_dir, p_enc->p_fname, 1) < 0) ||
+         (__tempPath(p_tmp, p_enc) < 0) || !MoveFileEx(p_tmp, p_path, flags)))
+        err = -1;
+    if (err == 0)
+        p_enc->temp = 0;
+
+    return (err);
+}
+
+void os_fReserve(st_encoder_t* p_enc, uint64_t len)
+{
+    assert(p_enc != NULL);
+    assert(p_enc->p_fp != NULL);
+
+    /* Space isn't preallocated yet, only writes are collected */
+    (void) len;
+    p_enc->p_wbuf = malloc(OS_WRITE_BLOCK);
+    if ((p_enc->p_wbuf != NULL) &&
+        (setvbuf(p_enc->p_fp, (char*) p_enc->p_wbuf, _IOFBF, OS_WRITE_BLOCK) != 0)) {
+        free(p_enc->p_wbuf);
+        p_enc->p_wbuf = NULL;
+    }
+}
+
+int32_t os_fExplore(st_encArg_t* p_encArg, os_fFound_t p_found)
 {
 
     assert(p_encArg != NULL);
     assert(p_encArg->p_trgPath != NULL);
 
-    TCHAR 			p_dir[MAX_PATH];
-    int32_t         dirSize = 0;
-	WIN32_FIND_DATA ffd;
-	HANDLE 			hFind = INVALID_HANDLE_VALUE;
+    st_encDir_t*    p_root = calloc(1, sizeof(st_encDir_t));
 
-    /* Scanning the in directory */
-	strncpy(p_dir, p_encArg->p_trgPath, MAX_PATH);
-	strncat(p_dir, TEXT("\\*"), MAX_PATH);
+    if (p_root == NULL)
+    {
+        p_encArg->files = -1;
+        return (-1);
+    }
+    p_root->fd = -1;
+    p_root->outFd = -1;
+    p_encArg->p_dirs = p_root;
+    os_inRoot = p_encArg->p_trgPath;
+    os_outRoot = p_encArg->p_outPath;
+
+    /* Outputs are written to a mirror of the tree */
+    if ((p_encArg->p_outPath != NULL) && (os_mkDir(p_encArg->p_outPath) < 0))
+    {
+        fprintf(stderr, "Error : Failed to open output directory.\n");
+        p_encArg->files = -1;
+        return (-1);
+    }
 
-	// Find the first file in the directory.
-	hFind = FindFirstFile(p_dir, &ffd);
-	if (INVALID_HANDLE_VALUE == hFind)
+    if (__dirExplore(p_encArg, p_found, p_root) < 0)
+        p_encArg->files = -1;
+
+    return (p_encArg->files);
+}
+
+void os_dirRetain(st_encDir_t* p_dir)
+{
+    assert(p_dir != NULL);
+
+    atomic_fetch_add(&p_dir->refs, 1);
+}
+
+void os_dirRelease(st_encDir_t* p_dir)
+{
+    assert(p_dir != NULL);
+
+    /* Nothing is kept open for a directory here */
+    atomic_fetch_sub(&p_dir->refs, 1);
+}
+
+uint32_t os_cpuCount(void)
+{
+	DWORD_PTR 		procMask = 0;
+	DWORD_PTR 		sysMask = 0;
+	SYSTEM_INFO 	info;
+	uint32_t        cpus = 0;
+
+	/* Only CPUs we are allowed to run on count */
+	if (GetProcessAffinityMask(GetCurrentProcess(), &procMask, &sysMask))
 	{
-		fprintf(stderr, "%s\n",TEXT("FindFirstFile"));
-		dirSize = -1;
-		return (dirSize);
+		for (; procMask; procMask &= procMask - 1)
+			cpus++;
+	}
+	if (cpus == 0)
+	{
+		GetSystemInfo(&info);
+		cpus = info.dwNumberOfProcessors;
 	}
 
-	do {
-		if (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-			continue;
-		if (__extIsSupported(ffd.cFileName) <= 0)
-			continue;
+	return ((cpus > 0) ? cpus : 1);
+}
 
-		/* Allocate memory for file descriptor  */
-		if (dirSize == 0) {
-			p_encArg->p_fdesc = malloc(sizeof(st_encFDesc_t));
-		} else {
-			p_encArg->p_fdesc = realloc(p_encArg->p_fdesc, (dirSize+1)*sizeof(st_encFDesc_t));
-		}
+uint32_t os_cpuList(uint32_t** pp_cpus, uint8_t smt)
+{
+	DWORD_PTR 		procMask = 0;
+	DWORD_PTR 		sysMask = 0;
+	uint32_t        cpus = 0;
 
-		/* Check result of malloc/realloc */
-		if (p_encArg->p_fdesc == NULL) {
-			fprintf(stderr, "Error : Failed to allocate memory for file descriptor\n");
-			dirSize = -1;
-			break;
-		}
-		/* We've found a file, duplicate memory*/
-		p_encArg->p_fdesc[dirSize].p_fname = strdup(ffd.cFileName);
-		p_encArg->p_fdesc[dirSize].flocked = 0;
-		/* Move pointer to a next element in array of filenames */
-		/* Increment file amount of files */
-		dirSize++;
-	}while (FindNextFile(hFind, &ffd) != 0);
+	/* Hyper-threads aren't told apart, every allowed CPU is listed */
+	*pp_cpus = NULL;
+	if (!GetProcessAffinityMask(GetCurrentProcess(), &procMask, &sysMask))
+		return (0);
 
-	if (dirSize == 0) {
-        free(p_encArg->p_fdesc);
-    }
-    p_encArg->files = dirSize;
+	*pp_cpus = malloc(sizeof(DWORD_PTR) * 8 * sizeof(uint32_t));
+	if (*pp_cpus == NULL)
+		return (0);
+
+	for (uint32_t i = 0; i < sizeof(DWORD_PTR) * 8; i++)
+	{
+		if (procMask & ((DWORD_PTR) 1 << i))
+			(*pp_cpus)[cpus++] = i;
+	}
 
-    return (dirSize);
+	return (cpus);
+}
+
+int8_t os_cpuPin(uint32_t cpu)
+{
+	return ((SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR) 1 << cpu) != 0) ? 0 : -1);
+}
+
+uint32_t os_cpuNode(void)
+{
+	UCHAR 			node = 0;
+
+	if (!GetNumaProcessorNode((UCHAR) GetCurrentProcessorNumber(), &node))
+		return (0);
+
+	return (node);
 }
 
 inline void os_mkPath(char* p_path, char* p_dirPath, char* p_fname, uint16_t lim)
@@ -249,44 +627,98 @@ inline void os_mkPath(char* p_path, char* p_dirPath, char* p_fname, uint16_t lim
     snprintf(p_path,lim,"%s\\%s",p_dirPath,p_fname);
 }
 
-inline int32_t os_read32be(FILE* p_fp)
+int8_t os_dirPath(char* p_path, const char* p_root, const st_encDir_t* p_dir,
+                  const char* p_fname, uint32_t lim)
 {
-    uint8_t data[4] = { 0, 0, 0, 0 };
-    fread_unlocked(data, 1, 4, p_fp);
-	int32_t const high = data[0];
-	int32_t const medh = data[1];
-	int32_t const medl = data[2];
-	int32_t const low = data[3];
-	return (high << 24) | (medh << 16) | (medl << 8) | low;
+    size_t      len = strlen(p_fname);
+    size_t      off = 0;
+
+    /* Length first, then the path is filled from its end */
+    if (p_root != NULL)
+        len += strlen(p_root) + 1;
+    for (const st_encDir_t* p_it = p_dir; (p_it != NULL) && (p_it->p_name != NULL);
+         p_it = p_it->p_parent)
+        len += strlen(p_it->p_name) + 1;
+    if (len >= lim)
+        return (-1);
+
+    off = len - strlen(p_fname);
+    memcpy(p_path + off, p_fname, strlen(p_fname) + 1);
+    for (const st_encDir_t* p_it = p_dir; (p_it != NULL) && (p_it->p_name != NULL);
+         p_it = p_it->p_parent)
+    {
+        p_path[--off] = '\\';
+        off -= strlen(p_it->p_name);
+        memcpy(p_path + off, p_it->p_name, strlen(p_it->p_name));
+    }
+    if (p_root != NULL)
+    {
+        p_path[--off] = '\\';
+        memcpy(p_path, p_root, off);
+    }
+
+    return (0);
 }
 
-inline int32_t os_read32le(FILE* p_fp)
+void os_outPath(char* p_to, const char* p_from)
 {
-    uint8_t data[4] = { 0, 0, 0, 0 };
-    fread_unlocked(data, 1, 4, p_fp);
-	int32_t const high = data[3];
-	int32_t const medh = data[2];
-	int32_t const medl = data[1];
-	int32_t const low = data[0];
-	return (high << 24) | (medh << 16) | (medl << 8) | low;
+    /* Extension is substituted in place */
+    strcpy(p_to, p_from);
+    __extSubstitute(p_to, p_from);
 }
 
-inline int16_t os_read16be(FILE* p_fp)
+int8_t os_fLink(const st_encDir_t* p_fromDir, const char* p_from,
+                const st_encDir_t* p_toDir, const char* p_to)
 {
-    uint8_t data[2] = { 0, 0};
-    fread_unlocked(data, 1, 2, p_fp);
-	int32_t const high = data[0];
-	int32_t const low = data[1];
-	return (high << 8) | low;
+    TCHAR       p_src[MAX_PATH];
+    TCHAR       p_dst[MAX_PATH];
+    TCHAR       p_tmp[MAX_PATH];
+    HANDLE      hFile;
+    DWORD       flags = MOVEFILE_REPLACE_EXISTING;
+    BOOL        synced = TRUE;
+
+    if ((__filePath(p_src, p_fromDir, p_from, 1) < 0) ||
+        (__filePath(p_dst, p_toDir, p_to, 1) < 0) ||
+        (snprintf(p_tmp, MAX_PATH, "%s.%lu.%lu.tmp", p_dst, GetCurrentProcessId(),
+                  GetCurrentThreadId()) >= MAX_PATH))
+        return (-1);
+
+    /* There are no reflinks, files which can't be linked are copied */
+    if (!CreateHardLink(p_tmp, p_src, NULL) && !CopyFile(p_src, p_tmp, TRUE))
+        return (-1);
+
+    /* The target is made as durable as an encoded output */
+    if (os_syncMode != en_sync_none)
+    {
+        hFile = CreateFile(p_tmp, GENERIC_WRITE, 0, NULL, OPEN_EXISTING,
+                            FILE_ATTRIBUTE_NORMAL, NULL);
+        synced = (hFile != INVALID_HANDLE_VALUE) && FlushFileBuffers(hFile);
+        if (hFile != INVALID_HANDLE_VALUE)
+            CloseHandle(hFile);
+        flags |= MOVEFILE_WRITE_THROUGH;
+    }
+
+    if (!synced || !MoveFileEx(p_tmp, p_dst, flags))
+    {
+        DeleteFile(p_tmp);
+        return (-1);
+    }
+
+    return (0);
 }
 
-inline int16_t os_read16le(FILE* p_fp)
+int8_t os_mkDir(const char* p_path)
 {
-    uint8_t data[2] = { 0, 0 };
-    fread_unlocked(data, 1, 2, p_fp);
-    int32_t const high = data[1];
-    int32_t const low = data[0];
-    return (high << 8) | low;
+    DWORD       attr;
+
+    if (!CreateDirectory(p_path, NULL))
+    {
+        attr = GetFileAttributes(p_path);
+        if ((attr == INVALID_FILE_ATTRIBUTES) || !(attr & FILE_ATTRIBUTE_DIRECTORY))
+            return (-1);
+    }
+
+    return (0);
 }
 
 inline uint32_t os_fread_unlocked(void* p_buf, size_t size, size_t cnt, FILE* p_fp)
@@ -299,115 +731,139 @@ inline void os_fwrite_unlocked(void* p_buf, size_t size, size_t cnt, FILE* p_fp)
 	fwrite_unlocked(p_buf, size, cnt, p_fp);
 }
 
+inline uint32_t os_fRead(st_encoder_t* p_enc, uint8_t** pp_buf, size_t size, size_t cnt)
+{
+    return (fread_unlocked(*pp_buf, size, cnt, p_enc->p_fp));
+}
+
+inline void os_fWrite(st_encoder_t* p_enc, uint8_t* p_buf, size_t len)
+{
+    fwrite_unlocked(p_buf, 1, len, p_enc->p_fp);
+}
+
 inline void os_fclose(st_encoder_t* p_enc)
 {
+	TCHAR   p_tmp[MAX_PATH];
+
 	if (p_enc->opened)
 		fclose( p_enc->p_fp);
+	/* Output which wasn't committed is dropped, the old one stays */
+	if (p_enc->temp) {
+		if (__tempPath(p_tmp, p_enc) == 0)
+			DeleteFile(p_tmp);
+		p_enc->temp = 0;
+	}
+	free(p_enc->p_wbuf);
+	p_enc->p_wbuf = NULL;
 }
 
 
+void os_splitFlopInit(void)
+{
+    /* Only plain C converters are available on this platform */
+}
+
 inline void os_splitFlopUI8(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff)
 {
-    int     i = 0;
-    uint8_t off = sizeof(uint8_t);
+    uint32_t i = 0;
 
-    while (1)
+    if (toSec == NULL)
     {
-        if (((i + off) < toMaxOff) && (toFir != NULL))
-        {
-            *toFir = (from[i] ^ 0x80) << 24;
-            toFir++;
-            i += off;
-        }
-
-        if (((i + off) < toMaxOff) && (toSec != NULL))
+        for (i = 0; i < toMaxOff; i++)
+            toFir[i] = (from[i] ^ 0x80) << 24;
+    }
+    else
+    {
+        for (i = 0; (i + 2) <= toMaxOff; i += 2)
         {
-            *toSec = (from[i] ^ 0x80) << 24;
-            toSec++;
-            i += off;
+            *toFir++ = (from[i] ^ 0x80) << 24;
+            *toSec++ = (from[i + 1] ^ 0x80) << 24;
         }
-
-        if ((i + off) == toMaxOff)
-            break;
     }
 }
 
 inline void os_splitFlopI16(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff)
 {
-    int     i = 0;
-    uint8_t off = sizeof(int16_t);
+    uint32_t i = 0;
 
-    while (1)
+    if (toSec == NULL)
     {
-        if (((i + off) < toMaxOff) && (toFir != NULL))
-        {
-            *toFir = from[i + 1] << 24 | from[i] << 16;
-            toFir++;
-            i += off;
-        }
-
-        if (((i + off) < toMaxOff) && (toSec != NULL))
+        for (i = 0; (i + 2) <= toMaxOff; i += 2)
+            *toFir++ = from[i + 1] << 24 | from[i] << 16;
+    }
+    else
+    {
+        for (i = 0; (i + 4) <= toMaxOff; i += 4)
         {
-            *toSec = from[i + 1] << 24 | from[i] << 16;
-            toSec++;
-            i += off;
+            *toFir++ = from[i + 1] << 24 | from[i] << 16;
+            *toSec++ = from[i + 3] << 24 | from[i + 2] << 16;
         }
-
-        if ((i + off) == toMaxOff)
-            break;
     }
 }
 
 inline void os_splitFlopI24(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff)
 {
-    int     i = 0;
-    uint8_t off = 3;
+    uint32_t i = 0;
 
-    while (1)
+    if (toSec == NULL)
     {
-        if (((i + off) < toMaxOff) && (toFir != NULL))
-        {
-            *toFir = from[i + 2] << 24 | from[i + 1] << 16 | from[i] << 8;
-            toFir++;
-            i += off;
-        }
-
-        if (((i + off) < toMaxOff) && (toSec != NULL))
+        for (i = 0; (i + 3) <= toMaxOff; i += 3)
+            *toFir++ = from[i + 2] << 24 | from[i + 1] << 16 | from[i] << 8;
+    }
+    else
+    {
+        for (i = 0; (i + 6) <= toMaxOff; i += 6)
         {
-            *toSec = from[i + 2] << 24 | from[i + 1] << 16 | from[i] << 8;
-            toSec++;
-            i += off;
+            *toFir++ = from[i + 2] << 24 | from[i + 1] << 16 | from[i] << 8;
+            *toSec++ = from[i + 5] << 24 | from[i + 4] << 16 | from[i + 3] << 8;
         }
-
-        if ((i + off) == toMaxOff)
-            break;
     }
 }
 
 inline void os_splitFlopI32(uint8_t* from, int32_t* toFir, int32_t* toSec, uint32_t toMaxOff)
 {
-    int     i = 0;
-    uint8_t off = sizeof(int32_t);
+    uint32_t i = 0;
 
-    while (1)
+    if (toSec == NULL)
+    {
+        for (i = 0; (i + 4) <= toMaxOff; i += 4)
+            *toFir++ = from[i + 3] << 24 | from[i + 2] << 16 | from[i + 1] << 8 | from[i];
+    }
+    else
     {
-        if (((i + off) < toMaxOff) && (toFir != NULL))
+        for (i = 0; (i + 8) <= toMaxOff; i += 8)
         {
-            *toFir = from[i + 3] << 24 | from[i + 2] << 16 | from[i + 1] << 8 | from[i];
-            toFir++;
-            i += off;
+            *toFir++ = from[i + 3] << 24 | from[i + 2] << 16 | from[i + 1] << 8 | from[i];
+            *toSec++ = from[i + 7] << 24 | from[i + 6] << 16 | from[i + 5] << 8 | from[i + 4];
         }
+    }
+}
 
-        if (((i + off) < toMaxOff) && (toSec != NULL))
-        {
-            *toSec = from[i + 3] << 24 | from[i + 2] << 16 | from[i + 1] << 8 | from[i];
-            toSec++;
-            i += off;
-        }
+OS_SPLIT_SPECIALIZE(UI8)
+OS_SPLIT_SPECIALIZE(I16)
+OS_SPLIT_SPECIALIZE(I24)
+OS_SPLIT_SPECIALIZE(I32)
 
-        if ((i + off) == toMaxOff)
-            break;
-    }
+os_splitFlop_t os_splitFlopGet(uint8_t bps, uint8_t channels)
+{
+    static const os_splitFlop_t split[4][2] =
+    {
+        { __splitUI8Mono, __splitUI8Stereo },
+        { __splitI16Mono, __splitI16Stereo },
+        { __splitI24Mono, __splitI24Stereo },
+        { __splitI32Mono, __splitI32Stereo }
+    };
+
+    if ((bps < 1) || (bps > 4) || (channels < 1) || (channels > 2))
+        return (NULL);
+
+    return (split[bps - 1][channels - 1]);
+}
+
+os_splitFlop_t os_splitFlopImpl(en_osSplit_t impl, uint8_t bps, uint8_t channels)
+{
+    /* Only plain C converters are available on this platform */
+    return ((impl == en_split_scalar) ? os_splitFlopGet(bps, channels) : NULL);
 }
 
 inline uint8_t os_flop_ui8i32(uint8_t* from, int32_t* to, uint32_t toOff, uint32_t toMaxOff)
@@ -0,0 +1,557 @@
+/*
+ * --- Module Description --------------------------------------------------- *
+ */
+/**
+ * \file    pool.c
+ * \author  Artem Yushev
+ * \date    $Date$
+ * \version $Version$
+ *
+ * \brief   Work-stealing pool of worker threads
+ */
+
+
+/*
+ * --- Includes ------------------------------------------------------------- *
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "encoder.h"
+#include "os.h"
+#include "pool.h"
+
+/*
+ * --- Macro Definitions ---------------------------------------------------- *
+ */
+/* Initial capacity of a deque, it grows twice when full */
+#define   POOL_DEQUE_INIT               64
+/* Tasks from outside are claimed in batches of up to POOL_CLAIM_MAX,
+ * the batch shrinks with the queue to leave POOL_CLAIM_RATIO batches
+ * per worker and keep the tail balanced */
+#define   POOL_CLAIM_MAX                16
+#define   POOL_CLAIM_RATIO              4
+
+
+/*
+ * --- Type Definitions ----------------------------------------------------- *
+ */
+
+typedef struct st_poolTask
+{
+    pool_fn_t       p_fn;
+    void*           p_ctx;
+    uint32_t        idx;
+} st_poolTask_t;
+
+/* Growable ring of tasks, the owner works at the bottom,
+ * thieves take from the top */
+typedef struct st_poolDeque
+{
+    st_poolTask_t*  p_tasks;
+    uint32_t        cap;
+    /* Positions grow monotonically and wrap around the capacity */
+    uint32_t        top;
+    uint32_t        bottom;
+    pthread_mutex_t lock;
+} st_poolDeque_t;
+
+typedef struct st_poolWorker
+{
+    st_pool_t*      p_pool;
+    pthread_t       thread;
+    uint32_t        id;
+    /* State of the random generator to choose victims */
+    uint32_t        seed;
+    /* CPU to pin the thread to, or -1 to let it float */
+    int32_t         cpu;
+    /* Thread was started and has to be joined */
+    uint8_t         running;
+    st_poolDeque_t  deque;
+    /* Tasks claimed from outside and not started yet, taken in order */
+    st_poolTask_t   batch[POOL_CLAIM_MAX];
+    uint32_t        batchPos;
+    uint32_t        batchLen;
+} st_poolWorker_t;
+
+struct st_pool
+{
+    st_poolWorker_t* p_workers;
+    uint32_t        workers;
+    /* Tasks submitted from outside, served in order of submission */
+    st_poolDeque_t  inject;
+    /* Tasks waiting in any queue, claimed batches don't count */
+    _Atomic int32_t queued;
+    /* Workers waiting for work, a push takes the lock only if there are */
+    _Atomic int32_t sleepers;
+    /* Tasks submitted and not finished yet */
+    _Atomic int32_t pending;
+    uint8_t         stop;
+    pthread_mutex_t lock;
+    /* Signalled when a task is queued and when the last one is finished */
+    pthread_cond_t  work;
+    pthread_cond_t  idle;
+    pool_hook_t     p_enter;
+    pool_hook_t     p_leave;
+};
+
+/*
+ * --- Variables ------------------------------------------------------------ *
+ */
+/* Worker description of the current thread, NULL outside the pool */
+static _Thread_local st_poolWorker_t* pool_worker = NULL;
+
+/*
+ * --- Local Functions Declaration ------------------------------------------ *
+ */
+
+/**
+ * \brief     Initialize and free a deque
+ *
+ * \param     p_deque       Deque
+ * \return    Negative for failure, otherwise OK
+ */
+static int8_t __dequeInit(st_poolDeque_t* p_deque);
+static void __dequeFree(st_poolDeque_t* p_deque);
+
+/**
+ * \brief     Put a task at the bottom of a deque
+ *
+ * \param     p_deque       Deque
+ * \param     p_task        Task to copy
+ * \return    Negative for failure, otherwise OK
+ */
+static int8_t __dequePush(st_poolDeque_t* p_deque, const st_poolTask_t* p_task);
+
+/**
+ * \brief     Take a task from the bottom (newest) or the top (oldest)
+ *
+ * \param     p_deque       Deque
+ * \param     p_task        Where to copy the task
+ * \return    Negative if the deque is empty, otherwise OK
+ */
+static int8_t __dequePop(st_poolDeque_t* p_deque, st_poolTask_t* p_task);
+static int8_t __dequeTake(st_poolDeque_t* p_deque, st_poolTask_t* p_task);
+
+/**
+ * \brief     Take a batch of the oldest tasks from the top of a deque, its
+ *            size depends on how many tasks are left per worker
+ *
+ * \param     p_deque       Deque
+ * \param     p_tasks       Where to copy up to POOL_CLAIM_MAX tasks
+ * \param     workers       Amount of workers sharing the deque
+ * \return    Amount of tasks taken, 0 if the deque is empty
+ */
+static uint32_t __dequeClaim(st_poolDeque_t* p_deque, st_poolTask_t* p_tasks,
+                             uint32_t workers);
+
+/**
+ * \brief     Find a task for a worker: own deque first, then the claimed
+ *            batch, then a new batch of tasks from outside, then steal from
+ *            other workers starting at a random one
+ *
+ * \param     p_self        Worker
+ * \param     p_task        Where to copy the task
+ * \return    Negative if nothing was found, otherwise OK
+ */
+static int8_t __poolFind(st_poolWorker_t* p_self, st_poolTask_t* p_task);
+
+/**
+ * \brief     Queue a task and wake up a worker if any is waiting
+ *
+ * \param     p_pool        Pool
+ * \param     p_deque       Deque to put the task in
+ * \param     p_task        Task to copy
+ * \return    Negative for failure, otherwise OK
+ */
+static int8_t __poolPush(st_pool_t* p_pool, st_poolDeque_t* p_deque,
+                         const st_poolTask_t* p_task);
+
+/**
+ * \brief     Worker thread
+ *
+ * \param     p_arg         Worker description
+ * \return    NULL
+ */
+static void* __poolWorker(void* p_arg);
+
+/*
+ * --- Local Functions Definition ------------------------------------------- *
+ */
+static int8_t __dequeInit(st_poolDeque_t* p_deque)
+{
+    memset(p_deque, 0, sizeof(st_poolDeque_t));
+    pthread_mutex_init(&p_deque->lock, NULL);
+
+    p_deque->p_tasks = malloc(POOL_DEQUE_INIT * sizeof(st_poolTask_t));
+    if (p_deque->p_tasks == NULL)
+        return (-1);
+    p_deque->cap = POOL_DEQUE_INIT;
+
+    return (0);
+}
+
+static void __dequeFree(st_poolDeque_t* p_deque)
+{
+    free(p_deque->p_tasks);
+    p_deque->p_tasks = NULL;
+    pthread_mutex_destroy(&p_deque->lock);
+}
+
+static int8_t __dequePush(st_poolDeque_t* p_deque, const st_poolTask_t* p_task)
+{
+    st_poolTask_t*  p_tasks = NULL;
+    uint32_t        cap = 0;
+    int8_t          err = 0;
+
+    pthread_mutex_lock(&p_deque->lock);
+    if ((p_deque->bottom - p_deque->top) == p_deque->cap)
+    {
+        /* Keep tasks at the same positions modulo the new capacity */
+        cap = p_deque->cap * 2;
+        p_tasks = malloc(cap * sizeof(st_poolTask_t));
+        if (p_tasks != NULL)
+        {
+            for (uint32_t i = p_deque->top; i != p_deque->bottom; i++)
+                p_tasks[i % cap] = p_deque->p_tasks[i % p_deque->cap];
+            free(p_deque->p_tasks);
+            p_deque->p_tasks = p_tasks;
+            p_deque->cap = cap;
+        }
+        else
+        {
+            err = -1;
+        }
+    }
+    if (err == 0)
+    {
+        p_deque->p_tasks[p_deque->bottom % p_deque->cap] = *p_task;
+        p_deque->bottom++;
+    }
+    pthread_mutex_unlock(&p_deque->lock);
+
+    return (err);
+}
+
+static int8_t __dequePop(st_poolDeque_t* p_deque, st_poolTask_t* p_task)
+{
+    int8_t  err = -1;
+
+    pthread_mutex_lock(&p_deque->lock);
+    if (p_deque->bottom != p_deque->top)
+    {
+        p_deque->bottom--;
+        *p_task = p_deque->p_tasks[p_deque->bottom % p_deque->cap];
+        err = 0;
+    }
+    pthread_mutex_unlock(&p_deque->lock);
+
+    return (err);
+}
+
+static int8_t __dequeTake(st_poolDeque_t* p_deque, st_poolTask_t* p_task)
+{
+    int8_t  err = -1;
+
+    pthread_mutex_lock(&p_deque->lock);
+    if (p_deque->bottom != p_deque->top)
+    {
+        *p_task = p_deque->p_tasks[p_deque->top % p_deque->cap];
+        p_deque->top++;
+        err = 0;
+    }
+    pthread_mutex_unlock(&p_deque->lock);
+
+    return (err);
+}
+
+static uint32_t __dequeClaim(st_poolDeque_t* p_deque, st_poolTask_t* p_tasks,
+                             uint32_t workers)
+{
+    uint32_t    len = 0;
+
+    pthread_mutex_lock(&p_deque->lock);
+    len = (p_deque->bottom - p_deque->top) / (workers * POOL_CLAIM_RATIO);
+    if (len > POOL_CLAIM_MAX)
+        len = POOL_CLAIM_MAX;
+    if (len == 0)
+        len = (p_deque->bottom != p_deque->top) ? 1 : 0;
+    for (uint32_t i = 0; i < len; i++)
+        p_tasks[i] = p_deque->p_tasks[(p_deque->top + i) % p_deque->cap];
+    p_deque->top += len;
+    pthread_mutex_unlock(&p_deque->lock);
+
+    return (len);
+}
+
+static int8_t __poolFind(st_poolWorker_t* p_self, st_poolTask_t* p_task)
+{
+    st_pool_t*  p_pool = p_self->p_pool;
+    uint32_t    victim = 0;
+    uint32_t    len = 0;
+    int8_t      err = -1;
+
+    /* Tasks spawned by this worker go before the rest of its batch */
+    if ((atomic_load_explicit(&p_pool->queued, memory_order_acquire) > 0) &&
+        (__dequePop(&p_self->deque, p_task) == 0))
+    {
+        atomic_fetch_sub_explicit(&p_pool->queued, 1, memory_order_relaxed);
+        return (0);
+    }
+
+    if (p_self->batchPos != p_self->batchLen)
+    {
+        *p_task = p_self->batch[p_self->batchPos++];
+        return (0);
+    }
+
+    if (atomic_load_explicit(&p_pool->queued, memory_order_acquire) <= 0)
+        return (-1);
+
+    /* A claimed batch leaves the queue at once, so that idle workers
+     * don't spin on tasks they can't take */
+    len = __dequeClaim(&p_pool->inject, p_self->batch, p_pool->workers);
+    if (len > 0)
+    {
+        atomic_fetch_sub_explicit(&p_pool->queued, len, memory_order_relaxed);
+        *p_task = p_self->batch[0];
+        p_self->batchPos = 1;
+        p_self->batchLen = len;
+        return (0);
+    }
+
+    if (p_pool->workers > 1)
+    {
+        /* xorshift32, a random start spreads thieves among victims */
+        p_self->seed ^= p_self->seed << 13;
+        p_self->seed ^= p_self->seed >> 17;
+        p_self->seed ^= p_self->seed << 5;
+        victim = p_self->seed % p_pool->workers;
+
+        for (uint32_t i = 0; (i < p_pool->workers) && (err < 0); i++)
+        {
+            if (((victim + i) % p_pool->workers) == p_self->id)
+                continue;
+            err = __dequeTake(&p_pool->p_workers[(victim + i) % p_pool->workers].deque,
+                              p_task);
+        }
+    }
+
+    if (err == 0)
+        atomic_fetch_sub_explicit(&p_pool->queued, 1, memory_order_relaxed);
+
+    return (err);
+}
+
+static int8_t __poolPush(st_pool_t* p_pool, st_poolDeque_t* p_deque,
+                         const st_poolTask_t* p_task)
+{
+    atomic_fetch_add_explicit(&p_pool->pending, 1, memory_order_relaxed);
+    if (__dequePush(p_deque, p_task) < 0)
+    {
+        atomic_fetch_sub_explicit(&p_pool->pending, 1, memory_order_relaxed);
+        return (-1);
+    }
+    /* Both the count and the check are sequentially consistent against
+     * the ones of a worker going to sleep, so either the worker sees the
+     * task or this sees the worker */
+    atomic_fetch_add(&p_pool->queued, 1);
+    if (atomic_load(&p_pool->sleepers) > 0)
+    {
+        pthread_mutex_lock(&p_pool->lock);
+        pthread_cond_signal(&p_pool->work);
+        pthread_mutex_unlock(&p_pool->lock);
+    }
+
+    return (0);
+}
+
+static void* __poolWorker(void* p_arg)
+{
+    st_poolWorker_t*    p_self = (st_poolWorker_t*) p_arg;
+    st_pool_t*          p_pool = p_self->p_pool;
+    st_poolTask_t       task;
+
+    /* Pin before anything is allocated, so that the memory of the
+     * worker is placed on its local NUMA node by the first touch */
+    if ((p_self->cpu >= 0) && (os_cpuPin(p_self->cpu) < 0))
+        fprintf(stderr, "Failed to pin worker %lu to CPU %lu\n", p_self->id, p_self->cpu);
+
+    pool_worker = p_self;
+    if (p_pool->p_enter != NULL)
+        p_pool->p_enter(p_self->id);
+
+    while (1)
+    {
+        if (__poolFind(p_self, &task) == 0)
+        {
+            task.p_fn(task.p_ctx, task.idx);
+            if (atomic_fetch_sub_explicit(&p_pool->pending, 1, memory_order_acq_rel) == 1)
+            {
+                pthread_mutex_lock(&p_pool->lock);
+                pthread_cond_broadcast(&p_pool->idle);
+                pthread_mutex_unlock(&p_pool->lock);
+            }
+            continue;
+        }
+
+        /* The worker is counted as a sleeper before it checks the queue,
+         * and a push signals under the lock, so a wakeup can't be missed */
+        pthread_mutex_lock(&p_pool->lock);
+        atomic_fetch_add(&p_pool->sleepers, 1);
+        while (!p_pool->stop && (atomic_load(&p_pool->queued) <= 0))
+            pthread_cond_wait(&p_pool->work, &p_pool->lock);
+        atomic_fetch_sub_explicit(&p_pool->sleepers, 1, memory_order_relaxed);
+        if (p_pool->stop &&
+            (atomic_load_explicit(&p_pool->queued, memory_order_acquire) <= 0))
+        {
+            pthread_mutex_unlock(&p_pool->lock);
+            break;
+        }
+        pthread_mutex_unlock(&p_pool->lock);
+    }
+
+    if (p_pool->p_leave != NULL)
+        p_pool->p_leave(p_self->id);
+    pool_worker = NULL;
+
+    return (NULL);
+}
+
+/*
+ * --- Global Functions Definition ------------------------------------------ *
+ */
+
+st_pool_t* pool_create(uint32_t workers, const uint32_t* p_cpus, uint32_t cpus,
+                       pool_hook_t p_enter, pool_hook_t p_leave)
+{
+    st_pool_t*  p_pool = NULL;
+    uint32_t    started = 0;
+
+    if (workers == 0)
+        return (NULL);
+
+    p_pool = calloc(1, sizeof(st_pool_t));
+    if (p_pool == NULL)
+        return (NULL);
+
+    p_pool->p_workers = calloc(workers, sizeof(st_poolWorker_t));
+    if ((p_pool->p_workers == NULL) || (__dequeInit(&p_pool->inject) < 0))
+    {
+        free(p_pool->p_workers);
+        free(p_pool);
+        return (NULL);
+    }
+    pthread_mutex_init(&p_pool->lock, NULL);
+    pthread_cond_init(&p_pool->work, NULL);
+    pthread_cond_init(&p_pool->idle, NULL);
+    p_pool->p_enter = p_enter;
+    p_pool->p_leave = p_leave;
+
+    /* Deques have to exist before any worker may steal from them */
+    for (uint32_t i = 0; i < workers; i++)
+    {
+        p_pool->p_workers[i].p_pool = p_pool;
+        p_pool->p_workers[i].id = i;
+        p_pool->p_workers[i].seed = (i + 1) * 2654435761u;
+        p_pool->p_workers[i].cpu = ((p_cpus != NULL) && (cpus > 0)) ?
+                                   (int32_t) p_cpus[i % cpus] : -1;
+        if (__dequeInit(&p_pool->p_workers[i].deque) < 0)
+            break;
+        p_pool->workers++;
+    }
+
+    for (uint32_t i = 0; i < p_pool->workers; i++)
+    {
+        if (pthread_create(&p_pool->p_workers[i].thread, NULL, __poolWorker,
+                           &p_pool->p_workers[i]) != 0)
+        {
+            fprintf(stderr, " Error in pthread_create(), worker %lu\n", i);
+            continue;
+        }
+        p_pool->p_workers[i].running = 1;
+        started++;
+    }
+
+    /* Deques of workers which didn't start just stay empty */
+    if (started == 0)
+    {
+        pool_destroy(p_pool);
+        return (NULL);
+    }
+
+    return (p_pool);
+}
+
+int8_t pool_submit(st_pool_t* p_pool, pool_fn_t p_fn, void* p_ctx, uint32_t idx)
+{
+    assert(p_pool != NULL);
+    assert(p_fn != NULL);
+
+    st_poolTask_t   task = { .p_fn = p_fn, .p_ctx = p_ctx, .idx = idx };
+    st_poolDeque_t* p_deque = &p_pool->inject;
+
+    if ((pool_worker != NULL) && (pool_worker->p_pool == p_pool))
+        p_deque = &pool_worker->deque;
+
+    return (__poolPush(p_pool, p_deque, &task));
+}
+
+int8_t pool_inject(st_pool_t* p_pool, pool_fn_t p_fn, void* p_ctx, uint32_t idx)
+{
+    assert(p_pool != NULL);
+    assert(p_fn != NULL);
+
+    st_poolTask_t   task = { .p_fn = p_fn, .p_ctx = p_ctx, .idx = idx };
+
+    return (__poolPush(p_pool, &p_pool->inject, &task));
+}
+
+void pool_wait(st_pool_t* p_pool)
+{
+    assert(p_pool != NULL);
+
+    pthread_mutex_lock(&p_pool->lock);
+    while (atomic_load_explicit(&p_pool->pending, memory_order_acquire) > 0)
+        pthread_cond_wait(&p_pool->idle, &p_pool->lock);
+    pthread_mutex_unlock(&p_pool->lock);
+}
+
+void pool_destroy(st_pool_t* p_pool)
+{
+    if (p_pool == NULL)
+        return;
+
+    pthread_mutex_lock(&p_pool->lock);
+    p_pool->stop = 1;
+    pthread_cond_broadcast(&p_pool->work);
+    pthread_mutex_unlock(&p_pool->lock);
+
+    for (uint32_t i = 0; i < p_pool->workers; i++)
+    {
+        if (p_pool->p_workers[i].running)
+            pthread_join(p_pool->p_workers[i].thread, NULL);
+        __dequeFree(&p_pool->p_workers[i].deque);
+    }
+
+    __dequeFree(&p_pool->inject);
+    pthread_mutex_destroy(&p_pool->lock);
+    pthread_cond_destroy(&p_pool->work);
+    pthread_cond_destroy(&p_pool->idle);
+    free(p_pool->p_workers);
+    free(p_pool);
+}
+
+st_pool_t* pool_self(void)
+{
+    return ((pool_worker != NULL) ? pool_worker->p_pool : NULL);
+}
+
+uint32_t pool_workers(st_pool_t* p_pool)
+{
+    return ((p_pool != NULL) ? p_pool->workers : 0);
+}
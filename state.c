@@ -0,0 +1,312 @@
+/*
+ * --- Module Description --------------------------------------------------- *
+ */
+/**
+ * \file    state.c
+ * \author  Artem Yushev
+ * \date    $Date$
+ * \version $Version$
+ *
+ * \brief   State of previous runs for the incremental mode
+ */
+
+
+/*
+ * --- Includes ------------------------------------------------------------- *
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <string.h>
+#include "encoder.h"
+#include "os.h"
+#include "state.h"
+
+/*
+ * --- Macro Definitions ---------------------------------------------------- *
+ */
+/* State is kept next to the input files, it's skipped by the scan
+ * as its extension isn't supported */
+#define   STATE_FILE                    ".encoder.state"
+#define   STATE_TEMP                    ".encoder.state.tmp"
+/* Bump if the output for the same settings changes */
+#define   STATE_VERSION                 1
+/* Initial capacity of the records, it grows twice when full */
+#define   STATE_INIT                    64
+/* Files are opened relative to their directory, so their paths aren't
+ * bound by MAX_FILEPATH, only the records are */
+#define   STATE_PATH                    4096
+
+
+/*
+ * --- Type Definitions ----------------------------------------------------- *
+ */
+
+typedef struct st_stateRec
+{
+    char*           p_fname;
+    uint64_t        fsize;
+    int64_t         mtime;
+    /* Record is written on save */
+    uint8_t         keep;
+} st_stateRec_t;
+
+struct st_state
+{
+    char            p_path[MAX_FILEPATH];
+    char            p_temp[MAX_FILEPATH];
+    /* Settings of this run which affect the output */
+    uint64_t        key;
+    /* Records sorted by name up to sorted, updates are appended */
+    st_stateRec_t*  p_recs;
+    uint32_t        recs;
+    uint32_t        sorted;
+    uint32_t        cap;
+};
+
+/**
+ * \brief     Compare records by filename
+ */
+static int __recCmp(const void* p_a, const void* p_b);
+
+/**
+ * \brief     Find a record of a file among the loaded ones
+ *
+ * \param     p_state       State
+ * \param     p_fname       Filename
+ * \return    Record, NULL if there is none
+ */
+static st_stateRec_t* __recFind(st_state_t* p_state, const char* p_fname);
+
+/**
+ * \brief     Append a record
+ *
+ * \param     p_state       State
+ * \param     p_fname       Filename, copied
+ * \param     fsize         Size of the file
+ * \param     mtime         Modification time of the file
+ * \return    Record, NULL for failure
+ */
+static st_stateRec_t* __recAdd(st_state_t* p_state, const char* p_fname,
+                               uint64_t fsize, int64_t mtime);
+
+/*
+ * --- Local Functions Definition ------------------------------------------- *
+ */
+static int __recCmp(const void* p_a, const void* p_b)
+{
+    const st_stateRec_t* p_ra = (const st_stateRec_t*) p_a;
+    const st_stateRec_t* p_rb = (const st_stateRec_t*) p_b;
+
+    return (strcmp(p_ra->p_fname, p_rb->p_fname));
+}
+
+static st_stateRec_t* __recFind(st_state_t* p_state, const char* p_fname)
+{
+    st_stateRec_t   rec = { .p_fname = (char*) p_fname };
+
+    if (p_state->sorted == 0)
+        return (NULL);
+
+    return (bsearch(&rec, p_state->p_recs, p_state->sorted,
+                    sizeof(st_stateRec_t), __recCmp));
+}
+
+static st_stateRec_t* __recAdd(st_state_t* p_state, const char* p_fname,
+                               uint64_t fsize, int64_t mtime)
+{
+    st_stateRec_t*  p_recs = NULL;
+    st_stateRec_t*  p_rec = NULL;
+    uint32_t        cap = 0;
+
+    if (p_state->recs == p_state->cap)
+    {
+        cap = p_state->cap ? p_state->cap * 2 : STATE_INIT;
+        p_recs = realloc(p_state->p_recs, cap * sizeof(st_stateRec_t));
+        if (p_recs == NULL)
+            return (NULL);
+        p_state->p_recs = p_recs;
+        p_state->cap = cap;
+    }
+
+    p_rec = &p_state->p_recs[p_state->recs];
+    p_rec->p_fname = strdup(p_fname);
+    if (p_rec->p_fname == NULL)
+        return (NULL);
+    p_rec->fsize = fsize;
+    p_rec->mtime = mtime;
+    p_rec->keep = 0;
+    p_state->recs++;
+
+    return (p_rec);
+}
+
+/*
+ * --- Global Functions Definition ------------------------------------------ *
+ */
+st_state_t* state_load(const char* p_dir, const st_encOpts_t* p_opts)
+{
+    assert(p_dir != NULL);
+    assert(p_opts != NULL);
+
+    st_state_t*     p_state = NULL;
+    FILE*           p_fp = NULL;
+    char            p_line[STATE_PATH + 64];
+    uint64_t        key = 0;
+    uint64_t        fsize = 0;
+    int64_t         mtime = 0;
+    int             off = 0;
+    size_t          len = 0;
+
+    /* The separator and the longer name have to fit */
+    if ((strlen(p_dir) + sizeof(STATE_TEMP) + 1) > MAX_FILEPATH)
+    {
+        fprintf(stderr, "State directory path is too long.\n");
+        return (NULL);
+    }
+
+    p_state = calloc(1, sizeof(st_state_t));
+    if (p_state == NULL)
+        return (NULL);
+
+    os_mkPath(p_state->p_path, (char*) p_dir, STATE_FILE, MAX_FILEPATH);
+    os_mkPath(p_state->p_temp, (char*) p_dir, STATE_TEMP, MAX_FILEPATH);
+    /* Segments are cut at frame boundaries with the bit reservoir off,
+     * so the output depends on the segment length */
+    p_state->key = ((uint64_t) STATE_VERSION << 32) | p_opts->segLength;
+
+    p_fp = fopen(p_state->p_path, "r");
+    if (p_fp == NULL)
+        return (p_state);
+
+    if ((fgets(p_line, sizeof(p_line), p_fp) != NULL) &&
+        (sscanf(p_line, "encoder-state %" SCNu64, &key) == 1) &&
+        (key == p_state->key))
+    {
+        /* size mtime name, the name is the rest of the line */
+        while (fgets(p_line, sizeof(p_line), p_fp) != NULL)
+        {
+            len = strlen(p_line);
+            if ((len == 0) || (p_line[len - 1] != '\n'))
+                break;
+            p_line[len - 1] = '\0';
+            if ((sscanf(p_line, "%" SCNu64 " %" SCNd64 "%n", &fsize, &mtime, &off) != 2) ||
+                (p_line[off] != ' '))
+                break;
+            if (__recAdd(p_state, p_line + off + 1, fsize, mtime) == NULL)
+                break;
+        }
+    }
+    fclose(p_fp);
+
+    qsort(p_state->p_recs, p_state->recs, sizeof(st_stateRec_t), __recCmp);
+    p_state->sorted = p_state->recs;
+
+    return (p_state);
+}
+
+uint8_t state_fresh(st_state_t* p_state, const st_encFDesc_t* p_fdesc)
+{
+    assert(p_state != NULL);
+    assert(p_fdesc != NULL);
+
+    st_stateRec_t*  p_rec = NULL;
+    char            p_rel[STATE_PATH];
+
+    /* Files of subdirectories are recorded relative to the root */
+    if (os_dirPath(p_rel, NULL, p_fdesc->p_dir, p_fdesc->p_fname, STATE_PATH) < 0)
+        return (0);
+
+    p_rec = __recFind(p_state, p_rel);
+    if ((p_rec == NULL) || (p_rec->fsize != p_fdesc->fsize) ||
+        (p_rec->mtime != p_fdesc->mtime))
+        return (0);
+
+    p_rec->keep = 1;
+    return (1);
+}
+
+int8_t state_update(st_state_t* p_state, const st_encFDesc_t* p_fdesc)
+{
+    assert(p_state != NULL);
+    assert(p_fdesc != NULL);
+
+    st_stateRec_t*  p_rec = NULL;
+    char            p_rel[STATE_PATH];
+
+    /* Names are stored one per line */
+    if ((os_dirPath(p_rel, NULL, p_fdesc->p_dir, p_fdesc->p_fname, STATE_PATH) < 0) ||
+        (strchr(p_rel, '\n') != NULL))
+        return (-1);
+
+    p_rec = __recFind(p_state, p_rel);
+    if (p_rec == NULL)
+        p_rec = __recAdd(p_state, p_rel, p_fdesc->fsize, p_fdesc->mtime);
+    if (p_rec == NULL)
+        return (-1);
+
+    p_rec->fsize = p_fdesc->fsize;
+    p_rec->mtime = p_fdesc->mtime;
+    p_rec->keep = 1;
+
+    return (0);
+}
+
+int8_t state_save(st_state_t* p_state)
+{
+    assert(p_state != NULL);
+
+    FILE*           p_fp = NULL;
+    int8_t          err = 0;
+
+    p_fp = fopen(p_state->p_temp, "w");
+    if (p_fp == NULL)
+    {
+        fprintf(stderr, "Failed to write the state file.\n");
+        return (-1);
+    }
+
+    if (fprintf(p_fp, "encoder-state %" PRIu64 "\n", p_state->key) < 0)
+        err = -1;
+    for (uint32_t i = 0; (i < p_state->recs) && (err == 0); i++)
+    {
+        if (!p_state->p_recs[i].keep)
+            continue;
+        if (fprintf(p_fp, "%" PRIu64 " %" PRId64 " %s\n", p_state->p_recs[i].fsize,
+                    p_state->p_recs[i].mtime, p_state->p_recs[i].p_fname) < 0)
+            err = -1;
+    }
+    if (fclose(p_fp) != 0)
+        err = -1;
+
+    /* The old state stays in place until the new one is complete */
+    if (err == 0)
+    {
+        if (rename(p_state->p_temp, p_state->p_path) != 0)
+        {
+            remove(p_state->p_path);
+            if (rename(p_state->p_temp, p_state->p_path) != 0)
+                err = -1;
+        }
+    }
+    if (err < 0)
+    {
+        remove(p_state->p_temp);
+        fprintf(stderr, "Failed to write the state file.\n");
+    }
+
+    return (err);
+}
+
+void state_free(st_state_t* p_state)
+{
+    if (p_state == NULL)
+        return;
+
+    for (uint32_t i = 0; i < p_state->recs; i++)
+        free(p_state->p_recs[i].p_fname);
+    free(p_state->p_recs);
+    free(p_state);
+}
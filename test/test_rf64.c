@@ -0,0 +1,224 @@
+/*
+ * --- Module Description --------------------------------------------------- *
+ */
+/**
+ * \file    test_rf64.c
+ * \author  Artem Yushev
+ * \date    $Date$
+ * \version $Version$
+ *
+ * \brief   Conversion of an RF64 file with samples data over 4 GB. The file
+ *          is generated as a sparse file of silence in a temporary
+ *          directory, its sizes are given by the ds64 chunk only. The
+ *          output must cover the whole recording and the memory used must
+ *          not depend on its length.
+ *          Usage: test_rf64 <test directory>, the directory isn't used
+ */
+
+
+/*
+ * --- Includes ------------------------------------------------------------- *
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include "encoder.h"
+#include "os.h"
+#include "pool.h"
+#include "music.h"
+#include "util.h"
+
+/*
+ * --- Macro Definitions ---------------------------------------------------- *
+ */
+#define RF64_NAME           "rf64.wav"
+#define RF64_OUT            "rf64.mp3"
+/* 64-bit float stereo, the fewest frames to encode for the size */
+#define RF64_CHANNELS       2
+#define RF64_BITS           64
+#define RF64_RATE           48000
+#define RF64_FRAME          (RF64_CHANNELS * RF64_BITS / 8)
+/* Samples data over 4 GB, a 32-bit size would keep 16 MiB of it only */
+#define RF64_DATA           ((4ULL << 30) + (16ULL << 20))
+/* RF64, ds64 without a table, fmt and data headers */
+#define RF64_HEADER         (12 + 8 + 28 + 8 + 16 + 8)
+/* Any bitrate of MP3 gives more bytes per second of audio */
+#define RF64_MIN_RATE       1000
+/* Peak memory of the whole process: inputs are mapped in a window of two
+ * times MAX_PIPE_DEPTH blocks, see os_fRead(), the rest is for buffers */
+#define RF64_MAX_RSS_KB     ((2 * MAX_PIPE_DEPTH * MAX_BLOCK_SIZE >> 10) + 32 * 1024)
+
+/*
+ * --- Local Functions Declaration ------------------------------------------ *
+ */
+
+/**
+ * \brief     Store little-endian values
+ */
+static inline uint8_t* __put16le(uint8_t* p_buf, uint16_t val);
+static inline uint8_t* __put32le(uint8_t* p_buf, uint32_t val);
+static inline uint8_t* __put64le(uint8_t* p_buf, uint64_t val);
+
+/**
+ * \brief     Generate the RF64 file, samples data is a hole of zeros
+ *
+ * \param     p_path        Path of the file
+ * \return    Negative for failure, otherwise OK
+ */
+static int8_t __rf64Create(const char* p_path);
+
+/*
+ * --- Local Functions Definition ------------------------------------------- *
+ */
+static inline uint8_t* __put16le(uint8_t* p_buf, uint16_t val)
+{
+    p_buf[0] = val;
+    p_buf[1] = val >> 8;
+    return (p_buf + 2);
+}
+
+static inline uint8_t* __put32le(uint8_t* p_buf, uint32_t val)
+{
+    p_buf = __put16le(p_buf, val);
+    return (__put16le(p_buf, val >> 16));
+}
+
+static inline uint8_t* __put64le(uint8_t* p_buf, uint64_t val)
+{
+    p_buf = __put32le(p_buf, val);
+    return (__put32le(p_buf, val >> 32));
+}
+
+static int8_t __rf64Create(const char* p_path)
+{
+    uint8_t     p_hdr[RF64_HEADER];
+    uint8_t*    p = p_hdr;
+    int         fd = -1;
+    int8_t      ret = 0;
+
+    /* Sizes of RIFF and data are in ds64 */
+    memcpy(p, "RF64", 4);
+    p = __put32le(p + 4, 0xFFFFFFFF);
+    memcpy(p, "WAVE", 4);
+    p += 4;
+
+    memcpy(p, "ds64", 4);
+    p = __put32le(p + 4, 28);
+    p = __put64le(p, RF64_HEADER + RF64_DATA - 8);
+    p = __put64le(p, RF64_DATA);
+    p = __put64le(p, RF64_DATA / RF64_FRAME);
+    p = __put32le(p, 0);
+
+    memcpy(p, "fmt ", 4);
+    p = __put32le(p + 4, 16);
+    /* IEEE float */
+    p = __put16le(p, 3);
+    p = __put16le(p, RF64_CHANNELS);
+    p = __put32le(p, RF64_RATE);
+    p = __put32le(p, RF64_RATE * RF64_FRAME);
+    p = __put16le(p, RF64_FRAME);
+    p = __put16le(p, RF64_BITS);
+
+    memcpy(p, "data", 4);
+    p = __put32le(p + 4, 0xFFFFFFFF);
+
+    fd = open(p_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return (-1);
+    if ((write(fd, p_hdr, sizeof(p_hdr)) != sizeof(p_hdr)) ||
+        (ftruncate(fd, RF64_HEADER + RF64_DATA) != 0))
+        ret = -1;
+    close(fd);
+
+    return (ret);
+}
+
+/*
+ * --- Global Functions Definition ------------------------------------------ *
+ */
+
+int main(int argc, char* argv[])
+{
+    char            p_tmp[PATH_MAX];
+    char            p_path[PATH_MAX];
+    char            p_name[] = RF64_NAME;
+    st_encDir_t     dir;
+    st_encOpts_t    opts;
+    st_encFDesc_t   fdesc;
+    struct stat     st;
+    struct rusage   usage;
+    uint64_t        seconds = RF64_DATA / RF64_FRAME / RF64_RATE;
+    uint32_t        errs = 0;
+    int8_t          ret = 0;
+
+    os_splitFlopInit();
+
+    if (util_tempDir(p_tmp) < 0)
+    {
+        fprintf(stderr, "Failed to create a temporary directory\n");
+        return (1);
+    }
+    snprintf(p_path, sizeof(p_path), "%s/%s", p_tmp, RF64_NAME);
+    if ((__rf64Create(p_path) < 0) || (util_dirOpen(&dir, p_tmp, p_tmp) < 0))
+    {
+        fprintf(stderr, "Failed to generate %s\n", p_path);
+        util_tempRemove(p_tmp);
+        return (1);
+    }
+
+    /* The header is parsed by the conversion as for files not probed */
+    memset(&opts, 0, sizeof(opts));
+    memset(&fdesc, 0, sizeof(fdesc));
+    fdesc.p_fname = p_name;
+    fdesc.p_dir = &dir;
+    fdesc.fsize = RF64_HEADER + RF64_DATA;
+    fdesc.probe = en_probe_none;
+
+    music_workerEnter(0);
+    ret = music_procFile(&fdesc, &opts);
+    music_workerLeave(0);
+
+    if (ret < 0)
+    {
+        fprintf(stderr, "[%s] Conversion failed\n", RF64_NAME);
+        errs++;
+    }
+    if (fdesc.dataLength != RF64_DATA)
+    {
+        fprintf(stderr, "[%s] %llu bytes of samples instead of %llu\n", RF64_NAME,
+                (unsigned long long) fdesc.dataLength, (unsigned long long) RF64_DATA);
+        errs++;
+    }
+
+    memset(&st, 0, sizeof(st));
+    snprintf(p_path, sizeof(p_path), "%s/%s", p_tmp, RF64_OUT);
+    if ((stat(p_path, &st) != 0) || ((uint64_t) st.st_size < seconds * RF64_MIN_RATE))
+    {
+        fprintf(stderr, "[%s] Output of %lld bytes is short for %llu s\n", RF64_OUT,
+                (long long) st.st_size, (unsigned long long) seconds);
+        errs++;
+    }
+
+    getrusage(RUSAGE_SELF, &usage);
+    if (usage.ru_maxrss > RF64_MAX_RSS_KB)
+    {
+        fprintf(stderr, "[%s] Peak memory %ld kB is over %d kB\n", RF64_NAME,
+                usage.ru_maxrss, RF64_MAX_RSS_KB);
+        errs++;
+    }
+
+    util_dirClose(&dir);
+    util_tempRemove(p_tmp);
+
+    printf("RF64 of %llu bytes, %llu s, peak memory %ld kB: %s\n",
+           (unsigned long long) RF64_DATA, (unsigned long long) seconds,
+           usage.ru_maxrss, errs ? "FAILED" : "OK");
+    return (errs ? 1 : 0);
+}
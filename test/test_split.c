@@ -0,0 +1,254 @@
+/*
+ * --- Module Description --------------------------------------------------- *
+ */
+/**
+ * \file    test_split.c
+ * \author  Artem Yushev
+ * \date    $Date$
+ * \version $Version$
+ *
+ * \brief   Conformance of the sample converters. Every implementation of
+ *          os_splitFlop*() is checked against the plain C reference on the
+ *          samples of each file of the test directory, for all tail lengths
+ *          up to a few vectors and for unaligned input.
+ *          Usage: test_split <test directory>
+ */
+
+
+/*
+ * --- Includes ------------------------------------------------------------- *
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "encoder.h"
+#include "os.h"
+#include "util.h"
+
+/*
+ * --- Macro Definitions ---------------------------------------------------- *
+ */
+/* Tails up to this amount of frames are checked, it's more than the
+ * frames of several AVX2 iterations */
+#define SPLIT_TAIL          67
+/* The whole data is converted in blocks of this amount of frames */
+#define SPLIT_BLOCK         4096
+/* Output beyond the converted samples must stay untouched */
+#define SPLIT_CANARY        ((int32_t) 0x5A5A5A5A)
+#define SPLIT_GUARD         8
+
+/*
+ * --- Type Definitions ----------------------------------------------------- *
+ */
+
+/* Converter under test */
+typedef struct st_splitCase
+{
+    const char*     p_name;
+    os_splitFlop_t  p_fn;
+} st_splitCase_t;
+
+/*
+ * --- Local Functions Declaration ------------------------------------------ *
+ */
+
+/**
+ * \brief     Value of one sample as the scalar converters produce it:
+ *            unsigned 8 bits are centered, every sample gets to the upper
+ *            bits of 32
+ *
+ * \param     p_from        Sample
+ * \param     bps           Bytes per sample
+ * \return    Converted sample
+ */
+static int32_t __reference(const uint8_t* p_from, uint8_t bps);
+
+/**
+ * \brief     Convert frames with a converter and compare every channel
+ *            with the reference
+ *
+ * \param     p_case        Converter
+ * \param     p_wave        Format of the samples
+ * \param     p_from        Samples
+ * \param     frames        Amount of frames to convert
+ * \param     p_fir         First channel buffer, frames + SPLIT_GUARD long
+ * \param     p_sec         Second channel buffer, same length
+ * \return    Amount of mismatches
+ */
+static uint32_t __check(const st_splitCase_t* p_case, const st_utilWave_t* p_wave,
+                        uint8_t* p_from, uint32_t frames, int32_t* p_fir, int32_t* p_sec);
+
+/**
+ * \brief     Check all converters of a format on one file
+ *
+ * \param     p_name        Name of the file for the report
+ * \param     p_wave        Loaded file
+ * \return    Amount of mismatches
+ */
+static uint32_t __checkFile(const char* p_name, const st_utilWave_t* p_wave);
+
+/*
+ * --- Local Functions Definition ------------------------------------------- *
+ */
+static int32_t __reference(const uint8_t* p_from, uint8_t bps)
+{
+    uint32_t    val = 0;
+
+    if (bps == 1)
+        return ((p_from[0] ^ 0x80) << 24);
+
+    for (uint8_t i = 0; i < bps; i++)
+        val |= (uint32_t) p_from[i] << (8 * (4 - bps + i));
+
+    return ((int32_t) val);
+}
+
+static uint32_t __check(const st_splitCase_t* p_case, const st_utilWave_t* p_wave,
+                        uint8_t* p_from, uint32_t frames, int32_t* p_fir, int32_t* p_sec)
+{
+    uint8_t     bps = p_wave->bps;
+    uint8_t     stereo = (p_wave->channels == 2);
+    int32_t*    p_to[2] = { p_fir, p_sec };
+    int32_t     want = 0;
+    uint32_t    errs = 0;
+
+    for (uint32_t i = 0; i < frames + SPLIT_GUARD; i++)
+    {
+        p_fir[i] = SPLIT_CANARY;
+        p_sec[i] = SPLIT_CANARY;
+    }
+
+    p_case->p_fn(p_from, p_fir, stereo ? p_sec : NULL, frames * bps * p_wave->channels);
+
+    for (uint8_t ch = 0; ch < 2; ch++)
+    {
+        for (uint32_t i = 0; i < frames + SPLIT_GUARD; i++)
+        {
+            want = SPLIT_CANARY;
+            if ((i < frames) && (ch < p_wave->channels))
+                want = __reference(p_from + (i * p_wave->channels + ch) * bps, bps);
+            if ((p_to[ch][i] != want) && (errs++ == 0))
+                fprintf(stderr, "  %s: %lu frames, channel %u, sample %lu: "
+                        "0x%08x instead of 0x%08x\n", p_case->p_name, frames, ch, i,
+                        (uint32_t) p_to[ch][i], (uint32_t) want);
+        }
+    }
+
+    return (errs);
+}
+
+static uint32_t __checkFile(const char* p_name, const st_utilWave_t* p_wave)
+{
+    static const os_splitFlop_t generic[4] =
+    { os_splitFlopUI8, os_splitFlopI16, os_splitFlopI24, os_splitFlopI32 };
+    static const char* const names[en_split_impls] = { "scalar", "sse2", "avx2" };
+    st_splitCase_t  cases[en_split_impls + 2];
+    uint32_t        frameBytes = p_wave->bps * p_wave->channels;
+    uint32_t        frames = p_wave->len / frameBytes;
+    uint32_t        cnt = 0;
+    uint32_t        errs = 0;
+    uint32_t        block = 0;
+    uint8_t*        p_buf = NULL;
+    int32_t*        p_fir = NULL;
+    int32_t*        p_sec = NULL;
+
+    /* Every implementation the CPU has, the selected one, and the entry
+     * point which checks the channels on every call */
+    for (uint32_t impl = 0; impl < en_split_impls; impl++)
+    {
+        cases[cnt].p_name = names[impl];
+        cases[cnt].p_fn = os_splitFlopImpl(impl, p_wave->bps, p_wave->channels);
+        if (cases[cnt].p_fn != NULL)
+            cnt++;
+    }
+    cases[cnt].p_name = "selected";
+    cases[cnt++].p_fn = os_splitFlopGet(p_wave->bps, p_wave->channels);
+    cases[cnt].p_name = "generic";
+    cases[cnt++].p_fn = generic[p_wave->bps - 1];
+
+    p_buf = malloc(SPLIT_BLOCK * frameBytes + 4);
+    p_fir = malloc((SPLIT_BLOCK + SPLIT_GUARD) * sizeof(int32_t));
+    p_sec = malloc((SPLIT_BLOCK + SPLIT_GUARD) * sizeof(int32_t));
+    if ((p_buf == NULL) || (p_fir == NULL) || (p_sec == NULL))
+    {
+        fprintf(stderr, "[%s] Failed to allocate buffers\n", p_name);
+        errs = 1;
+    }
+
+    for (uint32_t c = 0; (errs == 0) && (c < cnt); c++)
+    {
+        /* Tails at any alignment of the input, the first mismatch of
+         * a file is reported only */
+        for (uint32_t shift = 0; (errs == 0) && (shift < 4); shift++)
+        {
+            memcpy(p_buf + shift, p_wave->p_data,
+                   ((frames < SPLIT_TAIL) ? frames : SPLIT_TAIL) * frameBytes);
+            for (uint32_t len = 0; (errs == 0) && (len <= SPLIT_TAIL) && (len <= frames); len++)
+                errs += __check(&cases[c], p_wave, p_buf + shift, len, p_fir, p_sec);
+        }
+
+        /* All samples of the file, the last block is a tail as well */
+        for (uint32_t off = 0; (errs == 0) && (off < frames); off += block)
+        {
+            block = ((frames - off) < SPLIT_BLOCK) ? (frames - off) : SPLIT_BLOCK;
+            memcpy(p_buf, p_wave->p_data + (uint64_t) off * frameBytes, block * frameBytes);
+            errs += __check(&cases[c], p_wave, p_buf, block, p_fir, p_sec);
+        }
+    }
+
+    printf("[%s] %lu bytes per sample, %u channels, %lu frames: %lu converters %s\n",
+           p_name, p_wave->bps, p_wave->channels, frames, cnt, errs ? "FAILED" : "OK");
+
+    free(p_buf);
+    free(p_fir);
+    free(p_sec);
+
+    return (errs);
+}
+
+/*
+ * --- Global Functions Definition ------------------------------------------ *
+ */
+
+int main(int argc, char* argv[])
+{
+    st_utilWave_t   wave;
+    char**          pp_names = NULL;
+    int32_t         files = 0;
+    uint32_t        errs = 0;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <test directory>\n", argv[0]);
+        return (2);
+    }
+
+    os_splitFlopInit();
+
+    files = util_waveList(argv[1], &pp_names);
+    if (files <= 0)
+    {
+        fprintf(stderr, "No WAVE files in %s\n", argv[1]);
+        return (2);
+    }
+
+    for (int32_t i = 0; i < files; i++)
+    {
+        if (util_waveLoad(argv[1], pp_names[i], &wave) < 0)
+        {
+            fprintf(stderr, "[%s] Failed to load\n", pp_names[i]);
+            errs++;
+            continue;
+        }
+        /* Float samples don't go through the converters */
+        if (!wave.isFloat && (wave.bps <= 4) && (wave.channels <= 2))
+            errs += __checkFile(pp_names[i], &wave);
+        util_waveFree(&wave);
+    }
+    util_listFree(pp_names, files);
+
+    printf("Converters: %s\n", errs ? "FAILED" : "OK");
+    return (errs ? 1 : 0);
+}
@@ -0,0 +1,243 @@
+/*
+ * --- Module Description --------------------------------------------------- *
+ */
+/**
+ * \file    util.c
+ * \author  Artem Yushev
+ * \date    $Date$
+ * \version $Version$
+ *
+ * \brief   Helpers shared by tests and benchmarks
+ */
+
+
+/*
+ * --- Includes ------------------------------------------------------------- *
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "encoder.h"
+#include "util.h"
+
+/*
+ * --- Macro Definitions ---------------------------------------------------- *
+ */
+#define UTIL_WAVE_PCM       0x0001
+#define UTIL_WAVE_FLOAT     0x0003
+#define UTIL_WAVE_EXT       0xFFFE
+
+/*
+ * --- Local Functions Declaration ------------------------------------------ *
+ */
+
+/**
+ * \brief     Read little-endian values
+ */
+static inline uint16_t __get16le(const uint8_t* p_buf);
+static inline uint32_t __get32le(const uint8_t* p_buf);
+
+/**
+ * \brief     Compare names for qsort()
+ */
+static int __nameCmp(const void* p_a, const void* p_b);
+
+/*
+ * --- Local Functions Definition ------------------------------------------- *
+ */
+static inline uint16_t __get16le(const uint8_t* p_buf)
+{
+    return (p_buf[0] | p_buf[1] << 8);
+}
+
+static inline uint32_t __get32le(const uint8_t* p_buf)
+{
+    return (p_buf[0] | p_buf[1] << 8 | p_buf[2] << 16 | (uint32_t) p_buf[3] << 24);
+}
+
+static int __nameCmp(const void* p_a, const void* p_b)
+{
+    return (strcmp(*(char* const*) p_a, *(char* const*) p_b));
+}
+
+/*
+ * --- Global Functions Definition ------------------------------------------ *
+ */
+
+int32_t util_waveList(const char* p_dir, char*** ppp_names)
+{
+    DIR*            p_d = opendir(p_dir);
+    struct dirent*  p_ent = NULL;
+    char**          pp_names = NULL;
+    char**          pp_grown = NULL;
+    const char*     p_ext = NULL;
+    int32_t         cnt = 0;
+
+    if (p_d == NULL)
+        return (-1);
+
+    while ((p_ent = readdir(p_d)) != NULL)
+    {
+        p_ext = strrchr(p_ent->d_name, '.');
+        if ((p_ext == NULL) || strcmp(p_ext, ".wav"))
+            continue;
+        pp_grown = realloc(pp_names, (cnt + 1) * sizeof(char*));
+        if (pp_grown == NULL)
+            break;
+        pp_names = pp_grown;
+        pp_names[cnt] = strdup(p_ent->d_name);
+        if (pp_names[cnt] == NULL)
+            break;
+        cnt++;
+    }
+    closedir(p_d);
+
+    qsort(pp_names, cnt, sizeof(char*), __nameCmp);
+    *ppp_names = pp_names;
+
+    return (cnt);
+}
+
+void util_listFree(char** pp_names, int32_t cnt)
+{
+    for (int32_t i = 0; i < cnt; i++)
+        free(pp_names[i]);
+    free(pp_names);
+}
+
+int8_t util_waveLoad(const char* p_dir, const char* p_name, st_utilWave_t* p_wave)
+{
+    char        p_path[PATH_MAX];
+    FILE*       p_fp = NULL;
+    struct stat st;
+    uint64_t    off = 12;
+    uint32_t    size = 0;
+    uint16_t    format = 0;
+    uint8_t*    p_chunk = NULL;
+
+    memset(p_wave, 0, sizeof(st_utilWave_t));
+    snprintf(p_path, sizeof(p_path), "%s/%s", p_dir, p_name);
+    p_fp = fopen(p_path, "rb");
+    if (p_fp == NULL)
+        return (-1);
+    if ((fstat(fileno(p_fp), &st) != 0) || (st.st_size < 12) ||
+        ((p_wave->p_file = malloc(st.st_size)) == NULL) ||
+        (fread(p_wave->p_file, 1, st.st_size, p_fp) != (size_t) st.st_size))
+    {
+        fclose(p_fp);
+        util_waveFree(p_wave);
+        return (-1);
+    }
+    fclose(p_fp);
+
+    /* Chunks are walked up to the samples, sizes are padded to words */
+    while ((off + 8) <= (uint64_t) st.st_size)
+    {
+        p_chunk = p_wave->p_file + off;
+        size = __get32le(p_chunk + 4);
+        if (!memcmp(p_chunk, "fmt ", 4) && ((off + 24) <= (uint64_t) st.st_size))
+        {
+            format = __get16le(p_chunk + 8);
+            if ((format == UTIL_WAVE_EXT) && ((off + 34) <= (uint64_t) st.st_size))
+                format = __get16le(p_chunk + 32);
+            p_wave->isFloat = (format == UTIL_WAVE_FLOAT);
+            p_wave->channels = __get16le(p_chunk + 10);
+            p_wave->sampleRate = __get32le(p_chunk + 12);
+            p_wave->bps = (__get16le(p_chunk + 22) + 7) >> 3;
+        }
+        else if (!memcmp(p_chunk, "data", 4))
+        {
+            p_wave->p_data = p_chunk + 8;
+            p_wave->len = st.st_size - off - 8;
+            if (size < p_wave->len)
+                p_wave->len = size;
+            break;
+        }
+        off += 8 + size + (size & 1);
+    }
+
+    if ((p_wave->p_data == NULL) || (p_wave->bps == 0) || (p_wave->channels == 0) ||
+        ((format != UTIL_WAVE_PCM) && (format != UTIL_WAVE_FLOAT)))
+    {
+        util_waveFree(p_wave);
+        return (-1);
+    }
+    /* Whole frames only */
+    p_wave->len -= p_wave->len % (p_wave->bps * p_wave->channels);
+
+    return (0);
+}
+
+void util_waveFree(st_utilWave_t* p_wave)
+{
+    free(p_wave->p_file);
+    memset(p_wave, 0, sizeof(st_utilWave_t));
+}
+
+int8_t util_dirOpen(st_encDir_t* p_dir, const char* p_in, const char* p_out)
+{
+    /* The root isn't held, its files are taken by their name within it */
+    memset(p_dir, 0, sizeof(st_encDir_t));
+    p_dir->fd = open(p_in, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    p_dir->outFd = open(p_out, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    atomic_init(&p_dir->refs, 1);
+    if ((p_dir->fd < 0) || (p_dir->outFd < 0))
+    {
+        util_dirClose(p_dir);
+        return (-1);
+    }
+
+    return (0);
+}
+
+void util_dirClose(st_encDir_t* p_dir)
+{
+    if (p_dir->fd >= 0)
+        close(p_dir->fd);
+    if (p_dir->outFd >= 0)
+        close(p_dir->outFd);
+    p_dir->fd = -1;
+    p_dir->outFd = -1;
+}
+
+int8_t util_tempDir(char* p_path)
+{
+    const char* p_tmp = getenv("TMPDIR");
+
+    snprintf(p_path, PATH_MAX, "%s/encoder.XXXXXX", (p_tmp != NULL) ? p_tmp : "/tmp");
+    return ((mkdtemp(p_path) != NULL) ? 0 : -1);
+}
+
+void util_tempRemove(const char* p_path)
+{
+    char            p_file[PATH_MAX];
+    DIR*            p_d = opendir(p_path);
+    struct dirent*  p_ent = NULL;
+
+    while ((p_d != NULL) && ((p_ent = readdir(p_d)) != NULL))
+    {
+        if (!strcmp(p_ent->d_name, ".") || !strcmp(p_ent->d_name, ".."))
+            continue;
+        snprintf(p_file, sizeof(p_file), "%s/%s", p_path, p_ent->d_name);
+        unlink(p_file);
+    }
+    if (p_d != NULL)
+        closedir(p_d);
+    rmdir(p_path);
+}
+
+uint64_t util_nsec(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec);
+}
@@ -0,0 +1,95 @@
+/*
+ * --- Module Description --------------------------------------------------- *
+ */
+/**
+ * \file    util.h
+ * \author  Artem Yushev
+ * \date    $Date$
+ * \version $Version$
+ *
+ * \brief   Helpers shared by tests and benchmarks: WAVE files of the test
+ *          directory, directories to convert files in and a clock
+ */
+
+#ifndef UTIL_H_
+#define UTIL_H_
+
+/*
+ * --- Type Definitions ----------------------------------------------------- *
+ */
+
+/* WAVE file loaded into memory */
+typedef struct st_utilWave
+{
+    uint8_t*        p_file;
+    /* Samples data within the file */
+    uint8_t*        p_data;
+    uint64_t        len;
+    /* Bytes per sample */
+    uint8_t         bps;
+    uint8_t         isFloat;
+    uint16_t        channels;
+    uint32_t        sampleRate;
+} st_utilWave_t;
+
+/*
+ * --- Global Functions Declaration ----------------------------------------- *
+ */
+
+/**
+ * \brief     List WAVE files of a directory in the order of names
+ *
+ * \param     p_dir         Directory
+ * \param     ppp_names     Where to store the names, freed by util_listFree()
+ * \return    Amount of files, negative for failure
+ */
+int32_t util_waveList(const char* p_dir, char*** ppp_names);
+void util_listFree(char** pp_names, int32_t cnt);
+
+/**
+ * \brief     Load a WAVE file and find its format and samples
+ *
+ * \param     p_dir         Directory of the file
+ * \param     p_name        Name of the file
+ * \param     p_wave        Where to store the file, freed by util_waveFree()
+ * \return    Negative for failure, otherwise OK
+ */
+int8_t util_waveLoad(const char* p_dir, const char* p_name, st_utilWave_t* p_wave);
+void util_waveFree(st_utilWave_t* p_wave);
+
+/**
+ * \brief     Describe a directory for music_procFile(), outputs of its files
+ *            are written to another directory
+ *
+ * \param     p_dir         Directory to initialize
+ * \param     p_in          Path of the directory of inputs
+ * \param     p_out         Path of the directory of outputs
+ * \return    Negative for failure, otherwise OK
+ */
+int8_t util_dirOpen(st_encDir_t* p_dir, const char* p_in, const char* p_out);
+void util_dirClose(st_encDir_t* p_dir);
+
+/**
+ * \brief     Create a temporary directory
+ *
+ * \param     p_path        String where to store the path, PATH_MAX long
+ * \return    Negative for failure, otherwise OK
+ */
+int8_t util_tempDir(char* p_path);
+
+/**
+ * \brief     Remove a directory with the files in it
+ *
+ * \param     p_path        Path of the directory
+ * \return    Nothing
+ */
+void util_tempRemove(const char* p_path);
+
+/**
+ * \brief     Monotonic clock
+ *
+ * \return    Nanoseconds
+ */
+uint64_t util_nsec(void);
+
+#endif /* UTIL_H_ */